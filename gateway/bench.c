@@ -0,0 +1,291 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_tcp.h>
+#include <rte_common.h>
+#include <rte_malloc.h>
+#include <rte_debug.h>
+
+#include "main.h"
+
+/*
+ * Offline benchmark of the data path. With --bench SECONDS the gateway
+ * runs that long, then prints the rates of each nf core and exits.
+ *
+ * The packets the nf queues receive are rewritten by an rx callback into
+ * a synthetic TCP trace, so a net_null or net_ring vdev is all it needs.
+ * Each nf core sends bench_flows flows round robin, a flow starting with
+ * its SYN, and replaces bench_new_flow_rate flows per second with new
+ * ones. With --bench-replay the packets are kept as received, e.g. a
+ * trace replayed by net_pcap.
+ */
+
+uint32_t bench_seconds;
+uint8_t bench_replay;
+uint32_t bench_flows = BENCH_FLOWS_DEFAULT;
+uint32_t bench_new_flow_rate;
+
+/* packet sizes (with the ethernet header) the trace cycles through */
+static uint16_t bench_sizes[BENCH_SIZES_MAX];
+static uint16_t nb_bench_sizes;
+
+/* clients of nf core n are 11.0.0.0 + (n << 18) + slot, on one service */
+#define BENCH_CLIENT_NET IPv4(11, 0, 0, 0)
+#define BENCH_SERVICE_IP IPv4(10, 10, 0, 1)
+#define BENCH_SERVICE_PORT 80
+
+struct bench_flow {
+    uint16_t gen; /* a new flow in the slot takes the next source port */
+    uint8_t opened; /* its SYN was sent */
+};
+
+/* Synthetic trace of one nf rx queue, only touched by its nf core */
+struct bench_gen {
+    uint32_t client_base;
+    uint32_t next; /* slot of the next packet */
+    uint32_t next_new; /* slot of the next new flow */
+    uint16_t next_size;
+    uint64_t credit; /* tsc the new flow rate still allows to spend */
+    uint64_t last_tsc;
+    struct bench_flow *flows;
+} __rte_cache_aligned;
+
+static struct bench_gen bench_gens[NF_CORE_MAX];
+
+static uint64_t bench_start_tsc;
+static uint64_t bench_start_stats[NF_CORE_MAX][GW_STAT_COUNT];
+
+/* Parse a packet size mix, SIZE[:WEIGHT] separated by commas */
+int
+bench_parse_sizes(const char *list)
+{
+    const char *p = list;
+    unsigned size, weight;
+    int n;
+
+    nb_bench_sizes = 0;
+    while (*p != '\0') {
+        weight = 1;
+        if (sscanf(p, "%u%n", &size, &n) != 1 ||
+            size < ETHER_MIN_LEN - ETHER_CRC_LEN ||
+            size > ETHER_MAX_LEN - ETHER_CRC_LEN)
+            return -1;
+        p += n;
+        if (*p == ':') {
+            if (sscanf(p + 1, "%u%n", &weight, &n) != 1 || weight == 0)
+                return -1;
+            p += n + 1;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+        if (nb_bench_sizes + weight > BENCH_SIZES_MAX)
+            return -1;
+        while (weight-- > 0)
+            bench_sizes[nb_bench_sizes++] = size;
+    }
+    return nb_bench_sizes > 0 ? 0 : -1;
+}
+
+/* Write the next packet of the trace into m */
+static inline void
+bench_fill(struct bench_gen *g, struct rte_mbuf *m, uint8_t port)
+{
+    struct bench_flow *f = &g->flows[g->next];
+    const uint16_t size = bench_sizes[g->next_size];
+    struct ether_hdr *eth_h;
+    struct ipv4_hdr *ip_h;
+    struct tcp_hdr *tcp_h;
+
+    eth_h = rte_pktmbuf_mtod(m, struct ether_hdr *);
+    ip_h = (struct ipv4_hdr *)(eth_h + 1);
+    tcp_h = (struct tcp_hdr *)(ip_h + 1);
+
+    memset(&eth_h->d_addr, 0, sizeof(eth_h->d_addr));
+    memset(&eth_h->s_addr, 0, sizeof(eth_h->s_addr));
+    eth_h->s_addr.addr_bytes[0] = 0x02;
+    eth_h->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+    memset(ip_h, 0, sizeof(*ip_h));
+    ip_h->version_ihl = (4 << 4) | 5;
+    ip_h->total_length = rte_cpu_to_be_16(size - sizeof(struct ether_hdr));
+    ip_h->time_to_live = 64;
+    ip_h->next_proto_id = IP_PROTO_TCP;
+    ip_h->src_addr = rte_cpu_to_be_32(g->client_base + g->next);
+    ip_h->dst_addr = rte_cpu_to_be_32(BENCH_SERVICE_IP);
+    ip_h->hdr_checksum = rte_ipv4_cksum(ip_h);
+
+    memset(tcp_h, 0, sizeof(*tcp_h));
+    tcp_h->src_port = rte_cpu_to_be_16(1024 + f->gen % 64000);
+    tcp_h->dst_port = rte_cpu_to_be_16(BENCH_SERVICE_PORT);
+    tcp_h->data_off = (sizeof(*tcp_h) / 4) << 4;
+    tcp_h->rx_win = rte_cpu_to_be_16(0xFFFF);
+    tcp_h->tcp_flags = f->opened ? TCP_FLAG_ACK : TCP_FLAG_SYN;
+    f->opened = 1;
+
+    m->data_len = size;
+    m->pkt_len = size;
+    m->nb_segs = 1;
+    m->ol_flags = 0;
+    m->port = port;
+
+    if (++g->next == bench_flows)
+        g->next = 0;
+    if (++g->next_size == nb_bench_sizes)
+        g->next_size = 0;
+}
+
+/* Replace the flows the new flow rate allows since the last burst */
+static inline void
+bench_new_flows(struct bench_gen *g)
+{
+    const uint64_t cost = rte_get_tsc_hz() / bench_new_flow_rate;
+    const uint64_t cur_tsc = rte_rdtsc();
+
+    g->credit += cur_tsc - g->last_tsc;
+    g->last_tsc = cur_tsc;
+    /* an idle core does not save up more than one burst of flows */
+    if (g->credit > cost * BURST_SIZE)
+        g->credit = cost * BURST_SIZE;
+    while (g->credit >= cost) {
+        g->credit -= cost;
+        g->flows[g->next_new].gen++;
+        g->flows[g->next_new].opened = 0;
+        if (++g->next_new == bench_flows)
+            g->next_new = 0;
+    }
+}
+
+static uint16_t
+bench_rx_cb(uint8_t port, __rte_unused uint16_t queue,
+            struct rte_mbuf *pkts[], uint16_t nb_pkts,
+            __rte_unused uint16_t max_pkts, void *user_param)
+{
+    struct bench_gen *g = user_param;
+    uint16_t i;
+
+    if (bench_new_flow_rate != 0)
+        bench_new_flows(g);
+    for (i = 0; i < nb_pkts; i++)
+        bench_fill(g, pkts[i], port);
+    return nb_pkts;
+}
+
+/* The synthetic trace has no control messages */
+static uint16_t
+bench_drop_cb(__rte_unused uint8_t port, __rte_unused uint16_t queue,
+              struct rte_mbuf *pkts[], uint16_t nb_pkts,
+              __rte_unused uint16_t max_pkts, __rte_unused void *user_param)
+{
+    uint16_t i;
+
+    for (i = 0; i < nb_pkts; i++)
+        rte_pktmbuf_free(pkts[i]);
+    return 0;
+}
+
+/* Install the synthetic trace on the rx queues of port, after port_init() */
+void
+bench_setup(uint8_t port)
+{
+    struct bench_gen *g;
+    int i;
+
+    if (bench_seconds == 0 || bench_replay)
+        return;
+    if (nb_bench_sizes == 0 && bench_parse_sizes(BENCH_SIZES_DEFAULT) < 0)
+        rte_exit(EXIT_FAILURE, "Invalid benchmark packet sizes\n");
+    FOR_EACH_NF_CORE {
+        g = &bench_gens[i];
+        if (g->flows == NULL) {
+            g->flows = rte_zmalloc_socket("bench_flows",
+                bench_flows * sizeof(struct bench_flow), RTE_CACHE_LINE_SIZE,
+                rte_lcore_to_socket_id(nf_insts[i].lcore_id));
+            if (g->flows == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot allocate benchmark flows\n");
+            g->client_base = BENCH_CLIENT_NET + ((uint32_t)i << 18);
+        }
+        if (rte_eth_add_rx_callback(port, nf_insts[i].rx_queue_id,
+                                    bench_rx_cb, g) == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot add benchmark rx callback\n");
+    }
+    if (rte_eth_add_rx_callback(port, MANAGER_RX_QUEUE,
+                                bench_drop_cb, NULL) == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot add benchmark rx callback\n");
+}
+
+/* Start the clock, the lcores are launched right after */
+void
+bench_start(void)
+{
+    unsigned lcore_id;
+    int i;
+
+    if (bench_seconds == 0)
+        return;
+    FOR_EACH_NF_CORE {
+        lcore_id = nf_insts[i].lcore_id;
+        memcpy(bench_start_stats[i], lcore_stats[lcore_id].c,
+               sizeof(bench_start_stats[i]));
+        bench_gens[i].last_tsc = rte_rdtsc();
+    }
+    bench_start_tsc = rte_rdtsc();
+    printf("bench: %u s, %s, %u flows per nf core, %u new flows/s,"
+           " %u packet sizes\n", bench_seconds,
+           bench_replay ? "received packets" : "synthetic trace",
+           bench_flows, bench_new_flow_rate, nb_bench_sizes);
+    /* SIGALRM sets force_quit */
+    alarm(bench_seconds);
+}
+
+static void
+bench_print(const char *name, const uint64_t *c, double secs)
+{
+    const uint64_t rx = c[GW_STAT_NF_RX_PKTS];
+
+    printf("bench: %s rx_mpps=%.3f tx_mpps=%.3f cycles_per_pkt=%.1f"
+           " flows_per_sec=%.0f misses_per_sec=%.0f pulls_per_sec=%.0f"
+           " dropped=%"PRIu64" malicious=%"PRIu64"\n",
+           name, rx / secs / 1e6, c[GW_STAT_NF_TX_PKTS] / secs / 1e6,
+           rx != 0 ? (double)c[GW_STAT_NF_CYCLES] / rx : 0.0,
+           c[GW_STAT_FLOWS] / secs, c[GW_STAT_STATE_MISSES] / secs,
+           c[GW_STAT_STATE_PULLS] / secs, c[GW_STAT_NF_DROPPED_PKTS],
+           c[GW_STAT_MALICIOUS_PKTS]);
+}
+
+/* Print the rates of the run, once every lcore returned */
+void
+bench_report(void)
+{
+    uint64_t delta[GW_STAT_COUNT], total[GW_STAT_COUNT] = {0};
+    char name[16];
+    double secs;
+    int i, s;
+
+    if (bench_seconds == 0)
+        return;
+    secs = (double)(rte_rdtsc() - bench_start_tsc) / rte_get_tsc_hz();
+    printf("\nbench: %.2f s\n", secs);
+    FOR_EACH_NF_CORE {
+        const uint64_t *c = lcore_stats[nf_insts[i].lcore_id].c;
+        for (s = 0; s < GW_STAT_COUNT; s++) {
+            delta[s] = c[s] - bench_start_stats[i][s];
+            total[s] += delta[s];
+        }
+        snprintf(name, sizeof(name), "nf%d", i);
+        bench_print(name, delta, secs);
+    }
+    bench_print("total", total, secs);
+}
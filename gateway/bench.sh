@@ -0,0 +1,3 @@
+#!/bin/bash
+# Benchmark the data path without a NIC, over a net_null port
+make && ./build/gateway -l 0-4 -n 1 --no-huge -m 2048 --no-pci --vdev net_null0 --file-prefix gwbench -- -p 0x1 --bench ${BENCH_SECONDS:-10} --bench-flows ${BENCH_FLOWS:-65536} --bench-new-flows ${BENCH_NEW_FLOWS:-10000} --bench-sizes ${BENCH_SIZES:-64:7,576:4,1500:1} "$@"
@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
 #include <getopt.h>
+#include <arpa/inet.h>
 
 #include <rte_eal.h>
 #include <rte_ethdev.h>
@@ -16,6 +18,8 @@
 #include <rte_udp.h>
 #include <rte_hash.h>
 #include <rte_errno.h>
+#include <rte_malloc.h>
+#include <rte_flow.h>
 
 #include "main.h"
 
@@ -33,107 +37,11 @@ static const struct rte_eth_conf port_conf_default = {
             // .rss_hf = I40E_FILTER_PCTYPE_NONF_IPV4_TCP,
         }
     },
-    // .fdir_conf = {
-    //     .mode = RTE_FDIR_MODE_PERFECT,
-    //     .pballoc = RTE_FDIR_PBALLOC_64K,
-    //     .status = RTE_FDIR_REPORT_STATUS,
-    //     .mask = {
-    //         .vlan_tci_mask = 0x0,
-    //         .ipv4_mask = {
-    //             // .src_ip = 0x0000FFFF,
-    //             .dst_ip = 0x0000FFFF,
-    //         },
-    //         // .ipv6_mask = {
-    //             // .src_ip = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF},
-    //             // .dst_ip = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF},
-    //         // },
-    //         // .src_port_mask = 0xFFFF,
-    //         // .dst_port_mask = 0xFFFF,
-    //         // .mac_addr_byte_mask = 0xFF,
-    //         // .tunnel_type_mask = 1,
-    //         // .tunnel_id_mask = 0xFFFFFFFF,
-    //     },
-    //     .drop_queue = 127,
-    // },
 };
 
-static struct rte_eth_fdir_filter fdir_filter_state = {
-    .soft_id = 1,
-    .input = {
-        .flow_type = RTE_ETH_FLOW_NONFRAG_IPV4_OTHER,
-        .flow = {
-            .ip4_flow = {
-                // .dst_ip = 0x000010AC,
-                .dst_ip = IPv4(0, 0, 16, 172),
-            }
-        }
-    },
-    .action = {
-        .rx_queue = 1,
-        .behavior = RTE_ETH_FDIR_ACCEPT,
-        .report_status = RTE_ETH_FDIR_REPORT_ID,
-    }
-};
-
-static struct rte_eth_fdir_filter fdir_filter_ecmp_tcp = {
-    .soft_id = 2,
-    .input = {
-        .flow_type = RTE_ETH_FLOW_NONFRAG_IPV4_TCP,
-        .flow = {
-            .tcp4_flow = {
-                .ip = {
-                    // .src_ip = 0x0000000A,
-                    .dst_ip = IPv4(0, 0, 16, 172),
-                },
-                // .src_port = rte_cpu_to_be_16(1024),
-                // .dst_port = rte_cpu_to_be_16(1024),
-            }
-        }
-    },
-    .action = {
-        .rx_queue = 1,
-        .behavior = RTE_ETH_FDIR_ACCEPT,
-        .report_status = RTE_ETH_FDIR_REPORT_ID,
-    }
-};
-
-static struct rte_eth_fdir_filter fdir_filter_ecmp_udp = {
-    .soft_id = 3,
-    .input = {
-        .flow_type = RTE_ETH_FLOW_NONFRAG_IPV4_UDP,
-        .flow = {
-            .udp4_flow = {
-                .ip = {
-                    // .src_ip = 0x0000000A,
-                    .dst_ip = IPv4(0, 0, 16, 172),
-                },
-                // .src_port = rte_cpu_to_be_16(1024),
-                // .dst_port = rte_cpu_to_be_16(1024),
-            }
-        }
-    },
-    .action = {
-        .rx_queue = 1,
-        .behavior = RTE_ETH_FDIR_ACCEPT,
-        .report_status = RTE_ETH_FDIR_REPORT_ID,
-    }
-};
-
-static struct rte_eth_fdir_filter fdir_filter_arp = {
-    .soft_id = 4,
-    .input = {
-        .flow_type = RTE_ETH_FLOW_RAW,
-        .flow = {
-            .l2_flow = {
-                .ether_type = 0x0608,
-            }
-        }
-    },
-    .action = {
-        .rx_queue = 1,
-        .behavior = RTE_ETH_FDIR_ACCEPT,
-        .report_status = RTE_ETH_FDIR_REPORT_ID,
-    }
+/* IP protocols of the control messages, see lcore_manager() */
+static const uint8_t ctrl_protos[] = {
+    IP_PROTO_TCP, IP_PROTO_UDP, 0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5,
 };
 
 //configurations
@@ -146,13 +54,33 @@ uint32_t dip_pool[DIP_POOL_SIZE] = {
 };
 
 
-struct rte_ring* nf_manager_ring;
-struct rte_ring* nf_pull_wait_ring;
+struct rte_ring* nf_manager_ring[NF_CORE_MAX];
+struct rte_ring* nf_manager_ring6[NF_CORE_MAX];
+struct rte_ring* nf_ctrl_ring[NF_CORE_MAX];
+struct rte_mempool* pull_reply_pool;
+struct rte_mempool* flow_req_pool;
+struct rte_ring* nf_pull_wait_ring[NF_CORE_MAX];
 
 struct port_param single_port_param;
+uint64_t port_tx_cksum_flags[RTE_MAX_ETHPORTS];
 
 int enabled_port_mask = 0;
 
+uint8_t keyset_compact = 0;
+uint8_t print_stats = 0;
+uint32_t migrate_rate = MIGRATE_RATE_DEFAULT;
+uint8_t migrate_on_start = 0;
+uint8_t syn_cookies = 0;
+uint32_t syn_cookie_rate = 0;
+
+uint16_t nb_nf_cores = 0; /* 0: every lcore left */
+unsigned manager_core = MANAGER_CORE_DEFAULT;
+unsigned manager_slave_core = MANAGER_SLAVE_CORE_DEFAULT;
+struct nf_inst_info *nf_insts;
+int16_t lcore_nf_map[RTE_MAX_LCORE];
+uint32_t flow_entries = HASH_ENTRIES;
+uint32_t flow_entries6 = HASH_ENTRIES6;
+
 static struct rte_eth_rss_reta_entry64 reta_conf[RSS_RETA_COUNT];
 
 static uint32_t manager_rx_queue_mask = 0x2;
@@ -201,63 +129,199 @@ ipv4_hash_crc(const void *data, __rte_unused uint32_t data_len,
     return init_val;
 }
 
+static inline uint32_t
+ipv6_hash_crc(const void *data, __rte_unused uint32_t data_len,
+              uint32_t init_val)
+{
+    const union ipv6_5tuple_host *k;
+    uint32_t t;
+    const uint32_t *p;
+    k = data;
+    t = k->proto;
+    p = (const uint32_t *)&k->port_src;
+
+    #ifdef EM_HASH_CRC
+    const uint64_t *ip_src = (const uint64_t *)k->ip_src;
+    const uint64_t *ip_dst = (const uint64_t *)k->ip_dst;
+    init_val = rte_hash_crc_4byte(t, init_val);
+    init_val = rte_hash_crc_8byte(ip_src[0], init_val);
+    init_val = rte_hash_crc_8byte(ip_src[1], init_val);
+    init_val = rte_hash_crc_8byte(ip_dst[0], init_val);
+    init_val = rte_hash_crc_8byte(ip_dst[1], init_val);
+    init_val = rte_hash_crc_4byte(*p, init_val);
+    #else
+    init_val = rte_jhash_1word(t, init_val);
+    init_val = rte_jhash(k->ip_src, IPV6_ADDR_LEN, init_val);
+    init_val = rte_jhash(k->ip_dst, IPV6_ADDR_LEN, init_val);
+    init_val = rte_jhash_1word(*p, init_val);
+    #endif
+    return init_val;
+}
+
+/*
+ * Create the state table of a socket. The nf cores of the socket and the
+ * manager (if it runs there) share it, so the memory does not grow with
+ * the number of nf cores.
+ */
 void
-setup_hash(const int lcore, const unsigned hash_table_index)
+setup_hash(const int socketid)
 {
-    int socketid = lcore % CPU_SOCKET_COUNT;
+    struct state_table *t = &state_tables[socketid];
     struct rte_hash_parameters hash_params = {
         .name = NULL,
-        .entries = HASH_ENTRIES,
+        .entries = flow_entries,
         .key_len = sizeof(union ipv4_5tuple_host),
         .hash_func = ipv4_hash_crc,
         .hash_func_init_val = 0,
     };
     char s[64];
-    snprintf(s, sizeof(s), "ipv4_state_hash_%d", hash_table_index);
+    snprintf(s, sizeof(s), "ipv4_state_hash_%d", socketid);
     hash_params.name = s;
     hash_params.socket_id = socketid;
     // hash_params.extra_flag = 0x06;
     rte_errno = 0;
-    state_hash_table[hash_table_index] =
-        rte_hash_create(&hash_params);
-    
+    t->hash = rte_hash_create(&hash_params);
 
-    if (state_hash_table[hash_table_index] == NULL){
+    if (t->hash == NULL){
         rte_exit(EXIT_FAILURE,
             "Unable to create the state_hash on socket %d - %s\n",
             socketid, rte_strerror(rte_errno));
     }
+    /* Values live in arrays indexed by key position, see setStates() */
+    t->states = rte_zmalloc_socket("flow_states",
+        flow_entries * sizeof(struct nf_states), RTE_CACHE_LINE_SIZE, socketid);
+    if (t->states == NULL){
+        rte_exit(EXIT_FAILURE,
+            "Unable to allocate the state values on socket %d\n",
+            socketid);
+    }
+    rte_spinlock_init(&t->lock);
+    t->seq = 0;
+    printf("setup hash_table for state %s\n", s);
 
-    struct rte_hash_parameters hash_paramss = {
+    /* The IPv6 table of the socket, keyed by union ipv6_5tuple_host */
+    t = &state_tables6[socketid];
+    hash_params.entries = flow_entries6;
+    hash_params.key_len = sizeof(union ipv6_5tuple_host);
+    hash_params.hash_func = ipv6_hash_crc;
+    snprintf(s, sizeof(s), "ipv6_state_hash_%d", socketid);
+    rte_errno = 0;
+    t->hash = rte_hash_create(&hash_params);
+
+    if (t->hash == NULL){
+        rte_exit(EXIT_FAILURE,
+            "Unable to create the IPv6 state_hash on socket %d - %s\n",
+            socketid, rte_strerror(rte_errno));
+    }
+    t->states = rte_zmalloc_socket("flow_states6",
+        flow_entries6 * sizeof(struct nf_states), RTE_CACHE_LINE_SIZE, socketid);
+    if (t->states == NULL){
+        rte_exit(EXIT_FAILURE,
+            "Unable to allocate the IPv6 state values on socket %d\n",
+            socketid);
+    }
+    rte_spinlock_init(&t->lock);
+    t->seq = 0;
+    printf("setup hash_table for state %s\n", s);
+}
+
+/*
+ * Create the IPv6 index table. It is an rte_hash in both index table
+ * builds: few flows are IPv6 next to the IPv4 ones EFD is meant for.
+ */
+static void
+setup_index_hash6(const int socketid)
+{
+    struct rte_hash_parameters hash_params = {
+        .name = "ipv6_index_hash",
+        .entries = flow_entries6,
+        .key_len = sizeof(union ipv6_5tuple_host),
+        .hash_func = ipv6_hash_crc,
+        .hash_func_init_val = 0,
+        .socket_id = socketid,
+    };
+    rte_errno = 0;
+    index_hash_table6 = rte_hash_create(&hash_params);
+
+    if (index_hash_table6 == NULL){
+        rte_exit(EXIT_FAILURE,
+            "Unable to create the IPv6 index_hash on socket %d - %s\n",
+            socketid, rte_strerror(rte_errno));
+    }
+    flow_indexs6 = rte_zmalloc_socket("flow_indexs6",
+        flow_entries6 * sizeof(struct nf_indexs), RTE_CACHE_LINE_SIZE, socketid);
+    if (flow_indexs6 == NULL){
+        rte_exit(EXIT_FAILURE,
+            "Unable to allocate the IPv6 index values on socket %d\n",
+            socketid);
+    }
+    printf("setup hash_table for index %s\n", hash_params.name);
+}
+
+/*
+ * Create the index table, shared by the manager (its only writer) and
+ * all nf cores, which only read it when a state is missing.
+ */
+void
+setup_index_hash(const int socketid)
+{
+#ifdef INDEX_TABLE_EFD
+    /* lookups come from every socket with an lcore, updates from ours */
+    uint8_t online_sockets = 0;
+    unsigned lcore_id;
+    RTE_LCORE_FOREACH(lcore_id) {
+        online_sockets |= 1 << rte_lcore_to_socket_id(lcore_id);
+    }
+    rte_errno = 0;
+    index_efd_table = rte_efd_create("ipv4_index_efd", flow_entries,
+        sizeof(union ipv4_5tuple_host), online_sockets, socketid);
+
+    if (index_efd_table == NULL){
+        rte_exit(EXIT_FAILURE,
+            "Unable to create the index_efd on socket %d - %s\n",
+            socketid, rte_strerror(rte_errno));
+    }
+    printf("setup efd_table for index ipv4_index_efd\n");
+#else
+    struct rte_hash_parameters hash_params = {
         .name = NULL,
-        .entries = HASH_ENTRIES,
+        .entries = flow_entries,
         .key_len = sizeof(union ipv4_5tuple_host),
         .hash_func = ipv4_hash_crc,
         .hash_func_init_val = 0,
     };
-    char ss[64];
-    snprintf(ss, sizeof(ss), "ipv4_index_hash_%d", hash_table_index);
-    hash_paramss.name = ss;
-    hash_paramss.socket_id = socketid;
-    // hash_paramss.extra_flag = 0x06;
+    char s[64];
+    snprintf(s, sizeof(s), "ipv4_index_hash");
+    hash_params.name = s;
+    hash_params.socket_id = socketid;
+    // hash_params.extra_flag = 0x06;
     rte_errno = 0;
-    index_hash_table[hash_table_index] =
-        rte_hash_create(&hash_paramss);
+    index_hash_table = rte_hash_create(&hash_params);
 
-    if (index_hash_table[hash_table_index] == NULL){
+    if (index_hash_table == NULL){
         rte_exit(EXIT_FAILURE,
             "Unable to create the index_hash on socket %d - %s\n",
             socketid, rte_strerror(rte_errno));
     }
-    printf("setup hash_table for state and index %s\n", s);
+    /* Values live in arrays indexed by key position, see setIndexs() */
+    flow_indexs = rte_zmalloc_socket("flow_indexs",
+        flow_entries * sizeof(struct nf_indexs), RTE_CACHE_LINE_SIZE, socketid);
+    if (flow_indexs == NULL){
+        rte_exit(EXIT_FAILURE,
+            "Unable to allocate the index values on socket %d\n",
+            socketid);
+    }
+    printf("setup hash_table for index %s\n", s);
+#endif
+    setup_index_hash6(socketid);
 }
 
 static inline int
-rss_hash_set(uint32_t nb_nf_lcore, uint8_t port)
+rss_hash_set(uint32_t nb_nf_lcore, uint8_t port, uint16_t reta_size)
 {
     unsigned int idx, i, j = 0;
     int retval;
-    for (idx = 0; idx < RSS_RETA_COUNT ; idx++) {
+    for (idx = 0; idx < reta_size / RTE_RETA_GROUP_SIZE; idx++) {
         reta_conf[idx].mask = ~0ULL;
         for (i = 0; i < RTE_RETA_GROUP_SIZE; i++, j++) {
             if (j == nb_nf_lcore)
@@ -265,17 +329,79 @@ rss_hash_set(uint32_t nb_nf_lcore, uint8_t port)
             reta_conf[idx].reta[i] = j;
         }
     }
-    retval = rte_eth_dev_rss_reta_update(port, reta_conf, RSS_RETA_SIZE);
+    retval = rte_eth_dev_rss_reta_update(port, reta_conf, reta_size);
     return retval;
 }
 
+/* Install a rule sending the packets of pattern to the manager queue */
+static struct rte_flow*
+ctrl_flow_create(uint8_t port, const struct rte_flow_item* pattern)
+{
+    const struct rte_flow_attr attr = { .ingress = 1 };
+    const struct rte_flow_action_queue queue = { .index = MANAGER_RX_QUEUE };
+    const struct rte_flow_action actions[] = {
+        { .type = RTE_FLOW_ACTION_TYPE_QUEUE, .conf = &queue },
+        { .type = RTE_FLOW_ACTION_TYPE_END },
+    };
+    struct rte_flow_error error;
+
+    if (rte_flow_validate(port, &attr, pattern, actions, &error) != 0)
+        return NULL;
+    return rte_flow_create(port, &attr, pattern, actions, &error);
+}
+
 /*
- * Initializes a given port using global settings and with the RX buffers
- * coming from the mbuf_pool passed as a parameter.
+ * Steer the control messages and ARP to the manager queue. What a port
+ * cannot match still reaches the nf cores, which pass control messages
+ * on through nf_ctrl_ring and answer ARP themselves.
+ */
+static void
+ctrl_flow_setup(uint8_t port)
+{
+    struct rte_flow_item_eth eth_spec, eth_mask;
+    struct rte_flow_item_ipv4 ip_spec, ip_mask;
+    struct rte_flow_item pattern[3];
+    unsigned k, nb_steered = 0;
+
+    memset(&ip_spec, 0, sizeof(ip_spec));
+    memset(&ip_mask, 0, sizeof(ip_mask));
+    ip_spec.hdr.dst_addr = rte_cpu_to_be_32(CTRL_NET);
+    ip_mask.hdr.dst_addr = rte_cpu_to_be_32(CTRL_NET_MASK);
+    ip_mask.hdr.next_proto_id = 0xFF;
+    memset(pattern, 0, sizeof(pattern));
+    pattern[0].type = RTE_FLOW_ITEM_TYPE_ETH;
+    pattern[1].type = RTE_FLOW_ITEM_TYPE_IPV4;
+    pattern[1].spec = &ip_spec;
+    pattern[1].mask = &ip_mask;
+    pattern[2].type = RTE_FLOW_ITEM_TYPE_END;
+    for (k = 0; k < RTE_DIM(ctrl_protos); k++) {
+        ip_spec.hdr.next_proto_id = ctrl_protos[k];
+        if (ctrl_flow_create(port, pattern) != NULL)
+            nb_steered++;
+    }
+    printf("Port %u steers %u of %u control protocols to queue %u%s\n",
+           port, nb_steered, (unsigned)RTE_DIM(ctrl_protos), MANAGER_RX_QUEUE,
+           nb_steered < RTE_DIM(ctrl_protos) ? ", nf cores pass the rest" : "");
+
+    memset(&eth_spec, 0, sizeof(eth_spec));
+    memset(&eth_mask, 0, sizeof(eth_mask));
+    eth_spec.type = rte_cpu_to_be_16(ETHER_TYPE_ARP);
+    eth_mask.type = 0xFFFF;
+    pattern[0].spec = &eth_spec;
+    pattern[0].mask = &eth_mask;
+    pattern[1].type = RTE_FLOW_ITEM_TYPE_END;
+    if (ctrl_flow_create(port, pattern) != NULL)
+        printf("Port %u steers ARP to queue %u\n", port, MANAGER_RX_QUEUE);
+    else
+        printf("Port %u leaves ARP to the nf cores\n", port);
+}
+
+/*
+ * Initializes a given port using global settings. Each queue and its RX
+ * buffers are on the socket of the lcore polling it, see single_port_param.
  */
 int
-port_init(uint8_t port, struct rte_mempool *mbuf_pool,
- 		struct rte_mempool *manager_mbuf_pool)
+port_init(uint8_t port)
 {
     if ((enabled_port_mask & (1 << port)) == 0) {
         printf("Skipping disabled port %d\n", port);
@@ -286,12 +412,40 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool,
     const uint16_t rx_rings = RX_QUEUE_COUNT, tx_rings = TX_QUEUE_COUNT;
     uint16_t nb_rxd = RX_RING_SIZE;
     uint16_t nb_txd = TX_RING_SIZE;
+    struct rte_eth_dev_info dev_info;
+    struct rte_eth_txconf txconf;
     int retval;
     uint16_t q;
 
     if (port >= rte_eth_dev_count())
         return -1;
 
+    rte_eth_dev_info_get(port, &dev_info);
+    if (dev_info.max_rx_queues < rx_rings ||
+        dev_info.max_tx_queues < tx_rings) {
+        printf("Port %u has %u rx and %u tx queues, %u and %u needed\n",
+               port, dev_info.max_rx_queues, dev_info.max_tx_queues,
+               rx_rings, tx_rings);
+        return -1;
+    }
+    if (dev_info.reta_size > RSS_RETA_COUNT * RTE_RETA_GROUP_SIZE) {
+        printf("Port %u has a RETA larger than %u\n",
+               port, RSS_RETA_COUNT * RTE_RETA_GROUP_SIZE);
+        return -1;
+    }
+
+    /* Let the NIC fill the checksums of the packets nf rewrites */
+    txconf = dev_info.default_txconf;
+    if ((dev_info.tx_offload_capa & DEV_TX_OFFLOAD_IPV4_CKSUM) &&
+        (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_TCP_CKSUM)) {
+        txconf.txq_flags &= ~ETH_TXQ_FLAGS_NOXSUMTCP;
+        port_tx_cksum_flags[port] =
+            PKT_TX_IPV4 | PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM;
+        printf("Port %u offloads the IPv4/TCP tx checksums\n", port);
+    }
+    else {
+        port_tx_cksum_flags[port] = 0;
+    }
 
     /* Configure the Ethernet device. */
     retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
@@ -302,28 +456,30 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool,
     if (retval != 0)
         return retval;
 
-    /* Allocate and set up 2 RX queue per Ethernet port. */
+    /* Allocate and set up a RX queue per nf core and one for manager. */
     for (q = 0; q < rx_rings; q++) {
+        unsigned socketid;
         if (q < rx_rings-1){
-        char name[30];
-        snprintf(name, sizeof(name),"MBUF_POOL_Q_%u",q);
-
-        struct rte_mempool *mbuf_pool = rte_pktmbuf_pool_create(name, NUM_MBUFS,MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-            retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
-                    rte_eth_dev_socket_id(port), NULL, mbuf_pool);
-    }
-        else
-            retval = rte_eth_rx_queue_setup(port, q, nb_rxd,
-                    rte_eth_dev_socket_id(port), NULL, manager_mbuf_pool);
+            socketid = rte_lcore_to_socket_id(nf_insts[q].lcore_id);
+            retval = rte_eth_rx_queue_setup(port, q, nb_rxd, socketid, NULL,
+                    single_port_param.nf_mempool[socketid]);
+        }
+        else {
+            socketid = rte_lcore_to_socket_id(manager_core);
+            retval = rte_eth_rx_queue_setup(port, q, nb_rxd, socketid, NULL,
+                    single_port_param.manager_mempool);
+        }
         if (retval < 0)
             return retval;
-        printf("Init queue %d for port %d\n", q, port);
+        printf("Init queue %d for port %d on socket %u\n", q, port, socketid);
     }
 
-    /* Allocate and set up 1 TX queue per Ethernet port. */
+    /* Allocate and set up a TX queue per nf core, manager and slave. */
     for (q = 0; q < tx_rings; q++) {
+        unsigned lcore_id = q < nb_nf_cores ? nf_insts[q].lcore_id :
+            q == MANAGER_TX_QUEUE ? manager_core : manager_slave_core;
         retval = rte_eth_tx_queue_setup(port, q, nb_txd,
-                rte_eth_dev_socket_id(port), NULL);
+                rte_lcore_to_socket_id(lcore_id), &txconf);
         if (retval < 0)
             return retval;
     }
@@ -333,47 +489,24 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool,
     if (retval < 0)
         return retval;
 
-    // /* Set FlowDirector flow filter on port */
-    // retval = rte_eth_dev_filter_ctrl(port, RTE_ETH_FILTER_FDIR,
-    //                                    RTE_ETH_FILTER_ADD, &fdir_filter_state);
-    // if (retval < 0)
-    //     return retval;
-    // // fdir_filter_ecmp.input.flow.tcp4_flow.src_port = rte_cpu_to_be_16(0),
-    // // fdir_filter_ecmp.input.flow.tcp4_flow.dst_port = rte_cpu_to_be_16(0),
-    // retval = rte_eth_dev_filter_ctrl(port, RTE_ETH_FILTER_FDIR,
-    //                                     RTE_ETH_FILTER_ADD, &fdir_filter_ecmp_tcp);
-    // if (retval < 0)
-    //     return retval;
-    // retval = rte_eth_dev_filter_ctrl(port, RTE_ETH_FILTER_FDIR,
-    //                                     RTE_ETH_FILTER_ADD, &fdir_filter_ecmp_udp);
-    // if (retval < 0)
-    //     return retval;
-    // retval = rte_eth_dev_filter_ctrl(port, RTE_ETH_FILTER_FDIR,
-    //                                  RTE_ETH_FILTER_ADD, &fdir_filter_arp);
-    // if (retval < 0)
-    //     return retval;
-    // struct rte_eth_fdir_info fdir_info;
-    // retval = rte_eth_dev_filter_ctrl(port, RTE_ETH_FILTER_FDIR,
-    //                                  RTE_ETH_FILTER_INFO, &fdir_info);
-    // if (retval < 0)
-    //     return retval;
-    // unsigned int j;
-    // for (j = 0; j < RTE_FLOW_MASK_ARRAY_SIZE; j++)
-    //     printf("flow_types_mask[%d]: %08x\n", j, fdir_info.flow_types_mask[j]);
-
-    /* Set hash array of RSS */
-    retval = rss_hash_set(NF_CORE_COUNT, port);
-    if (retval < 0) {
+    /* Send the control traffic to the manager queue */
+    ctrl_flow_setup(port);
+
+    /* Set hash array of RSS, ports without a RETA keep their default */
+    if (dev_info.reta_size == 0) {
+        printf("Port %u has no RSS RETA\n", port);
+    }
+    else if ((retval = rss_hash_set(nb_nf_cores, port, dev_info.reta_size)) < 0) {
         printf("Why?\n");
         return retval;
     }
     else {
         int idx, i;
-        retval = rte_eth_dev_rss_reta_query(port, reta_conf, RSS_RETA_SIZE);
+        retval = rte_eth_dev_rss_reta_query(port, reta_conf, dev_info.reta_size);
         if (retval < 0) {
             printf("Why?\n");
         }
-        for (idx = 0; idx < RSS_RETA_COUNT; idx++) {
+        for (idx = 0; idx < dev_info.reta_size / RTE_RETA_GROUP_SIZE; idx++) {
             for (i = 0; i < RTE_RETA_GROUP_SIZE; i++) {
                 printf("%d ", reta_conf[idx].reta[i]);
             }
@@ -401,9 +534,103 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool,
 static void
 print_usage(const char *prgname)
 {
-    printf("%s [EAL options] -- -p PORTMASK [-q NQ]\n"
-           "  -p PORTMASK: hexadecimal bitmask of ports to configure\n",
-           prgname);
+    printf("%s [EAL options] -- -p PORTMASK [-m NMACHINES] [-i INDEX] [-c] [-s]\n"
+           "  [--nf-cores N] [--manager-lcore ID] [--slave-lcore ID]"
+           " [--flows N] [--flows6 N]\n"
+           "  [--nf-chain STAGES] [--backends LIST] [--backends6 LIST]\n"
+           "  [--snat-ip A.B.C.D] [--ecmp-model MODEL] [--ecmp-fields MASK]"
+           " [--ecmp-seed N]\n"
+           "  [--migrate] [--migrate-rate N]\n"
+           "  [--bench SECONDS] [--bench-flows N] [--bench-new-flows N]\n"
+           "  [--bench-sizes LIST] [--bench-replay] [--latency]\n"
+           "  [--snapshot FILE] [--syn-cookies RATE]\n"
+           "  -p PORTMASK: hexadecimal bitmask of ports to configure\n"
+           "  -m NMACHINES: number of gateway machines (default %d, max %d)\n"
+           "  -i INDEX: index of this machine, from 0 (default 0)\n"
+           "  -c: send keysets in compact encoding\n"
+           "  -s: print the statistics every second\n"
+           "  --nf-cores N: number of nf cores, taken from the enabled lcores"
+           " (default all left, max %d)\n"
+           "  --manager-lcore ID: lcore of the manager (default %d)\n"
+           "  --slave-lcore ID: lcore of the manager slave (default %d)\n"
+           "  --flows N: entries of the state and index tables"
+           " (default %d)\n"
+           "  --flows6 N: entries of the IPv6 state and index tables"
+           " (default %d)\n"
+           "  --nf-chain STAGES: comma separated nf stages in the order"
+           " they run,\n"
+           "    from lb, snat and fw, lb before snat (default %s)\n"
+           "  --backends LIST: servers of lb as A.B.C.D[:WEIGHT],..."
+           " (default the built-in pool)\n"
+           "  --backends6 LIST: servers of lb for IPv6 flows as ADDR or"
+           " [ADDR]:WEIGHT,...,\n"
+           "    the same on every machine (default none, the flows keep"
+           " their destination)\n"
+           "  --snat-ip A.B.C.D: data address of the gateway the snat stage"
+           " translates\n"
+           "    to, the same on every machine, outside 172.16.0.0/16"
+           " (required with snat)\n"
+           "  --ecmp-model MODEL: hash of the switch, crc or toeplitz, to place"
+           " backups\n"
+           "    without probes once calibrated (default probe every flow)\n"
+           "  --ecmp-fields MASK: hexadecimal mask of the hashed fields, 1 sip,"
+           " 2 dip,\n"
+           "    4 sport, 8 dport, 10 proto (default 1f)\n"
+           "  --ecmp-seed N: seed of the switch hash (default 0)\n"
+           "  --migrate: ask the other machines at start for the states the"
+           " ECMP model\n"
+           "    places here and the backups this machine holds, to join or"
+           " replace one\n"
+           "  --migrate-rate N: state packets per second sent to a machine"
+           " that asks\n"
+           "    (default %d)\n"
+           "  --bench SECONDS: run that long and print the rates of each nf"
+           " core,\n"
+           "    over a synthetic TCP trace written into the received packets\n"
+           "  --bench-flows N: flows of the trace per nf core"
+           " (default %d, max %d)\n"
+           "  --bench-new-flows N: flows replaced by new ones per second and"
+           " nf core\n"
+           "    (default 0, all flows open at start)\n"
+           "  --bench-sizes LIST: packet sizes as SIZE[:WEIGHT],..."
+           " (default %s)\n"
+           "  --bench-replay: benchmark the packets as received, e.g. from"
+           " net_pcap\n"
+           "  --latency: histograms of the rx to tx latency by path, in the"
+           " gw_latency\n"
+           "    memzone and as percentile metrics\n"
+           "  --snapshot FILE: save the state and index tables to FILE on"
+           " exit and\n"
+           "    restore them from it at start\n"
+           "  --syn-cookies RATE: over RATE new flows per second and nf core"
+           " (0 always),\n"
+           "    answer a SYN with a cookie and open its flow only once the"
+           " client\n"
+           "    returned it; each challenged client waits for its SYN"
+           " retransmission\n"
+           "    timeout (>= 1s on Linux), and the verified clients are"
+           " kept per nf core\n",
+           prgname, N_MACHINE_DEFAULT, N_MACHINE_MAX, NF_CORE_MAX,
+           MANAGER_CORE_DEFAULT, MANAGER_SLAVE_CORE_DEFAULT, HASH_ENTRIES,
+           HASH_ENTRIES6, NF_CHAIN_DEFAULT, MIGRATE_RATE_DEFAULT,
+           BENCH_FLOWS_DEFAULT, BENCH_FLOWS_MAX, BENCH_SIZES_DEFAULT);
+}
+
+static int
+parse_uint(const char *arg)
+{
+    char *end = NULL;
+    unsigned long n;
+
+    /* parse decimal string */
+    n = strtoul(arg, &end, 10);
+    if ((arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+        return -1;
+
+    if (n > INT32_MAX)
+        return -1;
+
+    return n;
 }
 
 static int
@@ -423,6 +650,105 @@ parse_portmask(const char *portmask)
     return pm;
 }
 
+/* Parse an IPv4 address A.B.C.D into ip, host order */
+static int
+parse_ipv4(const char *arg, uint32_t *ip)
+{
+    unsigned a, b, c, d;
+    int n;
+
+    if (sscanf(arg, "%u.%u.%u.%u%n", &a, &b, &c, &d, &n) != 4 ||
+        arg[n] != '\0' || a > 255 || b > 255 || c > 255 || d > 255)
+        return -1;
+    *ip = IPv4(a, b, c, d);
+    return 0;
+}
+
+/* Parse a list of backends, A.B.C.D[:WEIGHT] separated by commas */
+static int
+parse_backends(const char *list)
+{
+    const char *p = list;
+    unsigned a, b, c, d, weight;
+    int n;
+
+    nb_lb_backends_conf = 0;
+    while (*p != '\0') {
+        if (nb_lb_backends_conf == LB_BACKEND_MAX)
+            return -1;
+        weight = 1;
+        if (sscanf(p, "%u.%u.%u.%u%n", &a, &b, &c, &d, &n) != 4 ||
+            a > 255 || b > 255 || c > 255 || d > 255)
+            return -1;
+        p += n;
+        if (*p == ':') {
+            if (sscanf(p + 1, "%u%n", &weight, &n) != 1 ||
+                weight == 0 || weight > UINT16_MAX)
+                return -1;
+            p += n + 1;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+        lb_backends_conf[nb_lb_backends_conf].ip = IPv4(a, b, c, d);
+        lb_backends_conf[nb_lb_backends_conf].weight = weight;
+        nb_lb_backends_conf++;
+    }
+    return nb_lb_backends_conf > 0 ? 0 : -1;
+}
+
+/*
+ * Parse a list of IPv6 backends separated by commas, each ADDR or
+ * [ADDR]:WEIGHT
+ */
+static int
+parse_backends6(const char *list)
+{
+    const char *p = list;
+    char addr[INET6_ADDRSTRLEN];
+    struct lb_backend6 *backend;
+    unsigned weight;
+    size_t len;
+    int n;
+
+    nb_lb_backends6_conf = 0;
+    while (*p != '\0') {
+        if (nb_lb_backends6_conf == LB_BACKEND_MAX)
+            return -1;
+        weight = 1;
+        if (*p == '[') {
+            len = strcspn(++p, "]");
+            if (p[len] != ']' || p[len + 1] != ':' || len >= sizeof(addr))
+                return -1;
+            memcpy(addr, p, len);
+            p += len + 2;
+            if (sscanf(p, "%u%n", &weight, &n) != 1 ||
+                weight == 0 || weight > UINT16_MAX)
+                return -1;
+            p += n;
+        }
+        else {
+            len = strcspn(p, ",");
+            if (len >= sizeof(addr))
+                return -1;
+            memcpy(addr, p, len);
+            p += len;
+        }
+        addr[len] = '\0';
+        backend = &lb_backends6_conf[nb_lb_backends6_conf];
+        if (inet_pton(AF_INET6, addr, backend->ip) != 1)
+            return -1;
+        backend->weight = weight;
+        nb_lb_backends6_conf++;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+    }
+    return nb_lb_backends6_conf > 0 ? 0 : -1;
+}
+
 /* Parse the argument given in the command line of the application */
 int
 parse_args(int argc, char **argv)
@@ -432,12 +758,36 @@ parse_args(int argc, char **argv)
     int option_index;
     char *prgname = argv[0];
     static struct option lgopts[] = {
+        {"nf-cores", required_argument, 0, 0},
+        {"manager-lcore", required_argument, 0, 0},
+        {"slave-lcore", required_argument, 0, 0},
+        {"flows", required_argument, 0, 0},
+        {"flows6", required_argument, 0, 0},
+        {"bench", required_argument, 0, 0},
+        {"bench-flows", required_argument, 0, 0},
+        {"bench-new-flows", required_argument, 0, 0},
+        {"bench-sizes", required_argument, 0, 0},
+        {"bench-replay", no_argument, 0, 0},
+        {"latency", no_argument, 0, 0},
+        {"snapshot", required_argument, 0, 0},
+        {"syn-cookies", required_argument, 0, 0},
+        {"nf-chain", required_argument, 0, 0},
+        {"backends", required_argument, 0, 0},
+        {"backends6", required_argument, 0, 0},
+        {"snat-ip", required_argument, 0, 0},
+        {"ecmp-model", required_argument, 0, 0},
+        {"ecmp-fields", required_argument, 0, 0},
+        {"ecmp-seed", required_argument, 0, 0},
+        {"migrate", no_argument, 0, 0},
+        {"migrate-rate", required_argument, 0, 0},
         {NULL, 0, 0, 0}
     };
 
     argvopt = argv;
 
-    while ((opt = getopt_long(argc, argvopt, "p:",
+    nf_chain_parse(NF_CHAIN_DEFAULT);
+
+    while ((opt = getopt_long(argc, argvopt, "p:m:i:cs",
                   lgopts, &option_index)) != EOF) {
 
         switch (opt) {
@@ -451,10 +801,168 @@ parse_args(int argc, char **argv)
             }
             break;
 
+        /* number of machines */
+        case 'm':
+            ret = parse_uint(optarg);
+            if (ret < 2 || ret > N_MACHINE_MAX) {
+                printf("invalid number of machines\n");
+                print_usage(prgname);
+                return -1;
+            }
+            n_machines = ret;
+            break;
+
+        /* index of this machine */
+        case 'i':
+            ret = parse_uint(optarg);
+            if (ret < 0) {
+                printf("invalid machine index\n");
+                print_usage(prgname);
+                return -1;
+            }
+            this_machine_index = ret;
+            break;
+
+        /* compact keysets */
+        case 'c':
+            keyset_compact = 1;
+            break;
+
+        case 's':
+            print_stats = 1;
+            break;
+
         /* long options */
         case 0:
-            print_usage(prgname);
-            return -1;
+            if (!strcmp(lgopts[option_index].name, "nf-chain")) {
+                if (nf_chain_parse(optarg) < 0) {
+                    printf("invalid nf chain %s\n", optarg);
+                    print_usage(prgname);
+                    return -1;
+                }
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "backends")) {
+                if (parse_backends(optarg) < 0) {
+                    printf("invalid backends %s\n", optarg);
+                    print_usage(prgname);
+                    return -1;
+                }
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "backends6")) {
+                if (parse_backends6(optarg) < 0) {
+                    printf("invalid backends6 %s\n", optarg);
+                    print_usage(prgname);
+                    return -1;
+                }
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "snat-ip")) {
+                if (parse_ipv4(optarg, &snat_ip) < 0 ||
+                    (snat_ip & CTRL_NET_MASK) == CTRL_NET) {
+                    printf("invalid snat address %s\n", optarg);
+                    print_usage(prgname);
+                    return -1;
+                }
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "bench-sizes")) {
+                if (bench_parse_sizes(optarg) < 0) {
+                    printf("invalid packet sizes %s\n", optarg);
+                    print_usage(prgname);
+                    return -1;
+                }
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "bench-replay")) {
+                bench_replay = 1;
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "latency")) {
+                latency_enabled = 1;
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "snapshot")) {
+                snapshot_path = optarg;
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "migrate")) {
+                migrate_on_start = 1;
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "ecmp-model")) {
+                if (ecmp_model_parse(optarg) < 0) {
+                    printf("invalid ECMP model %s\n", optarg);
+                    print_usage(prgname);
+                    return -1;
+                }
+                break;
+            }
+            if (!strcmp(lgopts[option_index].name, "ecmp-fields")) {
+                char *end = NULL;
+                unsigned long mask = strtoul(optarg, &end, 16);
+                if (optarg[0] == '\0' || end == NULL || *end != '\0' ||
+                    mask == 0 || (mask & ~ECMP_F_ALL)) {
+                    printf("invalid ECMP fields %s\n", optarg);
+                    print_usage(prgname);
+                    return -1;
+                }
+                ecmp_fields = mask;
+                break;
+            }
+            ret = parse_uint(optarg);
+            if (!strcmp(lgopts[option_index].name, "nf-cores") &&
+                ret > 0 && ret <= NF_CORE_MAX) {
+                nb_nf_cores = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "manager-lcore") &&
+                     ret >= 0 && ret < RTE_MAX_LCORE) {
+                manager_core = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "slave-lcore") &&
+                     ret >= 0 && ret < RTE_MAX_LCORE) {
+                manager_slave_core = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "flows") &&
+                     ret > 0) {
+                flow_entries = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "flows6") &&
+                     ret > 0) {
+                flow_entries6 = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "ecmp-seed") &&
+                     ret >= 0) {
+                ecmp_seed = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "migrate-rate") &&
+                     ret > 0) {
+                migrate_rate = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "bench") &&
+                     ret > 0) {
+                bench_seconds = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "bench-flows") &&
+                     ret > 0 && ret <= BENCH_FLOWS_MAX) {
+                bench_flows = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "bench-new-flows") &&
+                     ret >= 0) {
+                bench_new_flow_rate = ret;
+            }
+            else if (!strcmp(lgopts[option_index].name, "syn-cookies") &&
+                     ret >= 0) {
+                syn_cookies = 1;
+                syn_cookie_rate = ret;
+            }
+            else {
+                printf("invalid value for --%s\n", lgopts[option_index].name);
+                print_usage(prgname);
+                return -1;
+            }
+            break;
 
         default:
             print_usage(prgname);
@@ -468,6 +976,19 @@ parse_args(int argc, char **argv)
         return -1;
     }
 
+    if (this_machine_index >= n_machines) {
+        printf("machine index out of the topology\n");
+        print_usage(prgname);
+        return -1;
+    }
+
+    /* the control address would steer the answers to the manager */
+    if (nf_chain_has("snat") && snat_ip == 0) {
+        printf("snat needs --snat-ip\n");
+        print_usage(prgname);
+        return -1;
+    }
+
     if (optind >= 0)
         argv[optind-1] = prgname;
 
@@ -476,6 +997,59 @@ parse_args(int argc, char **argv)
     return ret;
 }
 
+/*
+ * Give the manager and its slave their lcores and make nf cores of the
+ * enabled lcores left, in order, so the number of nf cores and queues
+ * follows the EAL core list. Must run after parse_args().
+ */
+void
+setup_lcores(void)
+{
+    unsigned lcore_id;
+    uint16_t nb_free = 0, nf_id = 0;
+
+    if (manager_core == manager_slave_core ||
+        !rte_lcore_is_enabled(manager_core) ||
+        !rte_lcore_is_enabled(manager_slave_core))
+        rte_exit(EXIT_FAILURE,
+            "Manager lcore %u and slave lcore %u must be distinct enabled lcores\n",
+            manager_core, manager_slave_core);
+
+    RTE_LCORE_FOREACH(lcore_id) {
+        if (lcore_id != manager_core && lcore_id != manager_slave_core)
+            nb_free++;
+    }
+    if (nb_nf_cores == 0)
+        nb_nf_cores = RTE_MIN(nb_free, NF_CORE_MAX);
+    if (nb_nf_cores == 0 || nb_nf_cores > nb_free)
+        rte_exit(EXIT_FAILURE, "%u nf cores requested, %u lcores left\n",
+            nb_nf_cores, nb_free);
+
+    nf_insts = rte_zmalloc("nf_insts",
+        nb_nf_cores * sizeof(struct nf_inst_info), RTE_CACHE_LINE_SIZE);
+    if (nf_insts == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot allocate nf_insts\n");
+
+    for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++)
+        lcore_nf_map[lcore_id] = -1;
+    RTE_LCORE_FOREACH(lcore_id) {
+        if (lcore_id == manager_core || lcore_id == manager_slave_core)
+            continue;
+        if (nf_id == nb_nf_cores)
+            break;
+        nf_insts[nf_id].nf_id = nf_id;
+        nf_insts[nf_id].rx_queue_id = nf_id;
+        nf_insts[nf_id].tx_queue_id = nf_id;
+        nf_insts[nf_id].lcore_id = lcore_id;
+        lcore_nf_map[lcore_id] = nf_id;
+        printf("nf %u on lcore %u (socket %u)\n",
+               nf_id, lcore_id, rte_lcore_to_socket_id(lcore_id));
+        nf_id++;
+    }
+    printf("manager on lcore %u, manager slave on lcore %u\n",
+           manager_core, manager_slave_core);
+}
+
 void
 check_all_ports_link_status(uint8_t port_num, uint32_t port_mask)
 {
@@ -539,20 +1113,14 @@ lcore_main_loop(__attribute__((unused)) void *arg)
     unsigned lcore;
 
     lcore = rte_lcore_id();
-    // nfs, manager and manager-slave all use cores on NUMA 1
-    // by default,  manager uses core 1
-    //              manager-slave uses core 3
-    //              nfs use odd cores larger than or equal to 5
-    if (lcore > MANAGER_SLAVE_CORE && lcore % 2 == 1 && lcore <= MANAGER_SLAVE_CORE + 2 * NF_CORE_COUNT/*all odd cores on NUMA 1, lcore >= 5*/){
-        setup_hash(lcore, nf_insts[(lcore - MANAGER_SLAVE_CORE - 2) / 2].hash_table_index);
-        // lcore is supposed to be MANAGER_CORE + 1 ~ MANAGER_CORE + NF_CORE_COUNT
-        lcore_nf(/*NULL, */&nf_insts[(lcore - MANAGER_SLAVE_CORE - 2) / 2]);
-    }
-    else if (lcore == MANAGER_SLAVE_CORE/*3*/){
+    // roles of the lcores are assigned by setup_lcores()
+    if (lcore_nf_map[lcore] >= 0){
+        lcore_nf(/*NULL, */&nf_insts[lcore_nf_map[lcore]]);
+    }
+    else if (lcore == manager_slave_core){
         lcore_manager_slave(NULL);
     }
-    else if (lcore == MANAGER_CORE/*1*/){
-        setup_hash(lcore, 0);/*manager always uses hash_table[0]*/
+    else if (lcore == manager_core){
         lcore_manager(NULL);
     }
 
@@ -2,14 +2,18 @@
 #define _ECMP_PREDICT_H_
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <rte_ip.h>
 #include <rte_tcp.h>
 #include <rte_udp.h>
 #include <rte_byteorder.h>
 #include <rte_mbuf.h>
 #include <rte_ether.h>
+#include <rte_ethdev.h>
 #include <inttypes.h>
 #include <rte_byteorder.h>
+#include <rte_hash_crc.h>
+#include <rte_thash.h>
 
 #include "main.h"
 
@@ -28,9 +32,43 @@ struct ether_addr interface_MAC = {
 
 uint32_t probing_ip;
 
-uint32_t this_machine_index;
+uint32_t this_machine_index = 0;
+
+uint32_t n_machines = N_MACHINE_DEFAULT;
 
 uint32_t reverse_table[N_INTERFACE_MAX];
+
+uint8_t ecmp_model = ECMP_MODEL_NONE;
+uint8_t ecmp_fields = ECMP_F_ALL;
+uint32_t ecmp_seed = 0;
+volatile uint8_t ecmp_model_ready = 0;
+
+/* Toeplitz key, the usual RSS key unless a seed is given */
+static uint8_t ecmp_thash_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+/* machine index of each hash bucket, -1 until a probe showed it */
+static int8_t ecmp_bucket_map[N_MACHINE_MAX];
+static uint16_t ecmp_calib_replies;
+
+/*
+	Flow of a probe, carried after the master ip in the request and after
+	the index in the reply. The source and ports are in the headers.
+*/
+struct probe_flow {
+    uint32_t ip_dst;
+    uint8_t proto;
+    uint8_t flags;
+    uint16_t pad;
+} __attribute__((__packed__));
+#define PROBE_F_CALIB 0x1
+
+static struct rte_mbuf* build_probe(const struct ipv4_5tuple* ip_5tuple,
+                                    uint8_t flags);
 /*
 	A tool function for dumping ALL of the ip header fields.
 	The last line being 0xffff indicates that the cksum is correct.
@@ -75,30 +113,165 @@ void ecmp_predict_init(struct rte_mempool * mbuf_pool) {
     //printf("%x\n",eth_hdr);
     //printf("%x\n",iph);
 
-    //TODO: need a configuration process when boot
-    topo[0].id = 1;
-    topo[0].ip = IPv4(172,16,0,2);
+    /* Machine i is 172.16.i.2, n_machines and our index come from args */
+    uint32_t idx;
+    for (idx = 0; idx < n_machines; idx++) {
+        topo[idx].id = idx + 1;
+        topo[idx].ip = IPv4(172,16,idx,2);
+        reverse_table[idx + 1] = idx;
+    }
 
-    topo[1].id = 2;
-    topo[1].ip = IPv4(172,16,1,2);
+    this_machine = &(topo[this_machine_index]);
 
-    topo[2].id = 3;
-    topo[2].ip = IPv4(172,16,2,2);
+    probing_ip = IPv4(172,16,253,2); 
 
-    topo[3].id = 4;
-    topo[3].ip = IPv4(172,16,3,2);
+    printf("this machine.ip = " IPv4_BYTES_FMT " \n", IPv4_BYTES(this_machine->ip));
 
-    this_machine_index = 0;
+    if (ecmp_model == ECMP_MODEL_TOEPLITZ && ecmp_seed != 0) {
+        for (idx = 0; idx < sizeof(ecmp_thash_key); idx++)
+            ecmp_thash_key[idx] = ecmp_seed >> (24 - 8 * (idx % 4));
+    }
+}
 
-    this_machine = &(topo[this_machine_index]);
+/*
+	Backup machines of a flow whose probe reached the machine topo[index]:
+	that machine and the next one.
+*/
+void ecmp_backup_ips(uint32_t index, uint32_t* machine_ip1, uint32_t* machine_ip2) {
+    *machine_ip1 = topo[index].ip;
+    *machine_ip2 = topo[(index + 1) % n_machines].ip;
+}
 
-    probing_ip = IPv4(172,16,253,2); 
+/*
+	Select the ECMP model from its name, "crc" or "toeplitz".
+*/
+int ecmp_model_parse(const char* name) {
+    if (!strcmp(name, "crc"))
+        ecmp_model = ECMP_MODEL_CRC;
+    else if (!strcmp(name, "toeplitz"))
+        ecmp_model = ECMP_MODEL_TOEPLITZ;
+    else
+        return -1;
+    return 0;
+}
 
-    reverse_table[1] = 0;
-    reverse_table[2] = 1;
-    reverse_table[3] = 2;
-    reverse_table[4] = 3;
-    printf("this machine.ip = " IPv4_BYTES_FMT " \n", IPv4_BYTES(this_machine->ip));
+/*
+	Hash of a packet of the flow towards dip as the model thinks the switch
+	computes it. A probe carries the source and ports of the flow towards
+	probing_ip.
+*/
+static uint32_t ecmp_model_hash(const struct ipv4_5tuple* ip_5tuple, uint32_t dip) {
+    uint32_t tuple[4];
+    tuple[0] = (ecmp_fields & ECMP_F_SIP) ? ip_5tuple->ip_src : 0;
+    tuple[1] = (ecmp_fields & ECMP_F_DIP) ? dip : 0;
+    tuple[2] = ((ecmp_fields & ECMP_F_SPORT) ?
+                (uint32_t)ip_5tuple->port_src << 16 : 0) |
+               ((ecmp_fields & ECMP_F_DPORT) ? ip_5tuple->port_dst : 0);
+    tuple[3] = (ecmp_fields & ECMP_F_PROTO) ? IP_PROTO_TCP : 0;
+    if (ecmp_model == ECMP_MODEL_TOEPLITZ)
+        return rte_softrss(tuple, RTE_DIM(tuple), ecmp_thash_key);
+    return rte_hash_crc(tuple, sizeof(tuple), ecmp_seed);
+}
+
+/*
+	Index in topo of the machine the switch sends the probe of a flow to,
+	-1 while the model is not calibrated.
+*/
+int ecmp_model_index(const struct ipv4_5tuple* ip_5tuple) {
+    if (!ecmp_model_ready)
+        return -1;
+    return ecmp_bucket_map[ecmp_model_hash(ip_5tuple, probing_ip) % n_machines];
+}
+
+/*
+	Index in topo of the machine the switch sends the packets of a flow to,
+	its owner, -1 while the model is not calibrated.
+*/
+int ecmp_model_owner(const struct ipv4_5tuple* ip_5tuple) {
+    if (!ecmp_model_ready)
+        return -1;
+    return ecmp_bucket_map[ecmp_model_hash(ip_5tuple, ip_5tuple->ip_dst) % n_machines];
+}
+
+/*
+	Send the calibration probes, made-up flows whose replies tell the
+	machine of their bucket. Called once by the manager.
+*/
+void ecmp_model_calibrate(uint8_t port, uint16_t tx_queue_id) {
+    struct rte_mbuf* probing_packet;
+    struct ipv4_5tuple calib_tuple;
+    uint32_t k;
+
+    if (ecmp_model == ECMP_MODEL_NONE)
+        return;
+    memset(ecmp_bucket_map, -1, sizeof(ecmp_bucket_map));
+    for (k = 0; k < ECMP_CALIB_PROBES; k++) {
+        calib_tuple.ip_src = IPv4(10, 255, k >> 8, k & 0xff);
+        calib_tuple.ip_dst = probing_ip;
+        calib_tuple.port_src = 10000 + k;
+        calib_tuple.port_dst = 80;
+        calib_tuple.proto = IP_PROTO_TCP;
+        probing_packet = build_probe(&calib_tuple, PROBE_F_CALIB);
+        if (probing_packet == NULL)
+            return;
+        if (rte_eth_tx_burst(port, tx_queue_id, &probing_packet, 1) != 1) {
+            printf("ecmp: tx calibration probe failed!\n");
+            rte_pktmbuf_free(probing_packet);
+        }
+    }
+}
+
+/*
+	Learn from the reply of a calibration probe. The model is used once
+	every bucket has been seen and half of the probes agree, and dropped
+	if a reply contradicts it.
+*/
+void ecmp_model_calib_reply(const struct ipv4_5tuple* ip_5tuple, uint32_t index) {
+    uint32_t bucket, b;
+
+    /* once ready the manager relies on the model, late replies are dropped */
+    if (ecmp_model == ECMP_MODEL_NONE || ecmp_model_ready ||
+        index >= n_machines)
+        return;
+    bucket = ecmp_model_hash(ip_5tuple, probing_ip) % n_machines;
+    if (ecmp_bucket_map[bucket] >= 0 &&
+        ecmp_bucket_map[bucket] != (int8_t)index) {
+        printf("ecmp: the model does not match the switch, keep probing\n");
+        ecmp_model_ready = 0;
+        ecmp_model = ECMP_MODEL_NONE;
+        return;
+    }
+    ecmp_bucket_map[bucket] = index;
+    if (++ecmp_calib_replies < ECMP_CALIB_PROBES / 2)
+        return;
+    for (b = 0; b < n_machines; b++)
+        if (ecmp_bucket_map[b] < 0)
+            return;
+    printf("ecmp: model calibrated with %u probes\n", ecmp_calib_replies);
+    ecmp_model_ready = 1;
+}
+
+/*
+	Id of a machine in topo (index + 1), 0 if the ip is not in topo.
+*/
+uint8_t machine_id(uint32_t machine_ip) {
+    uint32_t idx;
+    if (machine_ip == 0)
+        return 0;
+    for (idx = 0; idx < n_machines; idx++) {
+        if (topo[idx].ip == machine_ip)
+            return topo[idx].id;
+    }
+    return 0;
+}
+
+/*
+	Ip of a machine from its id, 0 for id 0 or an id not in topo.
+*/
+uint32_t machine_ip(uint8_t id) {
+    if (id == 0 || id > n_machines)
+        return 0;
+    return topo[id - 1].ip;
 }
 
 /*
@@ -132,11 +305,13 @@ ipv4_hdr_cksum(struct ipv4_hdr *ip_h)
 	The caller decides when to call this function. In our scenario, when receiving IP packets with dip=172.16.x.2 and proto=6.
 
 	Input: the probe reply mbuf
-	Output: the ID of the probed backup machine
+	Output: the ID of the probed backup machine and the flow of the probe
+	Returns 1 if the probe was a calibration probe of the ECMP model,
+	-1 if the reply carries a machine index out of the topology
 
 
 */
-void master_receive_probe_reply(struct rte_mbuf* mbuf,uint32_t* machine_ip1 ,uint32_t* machine_ip2, struct ipv4_5tuple** ip_5tuple) {
+int master_receive_probe_reply(struct rte_mbuf* mbuf, uint32_t* index_out, uint32_t* machine_ip1 ,uint32_t* machine_ip2, struct ipv4_5tuple* ip_5tuple) {
 
 
     struct ether_hdr* eth_h = (struct ether_hdr*)rte_pktmbuf_mtod(mbuf, struct ether_hdr *);
@@ -158,10 +333,17 @@ void master_receive_probe_reply(struct rte_mbuf* mbuf,uint32_t* machine_ip1 ,uin
     #ifdef __DEBUG_LV2
     printf("ecmp: index: %d\n",index);
     #endif
-    *machine_ip1 = topo[index].ip;
-    *machine_ip2 = topo[index+1].ip;
-    *ip_5tuple = *((struct ipv4_5tuple**)(payload+4));
-    //printf("debug: test%x\n", *((uint32_t*)(payload+4)));
+    /* the index comes from the wire, it selects topo[index] */
+    if (index >= n_machines)
+        return -1;
+    *index_out = index;
+    ecmp_backup_ips(index, machine_ip1, machine_ip2);
+    const struct probe_flow* flow = (const struct probe_flow*)(payload + 4);
+    ip_5tuple->ip_src = rte_be_to_cpu_32(ip_hdr->src_addr);
+    ip_5tuple->ip_dst = flow->ip_dst;
+    ip_5tuple->port_src = rte_be_to_cpu_16(tcph->src_port);
+    ip_5tuple->port_dst = rte_be_to_cpu_16(tcph->dst_port);
+    ip_5tuple->proto = flow->proto;
 
     // uint32_t backup_port_N = *((uint32_t*)payload);
     // uint32_t flow_dip = *((uint32_t*)(payload+4));
@@ -187,27 +369,23 @@ void master_receive_probe_reply(struct rte_mbuf* mbuf,uint32_t* machine_ip1 ,uin
         // *dport = rte_be_to_cpu_16(tcph->dst_port);
     // printf("dport: %x\n",*dport);
     // printf("sport: %x\n",*sport);
+    return (flow->flags & PROBE_F_CALIB) != 0;
 }
 
 
 /*
 	The function called when master needs to send probe request.
-	The function modifies a global variable probing_packet.The caller can send this packet after this function is done.
-	TODO: need rework
-	(1) the 5-tuple as input
-	(2) build a new mbuf for every packet
-
+	Writes the probe of the flow ip_5tuple into a fresh mbuf, the flow
+	itself travels in the payload so nothing is kept for the reply.
 */
-struct rte_mbuf* build_probe_packet(struct ipv4_5tuple* ip_5tuple) {
-    struct rte_mbuf* probing_packet;
+static void fill_probe_packet(struct rte_mbuf* probing_packet,
+                              const struct ipv4_5tuple* ip_5tuple,
+                              uint8_t flags) {
     struct ether_hdr *eth_hdr;
     struct ipv4_hdr *iph;
     struct tcp_hdr *tcp_h;
     char* payload;
-    probing_packet = rte_pktmbuf_alloc(ecmp_mbuf_pool);
-    if (!probing_packet) {
-        printf("ecmp: probing_packet alloc failed!\n");
-    }
+    struct probe_flow* flow;
     eth_hdr = (struct ether_hdr *) rte_pktmbuf_append(probing_packet, sizeof(struct ether_hdr));
     iph = (struct ipv4_hdr *)rte_pktmbuf_append(probing_packet, sizeof(struct ipv4_hdr));
     tcp_h = (struct tcp_hdr *) rte_pktmbuf_append(probing_packet,sizeof(struct tcp_hdr));
@@ -254,13 +432,11 @@ struct rte_mbuf* build_probe_packet(struct ipv4_5tuple* ip_5tuple) {
         iph->src_addr=rte_cpu_to_be_32(0);
         tcp_h->src_port = rte_cpu_to_be_16(0);
         tcp_h->dst_port = rte_cpu_to_be_16(0);
-        *((struct ipv4_5tuple**)(payload+4)) = 0;
     }
     else {
         iph->src_addr=rte_cpu_to_be_32(ip_5tuple->ip_src);
         tcp_h->src_port = rte_cpu_to_be_16(ip_5tuple->port_src);
         tcp_h->dst_port = rte_cpu_to_be_16(ip_5tuple->port_dst);
-        *((struct ipv4_5tuple**)(payload+4)) = ip_5tuple;
     }
 
     iph->hdr_checksum = 0;
@@ -271,9 +447,11 @@ struct rte_mbuf* build_probe_packet(struct ipv4_5tuple* ip_5tuple) {
     //dump_ip_hdr(iph);
 
     *((uint32_t*)payload) = this_machine->ip;
-    //printf("debug: ip_5tuple %lx\n", ip_5tuple);
-    //printf("debug: test bpp %x\n", *((uint32_t*)(payload+4)));
-    //printf("debug: payload %lx\n", *((struct ipv4_5tuple**)(payload+4)));
+    flow = (struct probe_flow*)(payload + 4);
+    flow->ip_dst = ip_5tuple ? ip_5tuple->ip_dst : 0;
+    flow->proto = ip_5tuple ? ip_5tuple->proto : 0;
+    flow->flags = flags;
+    flow->pad = 0;
 
     /*
     udp_h->src_port = 10000;
@@ -284,9 +462,40 @@ struct rte_mbuf* build_probe_packet(struct ipv4_5tuple* ip_5tuple) {
 
     rte_pktmbuf_dump(stdout,probing_packet,100);
     */
+}
+
+static struct rte_mbuf* build_probe(const struct ipv4_5tuple* ip_5tuple,
+                                    uint8_t flags) {
+    struct rte_mbuf* probing_packet;
+    probing_packet = rte_pktmbuf_alloc(ecmp_mbuf_pool);
+    if (!probing_packet) {
+        printf("ecmp: probing_packet alloc failed!\n");
+        return NULL;
+    }
+    fill_probe_packet(probing_packet, ip_5tuple, flags);
     return probing_packet;
 }
 
+struct rte_mbuf* build_probe_packet(const struct ipv4_5tuple* ip_5tuple) {
+    return build_probe(ip_5tuple, 0);
+}
+
+/*
+	Probes of a batch of flows, the mbufs taken with one bulk allocation.
+	Returns the number of probes built, all or none.
+*/
+uint16_t build_probe_packets(struct ipv4_5tuple** ip_5tuples,
+                             struct rte_mbuf** pkts, uint16_t nb) {
+    uint16_t k;
+    if (rte_pktmbuf_alloc_bulk(ecmp_mbuf_pool, pkts, nb) != 0) {
+        printf("ecmp: probing_packet alloc failed!\n");
+        return 0;
+    }
+    for (k = 0; k < nb; k++)
+        fill_probe_packet(pkts[k], ip_5tuples[k], 0);
+    return nb;
+}
+
 
 /*
 	The function called when a certain machine receives a probe packet
@@ -301,6 +510,8 @@ struct rte_mbuf* backup_receive_probe_packet(struct rte_mbuf* mbuf) {
     struct tcp_hdr *tcp_h;
     char* payload;
     probing_packet = build_probe_packet(0);
+    if (probing_packet == NULL)
+        return NULL;
     eth_hdr = rte_pktmbuf_mtod(probing_packet, struct ether_hdr *);
     iph = (struct ipv4_hdr *)((u_char*)eth_hdr + sizeof(struct ether_hdr));
     tcp_h = (struct tcp_hdr *)((u_char*)iph + sizeof(struct ipv4_hdr));
@@ -333,8 +544,8 @@ struct rte_mbuf* backup_receive_probe_packet(struct rte_mbuf* mbuf) {
     iph->hdr_checksum = ck1;
 
     *((uint32_t*)payload) = this_machine_index;
-    //printf("debug: %lx\n", *((uint64_t*)(payload22+4)));
-    *((struct ipv4_5tuple**)(payload+4)) = *((struct ipv4_5tuple**)(payload22+4));
+    /* the flow goes back to the master as it came */
+    memcpy(payload + 4, payload22 + 4, sizeof(struct probe_flow));
     uint32_t ipv4_addr = dst_ip;
 
     //printf("debug: test brp %x\n", *((uint32_t*)(payload+4)));
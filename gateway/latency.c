@@ -0,0 +1,186 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_memzone.h>
+#include <rte_metrics.h>
+#include <rte_common.h>
+#include <rte_debug.h>
+
+#include "main.h"
+
+/*
+ * Latency by gateway path. With --latency an rx callback stamps the tsc
+ * of the burst into each packet, the nf cores tag a packet with its path
+ * (udata64) when they classify it and count tx tsc - rx tsc in the log2
+ * histogram of the path when the driver takes it from the tx buffer: the
+ * wait in the buffer is included, packets the driver refused are not
+ * counted. The manager does the same for the control messages it
+ * applied. The histograms live in the GW_LATENCY_MZ memzone for
+ * secondary processes, and the manager publishes their percentiles as
+ * metrics every second.
+ */
+
+uint8_t latency_enabled;
+struct gw_latency *gw_latency;
+
+static const char* const gw_lat_path_names[GW_LAT_COUNT] = {
+    [GW_LAT_LOCAL] = "local",
+    [GW_LAT_REMOTE] = "remote",
+    [GW_LAT_PULL] = "pull",
+    [GW_LAT_NEW] = "new",
+    [GW_LAT_MG_BACKUP] = "mg_backup",
+    [GW_LAT_MG_KEYSET] = "mg_keyset",
+};
+
+/* Percentiles published per path, in per mille */
+static const unsigned gw_lat_pcts[] = { 500, 990, 999 };
+#define GW_LAT_NB_PCTS RTE_DIM(gw_lat_pcts)
+
+static int gw_lat_base = -1;
+
+static uint16_t
+latency_rx_cb(__rte_unused uint8_t port, __rte_unused uint16_t queue,
+              struct rte_mbuf *pkts[], uint16_t nb_pkts,
+              __rte_unused uint16_t max_pkts, __rte_unused void *user_param)
+{
+    const uint64_t now = rte_rdtsc();
+    uint16_t i;
+
+    for (i = 0; i < nb_pkts; i++)
+        pkts[i]->timestamp = now;
+    return nb_pkts;
+}
+
+static inline void
+latency_count(struct gw_latency_hist *h, unsigned path, uint64_t cycles)
+{
+    h->count[path][63 - __builtin_clzll(cycles | 1)]++;
+}
+
+/* Count the latency of a control message the manager applied */
+void
+latency_record(unsigned path, const struct rte_mbuf *m)
+{
+    latency_count(&gw_latency->lcore[rte_lcore_id()], path,
+                  rte_rdtsc() - m->timestamp);
+}
+
+/*
+ * Count the latency of packets the driver just took, by the path and rx
+ * tsc they were tagged with
+ */
+void
+latency_record_tx(const uint64_t *paths, const uint64_t *rx_tsc,
+                  uint16_t nb_pkts)
+{
+    struct gw_latency_hist *h = &gw_latency->lcore[rte_lcore_id()];
+    const uint64_t now = rte_rdtsc();
+    uint16_t i;
+
+    for (i = 0; i < nb_pkts; i++)
+        if (paths[i] < GW_LAT_COUNT)
+            latency_count(h, paths[i], now - rx_tsc[i]);
+}
+
+/*
+ * Create the histograms and stamp the rx queues of the enabled ports,
+ * after port_init() and the benchmark callbacks, whose trace is stamped.
+ */
+void
+latency_setup(void)
+{
+    const struct rte_memzone *mz;
+    const char *names[GW_LAT_COUNT * GW_LAT_NB_PCTS];
+    char name_bufs[GW_LAT_COUNT * GW_LAT_NB_PCTS][RTE_METRICS_MAX_NAME_LEN];
+    const uint8_t nb_ports = rte_eth_dev_count();
+    unsigned path, p, n = 0;
+    uint8_t port;
+    int i;
+
+    if (!latency_enabled)
+        return;
+    mz = rte_memzone_reserve(GW_LATENCY_MZ, sizeof(struct gw_latency),
+                             rte_socket_id(), 0);
+    if (mz == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot reserve the latency memzone\n");
+    gw_latency = mz->addr;
+    memset(gw_latency, 0, sizeof(*gw_latency));
+    gw_latency->tsc_hz = rte_get_tsc_hz();
+
+    for (port = 0; port < nb_ports; port++) {
+        if ((enabled_port_mask & (1 << port)) == 0)
+            continue;
+        FOR_EACH_NF_CORE {
+            if (rte_eth_add_rx_callback(port, nf_insts[i].rx_queue_id,
+                                        latency_rx_cb, NULL) == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot add latency rx callback\n");
+        }
+        if (rte_eth_add_rx_callback(port, MANAGER_RX_QUEUE,
+                                    latency_rx_cb, NULL) == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot add latency rx callback\n");
+    }
+
+    for (path = 0; path < GW_LAT_COUNT; path++) {
+        for (p = 0; p < GW_LAT_NB_PCTS; p++, n++) {
+            snprintf(name_bufs[n], sizeof(name_bufs[n]), "gw_lat_%s_p%u_ns",
+                     gw_lat_path_names[path], gw_lat_pcts[p]);
+            names[n] = name_bufs[n];
+        }
+    }
+    gw_lat_base = rte_metrics_reg_names(names, n);
+    if (gw_lat_base < 0)
+        rte_exit(EXIT_FAILURE, "Cannot register latency metrics\n");
+}
+
+/*
+ * Publish the percentiles of each path since start, as the upper bound
+ * of the histogram bucket they fall in, and print them with -s.
+ */
+void
+latency_update_metrics(void)
+{
+    uint64_t hist[GW_LAT_BUCKETS];
+    uint64_t values[GW_LAT_COUNT * GW_LAT_NB_PCTS];
+    uint64_t total, seen;
+    unsigned lcore_id, path, p, b;
+
+    if (!latency_enabled)
+        return;
+    for (path = 0; path < GW_LAT_COUNT; path++) {
+        memset(hist, 0, sizeof(hist));
+        total = 0;
+        /* Counters only grow, a slightly stale read is fine */
+        RTE_LCORE_FOREACH(lcore_id) {
+            for (b = 0; b < GW_LAT_BUCKETS; b++)
+                hist[b] += gw_latency->lcore[lcore_id].count[path][b];
+        }
+        for (b = 0; b < GW_LAT_BUCKETS; b++)
+            total += hist[b];
+        for (p = 0; p < GW_LAT_NB_PCTS; p++) {
+            seen = 0;
+            for (b = 0; b < GW_LAT_BUCKETS - 1; b++) {
+                seen += hist[b];
+                if (seen * 1000 >= total * gw_lat_pcts[p])
+                    break;
+            }
+            values[path * GW_LAT_NB_PCTS + p] = total == 0 ? 0 :
+                (2ULL << b) * 1000000000ULL / gw_latency->tsc_hz;
+        }
+        if (print_stats && total != 0)
+            printf("latency %s: %"PRIu64" pkts, p50 %"PRIu64" ns,"
+                   " p99 %"PRIu64" ns, p99.9 %"PRIu64" ns\n",
+                   gw_lat_path_names[path], total,
+                   values[path * GW_LAT_NB_PCTS],
+                   values[path * GW_LAT_NB_PCTS + 1],
+                   values[path * GW_LAT_NB_PCTS + 2]);
+    }
+    rte_metrics_update_values(RTE_METRICS_GLOBAL, gw_lat_base, values,
+                              GW_LAT_COUNT * GW_LAT_NB_PCTS);
+}
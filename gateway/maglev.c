@@ -0,0 +1,220 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_ip.h>
+#include <rte_common.h>
+#include <rte_hash_crc.h>
+#include <rte_malloc.h>
+#include <rte_atomic.h>
+#include <rte_debug.h>
+
+#include "main.h"
+
+/*
+ * Maglev backend selection. Each backend walks its own permutation of
+ * the table slots (offset and skip from hashes of its address) and the
+ * backends take turns claiming free slots, weight slots per turn, until
+ * the table is full. A new backend list changes few slots, so most flows
+ * keep their server and can be derived again from their hash alone.
+ */
+
+/* Seeds of the two permutation hashes */
+#define MAGLEV_SEED_OFFSET 0x2a9b5f3d
+#define MAGLEV_SEED_SKIP 0x7c1e4d85
+
+/*
+ * Two tables: lookups read the active one while a rebuild copies into the
+ * other. maglev_lookup() reads the pointer per packet, so a core that
+ * loaded it just before a switch may still read the inactive table while
+ * the next rebuild overwrites it. The rebuild is done in maglev_scratch
+ * and copied over whole slots, so such a read returns a server of the old
+ * or of the new list, never a free slot.
+ */
+static uint32_t* maglev_tables[2];
+static uint32_t* maglev_scratch;
+uint32_t* volatile maglev_table;
+
+/* Backend list the active table was built from */
+static struct lb_backend lb_backends[LB_BACKEND_MAX];
+static uint16_t nb_lb_backends;
+
+/* set with --backends, otherwise dip_pool with weight 1 */
+struct lb_backend lb_backends_conf[LB_BACKEND_MAX];
+uint16_t nb_lb_backends_conf;
+
+/* set with --backends6, no table without them */
+uint32_t* maglev_table6;
+struct lb_backend6 lb_backends6_conf[LB_BACKEND_MAX];
+uint16_t nb_lb_backends6_conf;
+
+static void
+maglev_populate(uint32_t* table, const struct lb_backend* backends,
+                uint16_t nb_backends)
+{
+    uint32_t offset[LB_BACKEND_MAX], skip[LB_BACKEND_MAX];
+    uint32_t next[LB_BACKEND_MAX];
+    uint32_t filled = 0;
+    uint32_t c;
+    uint16_t b, w;
+
+    for (b = 0; b < nb_backends; b++) {
+        offset[b] = rte_hash_crc_4byte(backends[b].ip, MAGLEV_SEED_OFFSET) %
+            MAGLEV_TABLE_SIZE;
+        skip[b] = rte_hash_crc_4byte(backends[b].ip, MAGLEV_SEED_SKIP) %
+            (MAGLEV_TABLE_SIZE - 1) + 1;
+        next[b] = offset[b];
+    }
+    /* 0 is not a server address, it marks a free slot */
+    memset(table, 0, MAGLEV_TABLE_SIZE * sizeof(*table));
+    for (;;) {
+        for (b = 0; b < nb_backends; b++) {
+            for (w = 0; w < backends[b].weight; w++) {
+                /* the permutation visits every slot, one is free */
+                do {
+                    c = next[b];
+                    next[b] += skip[b];
+                    if (next[b] >= MAGLEV_TABLE_SIZE)
+                        next[b] -= MAGLEV_TABLE_SIZE;
+                } while (table[c] != 0);
+                table[c] = backends[b].ip;
+                if (++filled == MAGLEV_TABLE_SIZE)
+                    return;
+            }
+        }
+    }
+}
+
+/*
+ * Build the table for a new backend list and make it active. Not thread
+ * safe, only called at init and then by the manager.
+ */
+int
+maglev_build(const struct lb_backend* backends, uint16_t nb_backends)
+{
+    uint32_t* table;
+    uint16_t b;
+
+    if (nb_backends == 0 || nb_backends > LB_BACKEND_MAX)
+        return -1;
+    for (b = 0; b < nb_backends; b++)
+        if (backends[b].ip == 0 || backends[b].weight == 0)
+            return -1;
+    table = maglev_table == maglev_tables[0] ?
+        maglev_tables[1] : maglev_tables[0];
+    maglev_populate(maglev_scratch, backends, nb_backends);
+    memcpy(table, maglev_scratch, MAGLEV_TABLE_SIZE * sizeof(*table));
+    if (backends != lb_backends) {
+        memcpy(lb_backends, backends, nb_backends * sizeof(*backends));
+        nb_lb_backends = nb_backends;
+    }
+    /* the whole table is visible before any lookup can use it */
+    rte_smp_wmb();
+    maglev_table = table;
+    return 0;
+}
+
+/* Add a backend, or change its weight if it is already in the list */
+int
+maglev_add_backend(uint32_t ip, uint16_t weight)
+{
+    struct lb_backend backends[LB_BACKEND_MAX];
+    uint16_t nb = nb_lb_backends;
+    uint16_t b;
+
+    memcpy(backends, lb_backends, nb * sizeof(*backends));
+    for (b = 0; b < nb; b++)
+        if (backends[b].ip == ip)
+            break;
+    if (b == nb) {
+        if (nb == LB_BACKEND_MAX)
+            return -1;
+        backends[nb++].ip = ip;
+    }
+    backends[b].weight = weight;
+    return maglev_build(backends, nb);
+}
+
+/* Remove a backend, the last one stays */
+int
+maglev_remove_backend(uint32_t ip)
+{
+    struct lb_backend backends[LB_BACKEND_MAX];
+    uint16_t nb = 0;
+    uint16_t b;
+
+    for (b = 0; b < nb_lb_backends; b++)
+        if (lb_backends[b].ip != ip)
+            backends[nb++] = lb_backends[b];
+    if (nb == nb_lb_backends)
+        return -1;
+    return maglev_build(backends, nb);
+}
+
+/*
+ * Build the table of the IPv6 backends. The permutations are drawn from a
+ * hash of each address, the slots then get the backend numbers.
+ */
+static void
+maglev_build6(const int socketid)
+{
+    struct lb_backend keys[LB_BACKEND_MAX];
+    uint32_t c;
+    uint16_t b, k;
+
+    for (b = 0; b < nb_lb_backends6_conf; b++) {
+        keys[b].ip = rte_hash_crc(lb_backends6_conf[b].ip, IPV6_ADDR_LEN, 0);
+        keys[b].weight = lb_backends6_conf[b].weight;
+        for (k = 0; k < b; k++)
+            if (keys[k].ip == keys[b].ip)
+                rte_exit(EXIT_FAILURE, "Repeated IPv6 backend\n");
+        if (keys[b].ip == 0)
+            rte_exit(EXIT_FAILURE, "Invalid IPv6 backend\n");
+    }
+    maglev_table6 = rte_malloc_socket("maglev_table6",
+        MAGLEV_TABLE_SIZE * sizeof(uint32_t), RTE_CACHE_LINE_SIZE, socketid);
+    if (maglev_table6 == NULL)
+        rte_exit(EXIT_FAILURE, "Unable to create the maglev table\n");
+    maglev_populate(maglev_table6, keys, nb_lb_backends6_conf);
+    for (c = 0; c < MAGLEV_TABLE_SIZE; c++) {
+        for (b = 0; keys[b].ip != maglev_table6[c]; b++)
+            ;
+        maglev_table6[c] = b + 1;
+    }
+    printf("Maglev table of %u slots over %u IPv6 backends\n",
+           MAGLEV_TABLE_SIZE, nb_lb_backends6_conf);
+}
+
+void
+setup_maglev(const int socketid)
+{
+    uint16_t b;
+
+    maglev_tables[0] = rte_malloc_socket("maglev_table",
+        MAGLEV_TABLE_SIZE * sizeof(uint32_t), RTE_CACHE_LINE_SIZE, socketid);
+    maglev_tables[1] = rte_malloc_socket("maglev_table",
+        MAGLEV_TABLE_SIZE * sizeof(uint32_t), RTE_CACHE_LINE_SIZE, socketid);
+    maglev_scratch = rte_malloc_socket("maglev_scratch",
+        MAGLEV_TABLE_SIZE * sizeof(uint32_t), RTE_CACHE_LINE_SIZE, socketid);
+    if (maglev_tables[0] == NULL || maglev_tables[1] == NULL ||
+        maglev_scratch == NULL)
+        rte_exit(EXIT_FAILURE, "Unable to create the maglev table\n");
+
+    if (nb_lb_backends_conf == 0) {
+        for (b = 0; b < DIP_POOL_SIZE; b++) {
+            lb_backends_conf[b].ip = dip_pool[b];
+            lb_backends_conf[b].weight = 1;
+        }
+        nb_lb_backends_conf = DIP_POOL_SIZE;
+    }
+    if (maglev_build(lb_backends_conf, nb_lb_backends_conf) < 0)
+        rte_exit(EXIT_FAILURE, "Invalid backend list\n");
+    printf("Maglev table of %u slots over %u backends\n",
+           MAGLEV_TABLE_SIZE, nb_lb_backends);
+    if (nb_lb_backends6_conf > 0)
+        maglev_build6(socketid);
+}
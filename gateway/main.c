@@ -34,6 +34,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <getopt.h>
+#include <signal.h>
 
 #include <rte_eal.h>
 #include <rte_ethdev.h>
@@ -48,10 +49,23 @@
 #include <rte_tcp.h>
 #include <rte_udp.h>
 #include <rte_hash.h>
+#include <rte_metrics.h>
 
 #include "main.h"
 
-struct nf_inst_info nf_insts[NF_CORE_COUNT];
+volatile uint8_t force_quit;
+
+static void
+signal_handler(int signum)
+{
+    if (signum == SIGINT || signum == SIGTERM || signum == SIGALRM) {
+        /* SIGALRM is the end of a benchmark run */
+        if (signum != SIGALRM)
+            printf("\n\nSignal %d received, preparing to exit...\n", signum);
+        force_quit = 1;
+    }
+}
+
 /*
  * The main function, which does initialization and calls the per-lcore
  * functions.
@@ -62,33 +76,11 @@ main(int argc, char *argv[])
     struct rte_mempool *mbuf_pool;
     struct rte_mempool *manager_mbuf_pool;
     unsigned nb_ports, lcore_id;
+    unsigned socketid, manager_socket;
+    unsigned nb_socket_nf_cores[NB_SOCKETS] = {0};
     uint8_t portid;
     int i;
 
-
-    // /* Initialize NF statistics data */
-    // FOR_EACH_NF_CORE{
-    //     nf_rx_bytes[i] = 0;
-    //     last_nf_rx_bytes[i] = 0;
-    //     nf_rx_pkts[i] = 0;
-    //     last_nf_rx_pkts[i] = 0;
-    //     nf_tx_bytes[i] = 0;
-    //     last_nf_tx_bytes[i] = 0;
-    //     nf_tx_pkts[i] = 0;
-    //     last_nf_tx_pkts[i] = 0;
-    // }
-
-    /* Initialize nf_insts */
-    for(i = 0;i < NF_CORE_COUNT;i++){
-        nf_insts[i].nf_id = i;
-        nf_insts[i].rx_queue_id = i;
-        nf_insts[i].tx_queue_id = i;
-        nf_insts[i].hash_table_index = i + 1;
-    }
-
-    /* Initialize numa wr lock */
-    rte_rwlock_init(&numa_hash_lock);
-
     /* Initialize the Environment Abstraction Layer (EAL). */
     int ret = rte_eal_init(argc, argv);
     if (ret < 0)
@@ -97,28 +89,54 @@ main(int argc, char *argv[])
     argc -= ret;
     argv += ret;
 
+    force_quit = 0;
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGALRM, signal_handler);
+
+    /* Statistics are published for proc_info and other secondaries */
+    rte_metrics_init(rte_socket_id());
+    setup_metrics();
+
     /* parse application arguments (after the EAL ones) */
     ret = parse_args(argc, argv);
     if (ret < 0)
         rte_exit(EXIT_FAILURE, "Invalid arguments\n");
 
+    /* Assign the lcores to nf cores, manager and manager slave */
+    setup_lcores();
+
     nb_ports = rte_eth_dev_count();
     if (nb_ports == 0)
         rte_exit(EXIT_FAILURE, "Error: no ports found\n");
 
-    /* Creates a new mempool in memory to hold the mbufs. */
-    mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS * nb_ports,
-        MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-    if (mbuf_pool == NULL)
-        rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
+    /* Count the nf cores of each socket */
+    manager_socket = rte_lcore_to_socket_id(manager_core);
+    FOR_EACH_NF_CORE{
+        nb_socket_nf_cores[rte_lcore_to_socket_id(nf_insts[i].lcore_id)]++;
+    }
+
+    /* Creates a mempool per socket of nf cores to hold their mbufs. */
+    for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+        char name[RTE_MEMPOOL_NAMESIZE];
+        if (nb_socket_nf_cores[socketid] == 0)
+            continue;
+        snprintf(name, sizeof(name), "MBUF_POOL_%u", socketid);
+        mbuf_pool = rte_pktmbuf_pool_create(name,
+            NUM_MBUFS * nb_ports * nb_socket_nf_cores[socketid],
+            MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, socketid);
+        if (mbuf_pool == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create mbuf pool on socket %u\n",
+                     socketid);
+        single_port_param.nf_mempool[socketid] = mbuf_pool;
+    }
 
     manager_mbuf_pool = rte_pktmbuf_pool_create("MANAGER_MBUF_POOL",
         NUM_MANAGER_MBUFS, MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
-        rte_socket_id());
+        manager_socket);
     if (manager_mbuf_pool == NULL)
         rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
 
-    single_port_param.nf_mempool = mbuf_pool;
     single_port_param.manager_mempool = manager_mbuf_pool;
 
     /* check if portmask has non-existent ports */
@@ -127,7 +145,7 @@ main(int argc, char *argv[])
 
     /* Initialize all ports. */
     for (portid = 0; portid < nb_ports; portid++)
-        if (port_init(portid, mbuf_pool, manager_mbuf_pool) == 0) {
+        if (port_init(portid) == 0) {
             #ifdef __DEBUG_LV1
             printf("Initialize port %u, finshed!\n", portid);
             #endif
@@ -138,21 +156,84 @@ main(int argc, char *argv[])
             #endif
         }
 
+    /* Replace the received packets by the benchmark trace */
+    for (portid = 0; portid < nb_ports; portid++)
+        if (enabled_port_mask & (1 << portid))
+            bench_setup(portid);
+    /* Stamp them, after the benchmark rewrote them */
+    latency_setup();
+
+    /* Create a state table per socket of nf cores or manager */
+    for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+        if (nb_socket_nf_cores[socketid] > 0 || socketid == manager_socket)
+            setup_hash(socketid);
+    }
+    /* Create the index table, its writer is the manager */
+    setup_index_hash(manager_socket);
+    setup_maglev(manager_socket);
+    if (nf_chain_has("snat"))
+        setup_snat();
+    /* Restore the flows of the previous run, before any packet is received */
+    snapshot_load(manager_socket);
+
     /* Initialize about ECMP by QiaoYi */
     ecmp_predict_init(manager_mbuf_pool);
 
-    /* Create and initialize ring between nf and manager */
-    nf_manager_ring = rte_ring_create("NF_MANAGER_RING", 1024,
-                                      rte_socket_id(),
-                                      RING_F_SP_ENQ | RING_F_SC_DEQ);
-    if (nf_manager_ring == NULL)
-        rte_exit(EXIT_FAILURE, "Cannot create ring between nf and manager\n");
-    /* Create and initialize ring for nf to wait pull state */
-    nf_pull_wait_ring = rte_ring_create("NF_PULL_WAIT_RING", 1024,
-                                      rte_socket_id(),
-                                      RING_F_SP_ENQ | RING_F_SC_DEQ);
-    if (nf_pull_wait_ring == NULL)
-        rte_exit(EXIT_FAILURE, "Cannot create ring for nf to wait pulled state\n");
+    /* Create the pool of backup requests of both IP versions, per-lcore cached */
+    flow_req_pool = rte_mempool_create("FLOW_REQ_POOL", NUM_FLOW_REQS,
+        RTE_MAX(sizeof(struct ipv4_5tuple), sizeof(struct ipv6_5tuple)),
+        MBUF_CACHE_SIZE, 0, NULL, NULL, NULL, NULL,
+        rte_lcore_to_socket_id(manager_slave_core), 0);
+    if (flow_req_pool == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot create backup request pool\n");
+
+    /* Create and initialize one ring per nf for its backup requests */
+    FOR_EACH_NF_CORE{
+        char name[RTE_RING_NAMESIZE];
+        snprintf(name, sizeof(name), "NF_MANAGER_RING_%d", i);
+        nf_manager_ring[i] = rte_ring_create(name, FLOW_REQ_RING_SIZE,
+                                             rte_lcore_to_socket_id(manager_slave_core),
+                                             RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (nf_manager_ring[i] == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create ring between nf and manager\n");
+    }
+    /* IPv6 flows are placed by the manager itself */
+    FOR_EACH_NF_CORE{
+        char name[RTE_RING_NAMESIZE];
+        snprintf(name, sizeof(name), "NF_MANAGER_RING6_%d", i);
+        nf_manager_ring6[i] = rte_ring_create(name, FLOW_REQ_RING_SIZE,
+                                              rte_lcore_to_socket_id(manager_core),
+                                              RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (nf_manager_ring6[i] == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create ring between nf and manager\n");
+    }
+    /* Create and initialize one ring per nf for the control messages it gets */
+    FOR_EACH_NF_CORE{
+        char name[RTE_RING_NAMESIZE];
+        snprintf(name, sizeof(name), "NF_CTRL_RING_%d", i);
+        nf_ctrl_ring[i] = rte_ring_create(name, 1024,
+                                          rte_lcore_to_socket_id(manager_core),
+                                          RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (nf_ctrl_ring[i] == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create ring for nf control messages\n");
+    }
+    /* Create the pool of pull replies, per-lcore cached */
+    pull_reply_pool = rte_mempool_create("PULL_REPLY_POOL", NUM_PULL_REPLIES,
+        sizeof(struct pull_reply), MBUF_CACHE_SIZE, 0, NULL, NULL, NULL, NULL,
+        manager_socket, 0);
+    if (pull_reply_pool == NULL)
+        rte_exit(EXIT_FAILURE, "Cannot create pull reply pool\n");
+
+    /* Create and initialize one ring per nf for the replies of its pulls */
+    FOR_EACH_NF_CORE{
+        char name[RTE_RING_NAMESIZE];
+        snprintf(name, sizeof(name), "NF_PULL_WAIT_RING_%d", i);
+        nf_pull_wait_ring[i] = rte_ring_create(name, 1024,
+                                          rte_lcore_to_socket_id(nf_insts[i].lcore_id),
+                                          RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (nf_pull_wait_ring[i] == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create ring for nf to wait pulled state\n");
+    }
 
     check_all_ports_link_status((uint8_t)nb_ports, enabled_port_mask);
 
@@ -165,12 +246,25 @@ main(int argc, char *argv[])
     // rte_eal_mp_wait_lcore();
 
     /* Launch per-lcore init on every lcore */
+    bench_start();
     rte_eal_mp_remote_launch(lcore_main_loop, NULL, CALL_MASTER);
     RTE_LCORE_FOREACH_SLAVE(lcore_id) {
         if (rte_eal_wait_lcore(lcore_id) < 0) {
             return -1;
         }
     }
+    bench_report();
+    snapshot_save();
+
+    for (portid = 0; portid < nb_ports; portid++) {
+        if ((enabled_port_mask & (1 << portid)) == 0)
+            continue;
+        printf("Closing port %d...", portid);
+        rte_eth_dev_stop(portid);
+        rte_eth_dev_close(portid);
+        printf(" Done\n");
+    }
+    printf("Bye...\n");
 
     return 0;
 }
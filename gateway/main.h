@@ -3,8 +3,13 @@
 
 #define NUM_MBUFS 8191
 #define NUM_MANAGER_MBUFS 8191
+#define NUM_PULL_REPLIES 8191
+#define NUM_FLOW_REQS 8191
+#define FLOW_REQ_RING_SIZE 1024
 #define MBUF_CACHE_SIZE 250
 #define BURST_SIZE 32
+/* packets of a burst whose headers are prefetched ahead of the parsed one */
+#define PREFETCH_OFFSET 3
 #define MAX_RX_QUEUE_PER_LCORE 16
 #define NB_SOCKETS 8
 #ifndef IPv4_BYTES
@@ -17,6 +22,8 @@
 #endif
 
 #define HASH_ENTRIES		(1024*1024*4)
+/* IPv6 flows get their own, smaller, state and index tables */
+#define HASH_ENTRIES6		(1024*1024)
 
 #define DIP_POOL_SIZE 5
 
@@ -30,37 +37,122 @@
 #define DEFAULT_HASH_FUNC       rte_jhash
 #endif
 
+/*
+ * Keep the index table in librte_efd instead of rte_hash: the two backup
+ * machines of a flow are stored as a pair of 4-bit machine ids, a few
+ * bits per flow instead of a full key and value. EFD cannot tell an
+ * unknown flow apart, it returns an arbitrary pair of ids for it.
+ */
+//#define INDEX_TABLE_EFD
+
 /* Configuration about ECMP */
 #define N_MACHINE_MAX 8
+#define N_MACHINE_DEFAULT 4
 #define N_INTERFACE_MAX 48
 
+#ifdef INDEX_TABLE_EFD
+#include <rte_efd.h>
+#if N_MACHINE_MAX > 15 || RTE_EFD_VALUE_NUM_BITS < 8
+#error "an EFD index value holds two 4-bit machine ids"
+#endif
+#define INDEX_EFD_VALUE(id0, id1) ((efd_value_t)((id0) | ((id1) << 4)))
+#define INDEX_EFD_ID0(value) ((value) & 0x0F)
+#define INDEX_EFD_ID1(value) (((value) >> 4) & 0x0F)
+#endif
+
 #define TIMER_RESOLUTION_CYCLES 2399987461ULL
 
-// core distribution
-#define CPU_SOCKET_COUNT 1
-#define NF_CORE_COUNT 2
-#define MANAGER_CORE 1
-#define MANAGER_SLAVE_CORE 3
+/*
+ * Flow aging. Flow times are coarse tsc (tsc >> FLOW_TIME_SHIFT) in 32
+ * bits, compared with modular arithmetic. The manager visits
+ * AGING_BUDGET state slots per loop and removes the flows idle for
+ * longer than their timeout, together with their remote copies. Once
+ * every FLOW_BACKUP_REFRESH it sends the backups of the flows that saw
+ * packets since the last time again, and drops the backup copies whose
+ * owner did not refresh them for FLOW_BACKUP_TIMEOUT, in case its
+ * teardown was lost or the owner is gone.
+ */
+#define FLOW_TIME_SHIFT 20
+#define FLOW_IDLE_TIMEOUT ((TIMER_RESOLUTION_CYCLES * 60) >> FLOW_TIME_SHIFT)
+#define FLOW_CLOSE_TIMEOUT ((TIMER_RESOLUTION_CYCLES * 2) >> FLOW_TIME_SHIFT)
+#define FLOW_BACKUP_REFRESH ((TIMER_RESOLUTION_CYCLES * 30) >> FLOW_TIME_SHIFT)
+#define FLOW_BACKUP_TIMEOUT ((TIMER_RESOLUTION_CYCLES * 180) >> FLOW_TIME_SHIFT)
+#define AGING_BUDGET 64
+
+/* Flows parked on an nf core while their state is pulled */
+#define PULL_PENDING_FLOWS 64
+#define PULL_PENDING_PKTS 8
+#define PULL_TIMEOUT_CYCLES (TIMER_RESOLUTION_CYCLES/200)
+
+/*
+ * Packets an nf core forwards wait in a tx buffer per port, sent when it
+ * is full or at the latest NF_TX_DRAIN_CYCLES (~100us) later
+ */
+#define NF_TX_BUFFER_SIZE BURST_SIZE
+#define NF_TX_DRAIN_CYCLES (TIMER_RESOLUTION_CYCLES/10000)
+
+/*
+ * SYN cookies. Cookies are valid for two slots of 2^SYN_COOKIE_SLOT_SHIFT
+ * tsc (~2s each); a flow whose cookie came back may open for
+ * SYN_VERIFIED_TIMEOUT, remembered by each nf core in SYN_VERIFIED_SLOTS
+ * slots.
+ */
+#define SYN_COOKIE_SLOT_SHIFT 32
+#define SYN_VERIFIED_SLOTS 4096
+#define SYN_VERIFIED_TIMEOUT ((TIMER_RESOLUTION_CYCLES * 10) >> FLOW_TIME_SHIFT)
+
+/*
+ * Control records to the same machine are coalesced into one packet,
+ * sent once the next record does not fit in CTRL_MTU or the oldest one
+ * has waited CTRL_FLUSH_CYCLES (~50us).
+ */
+#define CTRL_MTU 1500
+#define CTRL_FLUSH_CYCLES (TIMER_RESOLUTION_CYCLES/20000)
+
+/*
+ * Bulk migration. A machine that joins or replaces another asks its peers
+ * for their states (proto 0xA5); each peer walks its state tables then
+ * its index table, MIGRATE_BUDGET slots per manager loop. Of the flows it
+ * owns it hands over those the ECMP model places on the requester as
+ * CTRL_FMT_MIGRATE state backup packets, keeping a backup copy, and sends
+ * the requester's backups as plain ones; then all the indexes as keyset
+ * packets, at most migrate_rate packets per second with bursts of
+ * MIGRATE_BURST.
+ */
+#define MIGRATE_BUDGET 256
+#define MIGRATE_BURST 32
+#define MIGRATE_RATE_DEFAULT 100000
 
-// rss reta parameter
-#define RSS_RETA_COUNT 8
-#define RSS_RETA_SIZE 512
+// core distribution, set on the command line
+// nf cores are the enabled lcores left after manager and manager-slave
+#define NF_CORE_MAX 64
+#define MANAGER_CORE_DEFAULT 1
+#define MANAGER_SLAVE_CORE_DEFAULT 3
+
+// rss reta parameter, the largest table a port may have
+#define RSS_RETA_COUNT (ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE)
 
 // queue on each port of a NIC
-#define RX_QUEUE_COUNT (NF_CORE_COUNT + 1)
-#define TX_QUEUE_COUNT (NF_CORE_COUNT + 2)
-// by default, the first NF_CORE_COUNT queues of rx/tx are reserved for nf
+#define RX_QUEUE_COUNT (nb_nf_cores + 1)
+#define TX_QUEUE_COUNT (nb_nf_cores + 2)
+// the first nb_nf_cores queues of rx/tx are reserved for nf
 // the last rx_queue is for manager
 // the last 2 tx_queues are for manager and its slave respectively
 #define MANAGER_RX_QUEUE (RX_QUEUE_COUNT - 1)
-#define MANAGER_TX_QUEUE (RX_QUEUE_COUNT - 1)
-#define MANAGER_SLAVE_TX_QUEUE (RX_QUEUE_COUNT - 2)
+#define MANAGER_TX_QUEUE (TX_QUEUE_COUNT - 2)
+#define MANAGER_SLAVE_TX_QUEUE (TX_QUEUE_COUNT - 1)
+
+#define FOR_EACH_NF_CORE for(i = 0;i < nb_nf_cores;i++)
 
-#define FOR_EACH_NF_CORE for(i = 0;i < NF_CORE_COUNT;i++)
+// control messages between gateways are sent to 172.16.0.0/16
+#define CTRL_NET IPv4(172, 16, 0, 0)
+#define CTRL_NET_MASK IPv4(255, 255, 0, 0)
 
 #define IP_PROTO_TCP 6
 #define IP_PROTO_UDP 17
+#define TCP_FLAG_FIN 0x01
 #define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
 #define TCP_FLAG_ACK 0x10
 #define TCP_FLAG_SA (TCP_FLAG_SYN | TCP_FLAG_ACK)
 
@@ -76,15 +168,35 @@
 
 
 struct nf_states{
-    uint32_t ipserver; //Load Balancer
+    uint32_t ipserver; //Load Balancer, for IPv6 see LB_BACKEND6_KEEP
 
-    uint32_t dip; //NAT
+    uint32_t dip; //NAT: translated source address and port
     uint16_t dport;
 
     uint32_t bip; // Backup Machine IP
 
+    uint32_t last_seen; // Aging: flow time of the last packet
+    uint8_t flags; // NF_STATE_F_*
+    uint8_t fw_state; // Firewall: NF_FW_*
 };
 
+/* backup copy of a remote flow, removed by its owner's teardown or aged */
+#define NF_STATE_F_BACKUP 0x01
+/* FIN or RST seen, aged with FLOW_CLOSE_TIMEOUT */
+#define NF_STATE_F_CLOSING 0x02
+
+/* TCP states of the firewall; 0 is a flow it has not tracked from its SYN */
+#define NF_FW_SYN_SENT 1
+#define NF_FW_ESTABLISHED 2
+#define NF_FW_CLOSING 3
+
+#include <rte_cycles.h>
+static inline uint32_t
+flow_time_now(void)
+{
+    return (uint32_t)(rte_rdtsc() >> FLOW_TIME_SHIFT);
+}
+
 struct nf_indexs{
     uint32_t backupip[2];
 };
@@ -110,8 +222,117 @@ union ipv4_5tuple_host {
     xmm_t xmm;
 };
 
+#define IPV6_ADDR_LEN 16
+
+/* Addresses as in the header, ports in host order like ipv4_5tuple */
+struct ipv6_5tuple {
+    uint8_t  ip_dst[IPV6_ADDR_LEN];
+    uint8_t  ip_src[IPV6_ADDR_LEN];
+    uint16_t port_dst;
+    uint16_t port_src;
+    uint8_t  proto;
+};
+
+/*
+ * Key of the IPv6 tables: 48 bytes, three xmm words, which rte_hash
+ * compares with its vector 48-byte compare.
+ */
+union ipv6_5tuple_host {
+    struct {
+        uint16_t pad0;
+        uint8_t  proto;
+        uint8_t  pad1;
+        uint8_t  ip_src[IPV6_ADDR_LEN];
+        uint8_t  ip_dst[IPV6_ADDR_LEN];
+        uint16_t port_src;
+        uint16_t port_dst;
+        uint64_t reserve;
+    };
+    xmm_t xmm[3];
+};
+
+/* Records of the control messages and of the table snapshots */
+struct states_5tuple_pair {
+    struct ipv4_5tuple l4_5tuple;
+    struct nf_states states;
+};
+
+struct indexs_5tuple_pair {
+    struct ipv4_5tuple l4_5tuple;
+    struct nf_indexs indexs;
+};
+
+/* Records of IPv6 flows, CTRL_FMT_RECORDS6 in batches */
+struct states_5tuple6_pair {
+    struct ipv6_5tuple l4_5tuple;
+    struct nf_states states;
+};
+
+struct indexs_5tuple6_pair {
+    struct ipv6_5tuple l4_5tuple;
+    struct nf_indexs indexs;
+};
+
+/*
+ * Answer to a state pull, handed from the manager to the nf core that
+ * asked for it. states is NULL if the backup machine had no state.
+ */
+struct pull_reply {
+    union {
+        struct ipv4_5tuple l4_5tuple;
+        struct ipv6_5tuple l6_5tuple; /* if ipv6 */
+    };
+    uint8_t ipv6;
+    struct nf_states *states;
+};
+
+/*
+ * Backend update message (proto A4), weight 0 removes the backend.
+ * Fields in network order.
+ */
+struct lb_backend_update {
+    uint32_t ip;
+    uint16_t weight;
+} __attribute__((__packed__));
+
+/*
+ * Header of a batched control message, followed by count records. State
+ * pulls and their replies are batches of one record.
+ */
+struct ctrl_batch_hdr {
+    uint16_t count;
+    uint8_t format; // CTRL_FMT_*
+    uint8_t reserved;
+};
+
+/* records are the plain structs of the message type */
+#define CTRL_FMT_RECORDS 0
+/*
+ * keyset records with backup machines as topo indexes, and the
+ * destination only when it differs from the previous record
+ */
+#define CTRL_FMT_KEYSET_COMPACT 1
+/* records of IPv6 flows, ipv6_5tuple instead of ipv4_5tuple */
+#define CTRL_FMT_RECORDS6 2
+/* state records of a migration, the receiver owns them from now on */
+#define CTRL_FMT_MIGRATE 3
+/* snat_record keyset records, sent to every machine */
+#define CTRL_FMT_SNAT 4
+
+/*
+ * NAT port of a flow for the reverse translation of the machines the
+ * server's answers may reach, server_ip 0 releases it. Host order.
+ */
+struct snat_record {
+    struct ipv4_5tuple l4_5tuple;
+    uint32_t server_ip;
+    uint16_t port;
+};
+
 struct port_param {
-    struct rte_mempool* nf_mempool;
+    /* rx pools of the nf queues, on the socket of their nf core */
+    struct rte_mempool* nf_mempool[NB_SOCKETS];
+    /* rx pool of the manager queue and control packets, on its socket */
     struct rte_mempool* manager_mempool;
 };
 
@@ -124,19 +345,95 @@ struct nf_inst_info {
     uint8_t nf_id;
     uint16_t rx_queue_id;
     uint16_t tx_queue_id;
-    unsigned hash_table_index;
+    unsigned lcore_id;
 };
 
-#include <rte_rwlock.h>
-extern rte_rwlock_t numa_hash_lock;
+#include <rte_spinlock.h>
+/*
+ * rte_hash does not support a lookup concurrent with an add or a delete:
+ * a key may be moving between buckets or its slot being reused. The
+ * tables shared between cores are sequence locked instead. A writer makes
+ * seq odd while it changes the hash and even again after, a lookup is
+ * retried if seq was odd or changed under it. Lookups write nothing
+ * shared, so their cost does not grow with the number of cores; writers
+ * serialize among themselves.
+ */
+static inline uint32_t
+table_read_begin(const volatile uint32_t *seq)
+{
+    uint32_t s;
+
+    while ((s = *seq) & 1)
+        rte_pause();
+    rte_smp_rmb();
+    return s;
+}
+
+static inline int
+table_read_retry(const volatile uint32_t *seq, uint32_t s)
+{
+    rte_smp_rmb();
+    return *seq != s;
+}
+
+static inline void
+table_write_begin(volatile uint32_t *seq)
+{
+    (*seq)++;
+    rte_smp_wmb();
+}
+
+static inline void
+table_write_end(volatile uint32_t *seq)
+{
+    rte_smp_wmb();
+    (*seq)++;
+}
 
-// nf instance infos
-extern struct nf_inst_info nf_insts[NF_CORE_COUNT];
+/*
+ * State table of one socket, in the memory of that socket. A flow is set
+ * in the table of the socket of the nf core serving it (RSS keeps a flow
+ * on one nf core) and backups received by the manager in the manager's,
+ * so nf cores mostly look up local memory and only fall back to the
+ * other sockets on a miss.
+ */
+struct state_table {
+    struct rte_hash *hash;
+    /* values, indexed by the key position returned by rte_hash */
+    struct nf_states *states;
+    /* serializes the writers: nf cores adding flows, the manager */
+    rte_spinlock_t lock;
+    /* see table_read_begin() */
+    volatile uint32_t seq;
+} __rte_cache_aligned;
+
+// core distribution and nf instance infos, see setup_lcores()
+extern uint16_t nb_nf_cores;
+extern unsigned manager_core;
+extern unsigned manager_slave_core;
+extern struct nf_inst_info *nf_insts;
+// nf_id of each lcore, -1 if the lcore is not a nf core
+extern int16_t lcore_nf_map[RTE_MAX_LCORE];
+// entries of the state and index tables
+extern uint32_t flow_entries;
+// entries of the IPv6 state and index tables
+extern uint32_t flow_entries6;
 
 extern struct port_param single_port_param;
 
-extern struct rte_ring* nf_manager_ring;
-extern struct rte_ring* nf_pull_wait_ring;
+/*
+ * ol_flags the nf cores set on rewritten TCP packets of a port, 0 when
+ * the port cannot offload both the IPv4 and TCP checksums
+ */
+extern uint64_t port_tx_cksum_flags[RTE_MAX_ETHPORTS];
+
+/* Backup requests of new flows, one ring per nf to the manager slave */
+extern struct rte_ring* nf_manager_ring[NF_CORE_MAX];
+/* Backup requests of new IPv6 flows, to the manager (no ECMP probes) */
+extern struct rte_ring* nf_manager_ring6[NF_CORE_MAX];
+extern struct rte_ring* nf_pull_wait_ring[NF_CORE_MAX];
+/* Control messages an nf core received, when the port could not steer them */
+extern struct rte_ring* nf_ctrl_ring[NF_CORE_MAX];
 
 extern int enabled_port_mask;
 
@@ -144,8 +441,38 @@ extern uint8_t debug_mode;
 
 extern uint32_t dip_pool[DIP_POOL_SIZE];
 
-extern struct rte_hash *state_hash_table[NB_SOCKETS];
-extern struct rte_hash *index_hash_table[NB_SOCKETS];
+/* state tables of the sockets with a nf core or the manager, see setup_hash() */
+extern struct state_table state_tables[NB_SOCKETS];
+/* one index table shared by all nf cores and the manager */
+#ifdef INDEX_TABLE_EFD
+extern struct rte_efd_table *index_efd_table;
+#else
+extern struct rte_hash *index_hash_table;
+#endif
+/*
+ * Values of the tables, stored inline in arrays indexed by the key
+ * position returned by rte_hash, so setting up a flow allocates nothing.
+ */
+#ifndef INDEX_TABLE_EFD
+extern struct nf_indexs *flow_indexs;
+/*
+ * Sequence count of the index hash table, see table_read_begin(). The
+ * manager is its only writer and takes no lock.
+ */
+extern volatile uint32_t index_seq;
+#endif
+/*
+ * IPv6 counterparts, same layout. The IPv6 index table is an rte_hash
+ * even with INDEX_TABLE_EFD.
+ */
+extern struct state_table state_tables6[NB_SOCKETS];
+extern struct rte_hash *index_hash_table6;
+extern struct nf_indexs *flow_indexs6;
+extern volatile uint32_t index_seq6;
+/* Pull replies on their way from the manager to the nf cores */
+extern struct rte_mempool *pull_reply_pool;
+/* 5-tuples of the backup requests in nf_manager_ring(6) */
+extern struct rte_mempool *flow_req_pool;
 
 extern struct machine_IP_pair topo[N_MACHINE_MAX];
 extern struct machine_IP_pair* this_machine;
@@ -153,38 +480,333 @@ extern struct rte_mbuf* probing_packet;
 extern struct ether_addr interface_MAC;
 extern uint32_t broadcast_ip;
 extern uint32_t this_machine_index;
+/* number of machines in topo, set on the command line */
+extern uint32_t n_machines;
+/* send keysets with CTRL_FMT_KEYSET_COMPACT */
+extern uint8_t keyset_compact;
+
+/*
+ * Software model of the switch ECMP hash. Once a few probes have shown
+ * which machine each hash bucket goes to, the manager places the backups
+ * of new flows itself instead of probing for every flow.
+ */
+#define ECMP_MODEL_NONE 0
+#define ECMP_MODEL_CRC 1
+#define ECMP_MODEL_TOEPLITZ 2
+/* header fields the switch hashes */
+#define ECMP_F_SIP 0x01
+#define ECMP_F_DIP 0x02
+#define ECMP_F_SPORT 0x04
+#define ECMP_F_DPORT 0x08
+#define ECMP_F_PROTO 0x10
+#define ECMP_F_ALL 0x1f
+/* probes of the calibration */
+#define ECMP_CALIB_PROBES 32
+
+extern uint8_t ecmp_model;
+extern uint8_t ecmp_fields;
+extern uint32_t ecmp_seed;
+/* set by the manager when the calibration agrees with the switch */
+extern volatile uint8_t ecmp_model_ready;
+
+/*
+ * Gateway statistics. Every lcore counts in its own cache-aligned block,
+ * so counting causes no false sharing and needs no atomics; the manager
+ * sums the blocks every second and publishes the totals with
+ * librte_metrics (names in gw_stat_names, same order).
+ */
+enum gw_stat {
+    /* Data nf received and transmitted statistics */
+    GW_STAT_NF_RX_PKTS,
+    GW_STAT_NF_RX_BYTES,
+    GW_STAT_NF_TX_PKTS,
+    GW_STAT_NF_TX_BYTES,
+    GW_STAT_FLOWS,
+    GW_STAT_MALICIOUS_PKTS,
+    GW_STAT_NF_DROPPED_PKTS,
+    GW_STAT_AGED_FLOWS,
+    /* tsc nf cores spent on the bursts they received */
+    GW_STAT_NF_CYCLES,
+    /* packets of a flow without state on the nf core, pulls it sent */
+    GW_STAT_STATE_MISSES,
+    GW_STAT_STATE_PULLS,
+    /* SYNs answered with a cookie, cookies that came back */
+    GW_STAT_SYN_COOKIES,
+    GW_STAT_SYN_VERIFIED,
+    /* Control messages of manager and manager slave */
+    GW_STAT_CTRL_RX_PKTS,
+    GW_STAT_CTRL_RX_BYTES,
+    GW_STAT_CTRL_TX_PKTS,
+    GW_STAT_CTRL_TX_BYTES,
+    GW_STAT_ECMP_CTRL_TX_BYTES,
+    GW_STAT_KEYSET_CTRL_TX_BYTES,
+    GW_STAT_STATE_BACKUP_CTRL_TX_BYTES,
+    GW_STAT_STATE_PULL_CTRL_TX_BYTES,
+    GW_STAT_COUNT
+};
+
+struct lcore_stats {
+    uint64_t c[GW_STAT_COUNT];
+    uint64_t last_rx_burst;
+} __rte_cache_aligned;
+
+extern struct lcore_stats lcore_stats[RTE_MAX_LCORE];
+
+/* Count on the calling lcore; nf cores cache their block instead */
+static inline void
+lcore_stat_add(enum gw_stat stat, uint64_t value)
+{
+    lcore_stats[rte_lcore_id()].c[stat] += value;
+}
+
+/* print the statistics every second, besides publishing them */
+extern uint8_t print_stats;
+/* set by a signal, every lcore loop returns */
+extern volatile uint8_t force_quit;
+extern uint32_t migrate_rate;
+extern uint8_t migrate_on_start;
+
+/*
+ * NF chain. The TCP packets of a burst that have a flow state go through
+ * the configured stages in order; a stage handles the whole burst in one
+ * pass and drops a packet by setting its bit in drop_mask. IPv6 bursts
+ * only go through the stages with IPv6 hooks.
+ */
+#include <rte_ip.h>
+#include <rte_tcp.h>
+#define NF_CHAIN_MAX 8
+/* stages run when --nf-chain is not given */
+#define NF_CHAIN_DEFAULT "lb"
+
+struct nf_burst {
+    uint8_t port;
+    uint16_t nb_pkts;
+    uint64_t drop_mask;
+    struct rte_mbuf *pkts[BURST_SIZE];
+    union {
+        struct ipv4_hdr *ip_hdrs[BURST_SIZE];
+        struct ipv6_hdr *ip6_hdrs[BURST_SIZE]; /* bursts of nf_chain_run6() */
+    };
+    struct tcp_hdr *tcp_hdrs[BURST_SIZE];
+    struct nf_states *states[BURST_SIZE];
+    /* 5-tuples of the packets as received */
+    union {
+        const struct ipv4_5tuple *keys[BURST_SIZE];
+        const struct ipv6_5tuple *keys6[BURST_SIZE];
+    };
+};
+
+struct nf_stage {
+    const char *name;
+    /* set up the state of a new flow from its SYN, <0 refuses the flow */
+    int (*flow_init)(struct nf_states *state, const struct ipv4_5tuple *key,
+                     const struct tcp_hdr *tcp_h, uint32_t hash);
+    /* the flow key of state is gone, may be NULL */
+    void (*flow_release)(const struct nf_states *state,
+                         const struct ipv4_5tuple *key);
+    /* state was restored from a snapshot, take back what it holds; may be NULL */
+    void (*flow_restore)(const struct nf_states *state,
+                         const struct ipv4_5tuple *key);
+    void (*burst)(struct nf_burst *b);
+    /* flow_init and burst of IPv6 flows, NULL if the stage leaves them be */
+    int (*flow_init6)(struct nf_states *state, const struct ipv6_5tuple *key,
+                      const struct tcp_hdr *tcp_h, uint32_t hash);
+    void (*burst6)(struct nf_burst *b);
+};
+
+/*
+ * Maglev load balancing: the server of a new flow is the slot its hash
+ * falls in, the slots are shared among the backends by weight.
+ */
+#define LB_BACKEND_MAX 64
+/* prime, much larger than the number of backends */
+#define MAGLEV_TABLE_SIZE 65537
+
+struct lb_backend {
+    uint32_t ip;
+    uint16_t weight;
+};
 
-extern uint32_t flow_counts;
-extern uint32_t last_flow_counts;
-extern uint32_t malicious_packet_counts;
-/* Data nf received statistics */
-extern unsigned long long nf_rx_bytes[NF_CORE_COUNT];
-extern unsigned long long last_nf_rx_bytes[NF_CORE_COUNT];
-extern unsigned long long nf_rx_pkts[NF_CORE_COUNT];
-extern unsigned long long last_nf_rx_pkts[NF_CORE_COUNT];
-/* Data nf transmitted statistics */
-extern unsigned long long nf_tx_bytes[NF_CORE_COUNT];
-extern unsigned long long last_nf_tx_bytes[NF_CORE_COUNT];
-extern unsigned long long nf_tx_pkts[NF_CORE_COUNT];
-extern unsigned long long last_nf_tx_pkts[NF_CORE_COUNT];
-extern unsigned long long nf_rx[NF_CORE_COUNT];
+extern uint32_t* volatile maglev_table;
+extern struct lb_backend lb_backends_conf[LB_BACKEND_MAX];
+extern uint16_t nb_lb_backends_conf;
+
+static inline uint32_t
+maglev_lookup(uint32_t hash)
+{
+    return maglev_table[hash % MAGLEV_TABLE_SIZE];
+}
+
+/*
+ * IPv6 backends (--backends6), a static list. The ipserver of an IPv6
+ * flow is the number of its backend in the list plus one, or
+ * LB_BACKEND6_KEEP for a flow that keeps its destination.
+ */
+#define LB_BACKEND6_KEEP UINT32_MAX
+
+struct lb_backend6 {
+    uint8_t ip[IPV6_ADDR_LEN];
+    uint16_t weight;
+};
+
+extern uint32_t* maglev_table6;
+extern struct lb_backend6 lb_backends6_conf[LB_BACKEND_MAX];
+extern uint16_t nb_lb_backends6_conf;
+
+static inline uint32_t
+maglev_lookup6(uint32_t hash)
+{
+    return maglev_table6[hash % MAGLEV_TABLE_SIZE];
+}
+
+int maglev_build(const struct lb_backend* backends, uint16_t nb_backends);
+int maglev_add_backend(uint32_t ip, uint16_t weight);
+int maglev_remove_backend(uint32_t ip);
+void setup_maglev(const int socketid);
+
+int nf_chain_parse(const char *list);
+int nf_chain_flow_init(struct nf_states *state, const struct ipv4_5tuple *key,
+                       const struct tcp_hdr *tcp_h, uint32_t hash);
+void nf_chain_flow_release(const struct nf_states *state,
+                           const struct ipv4_5tuple *key);
+void nf_chain_flow_restore(const struct nf_states *state,
+                           const struct ipv4_5tuple *key);
+int nf_chain_has(const char *name);
+/* data address of the gateway for snat (--snat-ip), host order */
+extern uint32_t snat_ip;
+void setup_snat(void);
+void nf_snat_install(const struct ipv4_5tuple *key, uint32_t server_ip,
+                     uint16_t port);
+void nf_snat_release(const struct ipv4_5tuple *key, uint16_t port);
+int nf_snat_reverse(struct rte_mbuf *m, struct ipv4_hdr *ip_hdr,
+                    struct tcp_hdr *tcp_h);
+uint16_t nf_chain_run(struct nf_burst *b, struct rte_mbuf **tx_pkts,
+                      uint64_t *tx_bytes);
+int nf_chain_flow_init6(struct nf_states *state, const struct ipv6_5tuple *key,
+                        const struct tcp_hdr *tcp_h, uint32_t hash);
+uint16_t nf_chain_run6(struct nf_burst *b, struct rte_mbuf **tx_pkts,
+                       uint64_t *tx_bytes);
 
 void convert_ipv4_5tuple(struct ipv4_5tuple *key1, union ipv4_5tuple_host *key2);
-void setStates(struct ipv4_5tuple *ip_5tuple, struct nf_states *state, unsigned hash_table_index);
-int getStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state, unsigned own_hash_table_index);
-void setIndexs(struct ipv4_5tuple *ip_5tuple, struct nf_indexs *index);
+void convert_ipv4_5tuple_host(const union ipv4_5tuple_host *key1, struct ipv4_5tuple *key2);
+unsigned setStatesBulk(unsigned socket, struct ipv4_5tuple **ip_5tuples,
+	const struct nf_states *states, unsigned nb);
+struct nf_states* setStates(unsigned socket, struct ipv4_5tuple *ip_5tuple,
+          const struct nf_states *state);
+int getStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state);
+int lookupStates(const union ipv4_5tuple_host *key, struct nf_states **state);
+uint64_t getStatesBulk(union ipv4_5tuple_host *keys, uint32_t nb_keys,
+          struct nf_states **states, uint64_t *remote_mask);
+void setIndexs(struct ipv4_5tuple *ip_5tuple, const struct nf_indexs *index);
 int getIndexs(struct ipv4_5tuple *ip_5tuple, struct nf_indexs **index);
-int pullState(uint16_t nf_id, uint8_t port, struct ipv4_5tuple* ip_5tuple,
-          struct nf_indexs* target_indexs, struct nf_states** target_states);
-int port_init(uint8_t port, struct rte_mempool *mbuf_pool, struct rte_mempool *manager_mbuf_pool);
+int delStates(const union ipv4_5tuple_host *key);
+int delIndexs(const union ipv4_5tuple_host *key);
+void convert_ipv6_5tuple(const struct ipv6_5tuple *key1, union ipv6_5tuple_host *key2);
+void convert_ipv6_5tuple_host(const union ipv6_5tuple_host *key1, struct ipv6_5tuple *key2);
+struct nf_states* setStates6(unsigned socket, const struct ipv6_5tuple *ip_5tuple,
+          const struct nf_states *state);
+int getStates6(const struct ipv6_5tuple *ip_5tuple, struct nf_states **state);
+uint64_t getStatesBulk6(union ipv6_5tuple_host *keys, uint32_t nb_keys,
+          struct nf_states **states, uint64_t *remote_mask);
+int delStates6(const union ipv6_5tuple_host *key);
+void setIndexs6(const struct ipv6_5tuple *ip_5tuple, const struct nf_indexs *index);
+int getIndexs6(const struct ipv6_5tuple *ip_5tuple, struct nf_indexs **index);
+int delIndexs6(const union ipv6_5tuple_host *key);
+void nf_arp_process(uint8_t port, struct ether_hdr *eth_hdr,
+	uint16_t tx_queue_id, struct rte_mbuf ** bufs_i);
+int pullState(uint16_t nf_id, uint8_t port, uint16_t tx_queue_id,
+          struct ipv4_5tuple* ip_5tuple, struct nf_indexs* target_indexs);
+int pullState6(uint16_t nf_id, uint8_t port, uint16_t tx_queue_id,
+          const struct ipv6_5tuple* ip_5tuple, const struct nf_indexs* target_indexs);
+/*
+ * Offline benchmark, see bench.c. Synthetic flows are numbered per nf
+ * core, at most BENCH_FLOWS_MAX of them each.
+ */
+#define BENCH_FLOWS_DEFAULT 65536
+#define BENCH_FLOWS_MAX (1 << 18)
+#define BENCH_SIZES_MAX 256
+#define BENCH_SIZES_DEFAULT "64"
+
+extern uint32_t bench_seconds;
+extern uint8_t bench_replay;
+extern uint32_t bench_flows;
+extern uint32_t bench_new_flow_rate;
+
+int bench_parse_sizes(const char *list);
+void bench_setup(uint8_t port);
+void bench_start(void);
+void bench_report(void);
+
+/*
+ * Latency by path, see latency.c. Bucket b of a histogram counts the
+ * packets that took [2^b, 2^(b+1)) tsc cycles from rx to tx.
+ */
+#define GW_LATENCY_MZ "gw_latency"
+#define GW_LAT_BUCKETS 64
+
+enum gw_lat_path {
+    GW_LAT_LOCAL,     /* state in the table of this socket */
+    GW_LAT_REMOTE,    /* state in the table of another socket */
+    GW_LAT_PULL,      /* parked until a pull reply brought the state */
+    GW_LAT_NEW,       /* SYN of a new flow */
+    GW_LAT_MG_BACKUP, /* state backup applied by the manager */
+    GW_LAT_MG_KEYSET, /* keyset applied by the manager */
+    GW_LAT_COUNT
+};
+/* path of the packets that are not counted */
+#define GW_LAT_NONE GW_LAT_COUNT
+
+struct gw_latency_hist {
+    uint64_t count[GW_LAT_COUNT][GW_LAT_BUCKETS];
+} __rte_cache_aligned;
+
+/* Layout of the GW_LATENCY_MZ memzone */
+struct gw_latency {
+    uint64_t tsc_hz;
+    struct gw_latency_hist lcore[RTE_MAX_LCORE];
+};
+
+extern uint8_t latency_enabled;
+extern struct gw_latency *gw_latency;
+
+void latency_setup(void);
+void latency_record(unsigned path, const struct rte_mbuf *m);
+void latency_record_tx(const uint64_t *paths, const uint64_t *rx_tsc,
+                       uint16_t nb_pkts);
+void latency_update_metrics(void);
+
+/* SYN cookies (--syn-cookies), over syn_cookie_rate new flows/s per nf core */
+extern uint8_t syn_cookies;
+extern uint32_t syn_cookie_rate;
+
+/* Warm restart from a snapshot of the tables, see snapshot.c */
+extern char *snapshot_path;
+
+void snapshot_save(void);
+void snapshot_load(unsigned default_socket);
+
+int port_init(uint8_t port);
 int parse_args(int argc, char **argv);
-void setup_hash(const int socketid, const unsigned hash_table_index);
+void setup_hash(const int socketid);
+void setup_index_hash(const int socketid);
+void setup_lcores(void);
+void setup_metrics(void);
 void check_all_ports_link_status(uint8_t port_num, uint32_t port_mask);
 
-struct rte_mbuf* build_probe_packet(struct ipv4_5tuple* ip_5tuple);
+struct rte_mbuf* build_probe_packet(const struct ipv4_5tuple* ip_5tuple);
+uint16_t build_probe_packets(struct ipv4_5tuple** ip_5tuples,
+                             struct rte_mbuf** pkts, uint16_t nb);
 struct rte_mbuf* backup_receive_probe_packet(struct rte_mbuf* mbuf);
-void master_receive_probe_reply(struct rte_mbuf* mbuf, uint32_t* machine_ip1, uint32_t* machine_ip2, struct ipv4_5tuple** ip_5tuple);
+int master_receive_probe_reply(struct rte_mbuf* mbuf, uint32_t* index, uint32_t* machine_ip1, uint32_t* machine_ip2, struct ipv4_5tuple* ip_5tuple);
+void ecmp_backup_ips(uint32_t index, uint32_t* machine_ip1, uint32_t* machine_ip2);
+int ecmp_model_parse(const char* name);
+void ecmp_model_calibrate(uint8_t port, uint16_t tx_queue_id);
+void ecmp_model_calib_reply(const struct ipv4_5tuple* ip_5tuple, uint32_t index);
+int ecmp_model_index(const struct ipv4_5tuple* ip_5tuple);
+int ecmp_model_owner(const struct ipv4_5tuple* ip_5tuple);
 void ecmp_predict_init(struct rte_mempool * mbuf_pool);
+uint8_t machine_id(uint32_t machine_ip);
+uint32_t machine_ip(uint8_t id);
 
 int lcore_nf(/*__attribute__((unused)) void *arg, */const struct nf_inst_info* nf_info);
 int lcore_manager(__attribute__((unused)) void *arg);
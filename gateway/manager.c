@@ -17,147 +17,178 @@
 #include <rte_malloc.h>
 #include <rte_debug.h>
 #include <rte_timer.h>
+#include <rte_metrics.h>
 
 
 #include "main.h"
 
-struct states_5tuple_pair {
-    struct ipv4_5tuple l4_5tuple;
-    struct nf_states states;
+/*
+ * CTRL_FMT_KEYSET_COMPACT record: backup machines are topo index + 1
+ * (0 for none), and a keyset_compact_dst follows only if
+ * KEYSET_COMPACT_F_DST is set, otherwise the destination of the previous
+ * record in the packet is reused.
+ */
+struct keyset_compact_rec {
+    uint8_t flags;
+    uint8_t backup[2];
+    uint32_t ip_src;
+    uint16_t port_src;
+} __rte_packed;
+
+struct keyset_compact_dst {
+    uint32_t ip_dst;
+    uint16_t port_dst;
+    uint8_t proto;
+} __rte_packed;
+
+#define KEYSET_COMPACT_F_DST 0x01
+
+/* Control packet being filled with records for one machine */
+struct ctrl_batch {
+    struct rte_mbuf* packet;
+    struct ctrl_batch_hdr* hdr;
+    uint8_t port;
+    uint64_t start_tsc;
+    /* destination of the last compact keyset record in the packet */
+    struct ipv4_5tuple last_key;
 };
 
-struct indexs_5tuple_pair {
-    struct ipv4_5tuple l4_5tuple;
-    struct nf_indexs indexs;
+/* General state backups and keysets waiting to be sent, per topo index */
+static struct ctrl_batch backup_batches[N_MACHINE_MAX];
+static struct ctrl_batch keyset_batches[N_MACHINE_MAX];
+/* the same for IPv6 flows, their records do not mix with IPv4 ones */
+static struct ctrl_batch backup6_batches[N_MACHINE_MAX];
+static struct ctrl_batch keyset6_batches[N_MACHINE_MAX];
+/* NAT ports of the snat flows opened or closed here, for every machine */
+static struct ctrl_batch snat_batches[N_MACHINE_MAX];
+/* Flows torn down here, CTRL_FMT_RECORDS and CTRL_FMT_RECORDS6 */
+static struct ctrl_batch teardown_batches[N_MACHINE_MAX];
+static struct ctrl_batch teardown6_batches[N_MACHINE_MAX];
+
+/* Bulk migration of the state tables to a machine, see MIGRATE_BUDGET */
+struct migration {
+    uint32_t target_ip; /* 0 when no migration runs */
+    unsigned socket;
+    uint32_t next; /* rte_hash_iterate() cursor in the table of socket */
+    uint64_t credit; /* tsc the rate still allows to spend */
+    uint64_t last_tsc;
+    uint64_t nb_records;
+    uint64_t nb_backups;
+    uint64_t nb_indexs;
+    /* states handed over then indexes, and the backups the target holds */
+    struct ctrl_batch batch;
+    struct ctrl_batch backup_batch;
 };
+static struct migration migration;
 
 static struct rte_timer manager_timer;
-/* Control message received statistics */
-static unsigned long long ctrl_rx_bytes = 0;
-static unsigned long long last_ctrl_rx_bytes = 0;
-static unsigned long long ctrl_rx_pkts = 0;
-static unsigned long long last_ctrl_rx_pkts = 0;
-/* Control message transmitted statistics */
-static unsigned long long ctrl_tx_bytes = 0;
-static unsigned long long last_ctrl_tx_bytes = 0;
-static unsigned long long ctrl_tx_pkts = 0;
-static unsigned long long last_ctrl_tx_pkts = 0;
-
-static unsigned long long ecmp_ctrl_tx_bytes = 0;
-static unsigned long long last_ecmp_ctrl_tx_bytes = 0;
-static unsigned long long keyset_ctrl_tx_bytes = 0;
-static unsigned long long last_keyset_ctrl_tx_bytes = 0;
-static unsigned long long state_backup_ctrl_tx_bytes = 0;
-static unsigned long long last_state_backup_ctrl_tx_bytes = 0;
-static unsigned long long state_pull_ctrl_tx_bytes = 0;
-static unsigned long long last_state_pull_ctrl_tx_bytes = 0;
+
+/* Metric names, in enum gw_stat order */
+static const char* const gw_stat_names[GW_STAT_COUNT] = {
+    [GW_STAT_NF_RX_PKTS] = "gw_nf_rx_pkts",
+    [GW_STAT_NF_RX_BYTES] = "gw_nf_rx_bytes",
+    [GW_STAT_NF_TX_PKTS] = "gw_nf_tx_pkts",
+    [GW_STAT_NF_TX_BYTES] = "gw_nf_tx_bytes",
+    [GW_STAT_FLOWS] = "gw_flows",
+    [GW_STAT_MALICIOUS_PKTS] = "gw_malicious_pkts",
+    [GW_STAT_NF_DROPPED_PKTS] = "gw_nf_dropped_pkts",
+    [GW_STAT_AGED_FLOWS] = "gw_aged_flows",
+    [GW_STAT_NF_CYCLES] = "gw_nf_cycles",
+    [GW_STAT_STATE_MISSES] = "gw_state_misses",
+    [GW_STAT_STATE_PULLS] = "gw_state_pulls",
+    [GW_STAT_SYN_COOKIES] = "gw_syn_cookies",
+    [GW_STAT_SYN_VERIFIED] = "gw_syn_verified",
+    [GW_STAT_CTRL_RX_PKTS] = "gw_ctrl_rx_pkts",
+    [GW_STAT_CTRL_RX_BYTES] = "gw_ctrl_rx_bytes",
+    [GW_STAT_CTRL_TX_PKTS] = "gw_ctrl_tx_pkts",
+    [GW_STAT_CTRL_TX_BYTES] = "gw_ctrl_tx_bytes",
+    [GW_STAT_ECMP_CTRL_TX_BYTES] = "gw_ecmp_ctrl_tx_bytes",
+    [GW_STAT_KEYSET_CTRL_TX_BYTES] = "gw_keyset_ctrl_tx_bytes",
+    [GW_STAT_STATE_BACKUP_CTRL_TX_BYTES] = "gw_state_backup_ctrl_tx_bytes",
+    [GW_STAT_STATE_PULL_CTRL_TX_BYTES] = "gw_state_pull_ctrl_tx_bytes",
+};
+
+/* First metric id of the gateway statistics */
+static int gw_stat_base = -1;
+/* Totals of the previous second, for the printed rates */
+static uint64_t last_totals[GW_STAT_COUNT];
+static uint64_t last_nf_stats[NF_CORE_MAX][GW_STAT_COUNT];
+
+/*
+ * Register the gateway statistics with librte_metrics. The metrics
+ * library must be initialized before, from the primary process.
+ */
+void
+setup_metrics(void)
+{
+    gw_stat_base = rte_metrics_reg_names(gw_stat_names, GW_STAT_COUNT);
+    if (gw_stat_base < 0)
+        rte_exit(EXIT_FAILURE, "Cannot register gateway metrics\n");
+}
 
 static void
 manager_timer_cb(__attribute__((unused)) struct rte_timer *tim,
          __attribute__((unused)) void *arg)
 {
-    int i;
-    // printf("Manager Statistics\n");
-    // printf("ctrl_rx_throughput: %llu Mbps, ctrl_tx_throughput: %llu Mbps\n",
-    //        (ctrl_rx_bytes - last_ctrl_rx_bytes) * 8 / 1024 / 1024,
-    //        (ctrl_tx_bytes - last_ctrl_tx_bytes) * 8 / 1024 / 1024);
-    // printf("ctrl_rx_bytes: %llu, ctrl_tx_bytes: %llu\n",
-    //        ctrl_rx_bytes, ctrl_tx_bytes);
-
-    // printf("ctrl_tx_bytes_sec: %llu\n",ctrl_tx_bytes - last_ctrl_tx_bytes);
-    // printf("state_pull_ctrl_tx_bytes_sec: %llu\n",state_pull_ctrl_tx_bytes - last_state_pull_ctrl_tx_bytes);
-    // printf("ecmp_ctrl_tx_bytes_sec: %llu\n",ecmp_ctrl_tx_bytes - last_ecmp_ctrl_tx_bytes);
-    // printf("state_backup_ctrl_tx_bytes_sec: %llu\n",state_backup_ctrl_tx_bytes - last_state_backup_ctrl_tx_bytes);
-    // printf("keyset_ctrl_tx_bytes_sec: %llu\n",keyset_ctrl_tx_bytes - last_keyset_ctrl_tx_bytes);
-    // printf("ctrl_rx_pkts_sec: %llu, ctrl_tx_pkts_sec: %llu\n",
-    //        ctrl_rx_pkts - last_ctrl_rx_pkts,
-    //        ctrl_tx_pkts - last_ctrl_tx_pkts);
-    // printf("ctrl_rx_pkts: %llu, ctrl_tx_pkts: %llu\n",
-    //        ctrl_rx_pkts, ctrl_tx_pkts);
-
-    unsigned long long total_nf_rx_bytes = 0, total_nf_rx_pkts = 0,
-        total_last_nf_rx_bytes = 0, total_last_nf_rx_pkts = 0,
-        total_nf_tx_bytes = 0, total_nf_tx_pkts = 0,
-        total_last_nf_tx_bytes = 0, total_last_nf_tx_pkts = 0;
+    uint64_t totals[GW_STAT_COUNT] = {0};
+    const uint64_t* c;
+    unsigned lcore_id;
+    int i, s;
 
-    FOR_EACH_NF_CORE{
-        total_nf_rx_bytes += nf_rx_bytes[i];
-        total_nf_rx_pkts += nf_rx_pkts[i];
-        total_last_nf_rx_bytes += last_nf_rx_bytes[i];
-        total_last_nf_rx_pkts += last_nf_rx_pkts[i];
-        total_nf_tx_bytes += nf_tx_bytes[i];
-        total_nf_tx_pkts += nf_tx_pkts[i];
-        total_last_nf_tx_bytes += last_nf_tx_bytes[i];
-        total_last_nf_tx_pkts += last_nf_tx_pkts[i];
+    /* Counters only grow, a slightly stale read is fine */
+    RTE_LCORE_FOREACH(lcore_id) {
+        c = lcore_stats[lcore_id].c;
+        for (s = 0; s < GW_STAT_COUNT; s++)
+            totals[s] += c[s];
     }
+    rte_metrics_update_values(RTE_METRICS_GLOBAL, gw_stat_base,
+                              totals, GW_STAT_COUNT);
+    latency_update_metrics();
+
+    if (!print_stats)
+        return;
 
     printf("NF Statistics\n");
     FOR_EACH_NF_CORE{
-            printf("NF core No.%d\n", i);
-            printf("NF rx: %llu\n", nf_rx[i]);
-            printf("nf_rx_throughput: %llu Mbps, nf_tx_throughput: %llu Mbps\n",
-                (nf_rx_bytes[i] - last_nf_rx_bytes[i]) * 8 / 1024 / 1024,
-                (nf_tx_bytes[i] - last_nf_tx_bytes[i]) * 8 / 1024 / 1024);
-            // printf("nf_rx_bytes: %llu, nf_tx_bytes: %llu\n",
-            //        total_nf_rx_bytes, total_nf_tx_bytes);
-            printf("nf_rx_pkts_sec: %llu, nf_tx_pkts_sec: %llu\n",
-                nf_rx_pkts[i] - last_nf_rx_pkts[i],
-                nf_tx_pkts[i] - last_nf_tx_pkts[i]);
-    }
-    printf("nf_rx_throughput: %llu Mbps, nf_tx_throughput: %llu Mbps\n",
-           (total_nf_rx_bytes - total_last_nf_rx_bytes) * 8 / 1024 / 1024,
-           (total_nf_tx_bytes - total_last_nf_tx_bytes) * 8 / 1024 / 1024);
-    // printf("nf_rx_bytes: %llu, nf_tx_bytes: %llu\n",
-    //        total_nf_rx_bytes, total_nf_tx_bytes);
-    printf("nf_rx_pkts_sec: %llu, nf_tx_pkts_sec: %llu\n",
-           total_nf_rx_pkts - total_last_nf_rx_pkts,
-           total_nf_tx_pkts - total_last_nf_tx_pkts);
-    // printf("nf_rx_pkts: %llu, nf_tx_pkts: %llu\n",
-    //        total_nf_rx_pkts, total_nf_tx_pkts);
+        c = lcore_stats[nf_insts[i].lcore_id].c;
+        printf("NF core No.%d\n", i);
+        printf("NF rx: %"PRIu64"\n",
+               lcore_stats[nf_insts[i].lcore_id].last_rx_burst);
+        printf("nf_rx_throughput: %"PRIu64" Mbps, nf_tx_throughput: %"PRIu64" Mbps\n",
+               (c[GW_STAT_NF_RX_BYTES] - last_nf_stats[i][GW_STAT_NF_RX_BYTES]) * 8 / 1024 / 1024,
+               (c[GW_STAT_NF_TX_BYTES] - last_nf_stats[i][GW_STAT_NF_TX_BYTES]) * 8 / 1024 / 1024);
+        printf("nf_rx_pkts_sec: %"PRIu64", nf_tx_pkts_sec: %"PRIu64"\n",
+               c[GW_STAT_NF_RX_PKTS] - last_nf_stats[i][GW_STAT_NF_RX_PKTS],
+               c[GW_STAT_NF_TX_PKTS] - last_nf_stats[i][GW_STAT_NF_TX_PKTS]);
+        memcpy(last_nf_stats[i], c, sizeof(last_nf_stats[i]));
+    }
+    printf("nf_rx_throughput: %"PRIu64" Mbps, nf_tx_throughput: %"PRIu64" Mbps\n",
+           (totals[GW_STAT_NF_RX_BYTES] - last_totals[GW_STAT_NF_RX_BYTES]) * 8 / 1024 / 1024,
+           (totals[GW_STAT_NF_TX_BYTES] - last_totals[GW_STAT_NF_TX_BYTES]) * 8 / 1024 / 1024);
+    printf("nf_rx_pkts_sec: %"PRIu64", nf_tx_pkts_sec: %"PRIu64"\n",
+           totals[GW_STAT_NF_RX_PKTS] - last_totals[GW_STAT_NF_RX_PKTS],
+           totals[GW_STAT_NF_TX_PKTS] - last_totals[GW_STAT_NF_TX_PKTS]);
+    printf("Manager Statistics\n");
+    printf("ctrl_rx_throughput: %"PRIu64" Mbps, ctrl_tx_throughput: %"PRIu64" Mbps\n",
+           (totals[GW_STAT_CTRL_RX_BYTES] - last_totals[GW_STAT_CTRL_RX_BYTES]) * 8 / 1024 / 1024,
+           (totals[GW_STAT_CTRL_TX_BYTES] - last_totals[GW_STAT_CTRL_TX_BYTES]) * 8 / 1024 / 1024);
+    printf("ctrl_rx_pkts_sec: %"PRIu64", ctrl_tx_pkts_sec: %"PRIu64"\n",
+           totals[GW_STAT_CTRL_RX_PKTS] - last_totals[GW_STAT_CTRL_RX_PKTS],
+           totals[GW_STAT_CTRL_TX_PKTS] - last_totals[GW_STAT_CTRL_TX_PKTS]);
     printf("Other Statistics\n");
-    printf("malicious_packet_counts: %u\n", malicious_packet_counts);
-    printf("flow_counts: %u, flow_counts_sec: %u\n\n",
-           flow_counts, flow_counts - last_flow_counts);
+    printf("malicious_packet_counts: %"PRIu64"\n",
+           totals[GW_STAT_MALICIOUS_PKTS]);
+    printf("nf_dropped_pkts: %"PRIu64"\n", totals[GW_STAT_NF_DROPPED_PKTS]);
+    printf("aged_flow_counts: %"PRIu64"\n", totals[GW_STAT_AGED_FLOWS]);
+    if (syn_cookies)
+        printf("syn_cookies_sec: %"PRIu64", syn_verified_sec: %"PRIu64"\n",
+               totals[GW_STAT_SYN_COOKIES] - last_totals[GW_STAT_SYN_COOKIES],
+               totals[GW_STAT_SYN_VERIFIED] - last_totals[GW_STAT_SYN_VERIFIED]);
+    printf("flow_counts: %"PRIu64", flow_counts_sec: %"PRIu64"\n\n",
+           totals[GW_STAT_FLOWS],
+           totals[GW_STAT_FLOWS] - last_totals[GW_STAT_FLOWS]);
 
-    last_ctrl_rx_bytes = ctrl_rx_bytes;
-    last_ctrl_rx_pkts = ctrl_rx_pkts;
-    last_ctrl_tx_bytes = ctrl_tx_bytes;
-    last_ctrl_tx_pkts = ctrl_tx_pkts;
-
-
-	last_ecmp_ctrl_tx_bytes = ecmp_ctrl_tx_bytes;
-	last_state_pull_ctrl_tx_bytes = state_pull_ctrl_tx_bytes;
-	last_state_backup_ctrl_tx_bytes = state_backup_ctrl_tx_bytes;
-	last_keyset_ctrl_tx_bytes=keyset_ctrl_tx_bytes;
-
-    FOR_EACH_NF_CORE{
-        last_nf_rx_bytes[i] = nf_rx_bytes[i];
-        last_nf_rx_pkts[i] = nf_rx_pkts[i];
-        last_nf_tx_bytes[i] = nf_tx_bytes[i];
-        last_nf_tx_pkts[i] = nf_tx_pkts[i];
-    }
-    last_flow_counts = flow_counts;
-}
-
-/*
- * As manager doesn't need to enqueue 5tuple to nf_manager_ring,
- * so it need a more simple version of setStates
- */
-static void
-managerSetStates(struct ipv4_5tuple *ip_5tuple, struct nf_states *state)
-{
-    union ipv4_5tuple_host newkey;
-    convert_ipv4_5tuple(ip_5tuple, &newkey);
-    int ret =  rte_hash_add_key_data(state_hash_table[0], &newkey, state);
-    if (ret == 0) {
-        #ifdef __DEBUG_LV2
-        printf("mg: set state success!\n");
-        #endif
-    }
-    else {
-        printf("mg: error found in setStates!\n");
-        return;
-    }
+    memcpy(last_totals, totals, sizeof(last_totals));
 }
 
 static int
@@ -165,19 +196,7 @@ managerGetStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state)
 {
     union ipv4_5tuple_host newkey;
     convert_ipv4_5tuple(ip_5tuple, &newkey);
-    int i;
-    int ret;
-    /*table 0 for manager, 1~NF_CORE_COUNT for nfs*/
-    for(i = NF_CORE_COUNT;i >= 0;i--){
-        ret = rte_hash_lookup_data(state_hash_table[i], &newkey, (void **) state);
-        if(ret >= 0)
-            break;
-    }
-    // int ret = rte_hash_lookup_data(state_hash_table[1], &newkey, (void **) state);
-    // if (ret < 0){
-    //     ret = rte_hash_lookup_data(state_hash_table[0], &newkey, (void **) state);
-    // }
-    // // printf("ret, EINVAL, ENOENT is %d, %u and %u\n", ret, EINVAL, ENOENT);
+    int ret = lookupStates(&newkey, state);
     if (ret >= 0) {
         #ifdef __DEBUG_LV2
         printf("mg: get state success!\n");
@@ -195,142 +214,319 @@ managerGetStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state)
     return ret;
 }
 
-static struct rte_mbuf*
-build_backup_packet(uint8_t port,uint32_t backup_machine_ip,uint16_t packet_id,
-                    struct ipv4_5tuple* ip_5tuple, struct nf_states* states)
+static int
+ctrl_batch_start(struct ctrl_batch* batch, uint8_t port,
+                 uint32_t target_ip, uint8_t proto, uint8_t format)
 {
-    struct rte_mbuf* backup_packet;
+    struct rte_mbuf* batch_packet;
     struct ether_hdr* eth_h;
     struct ipv4_hdr* ip_h;
-    struct states_5tuple_pair* payload;
     struct ether_addr self_eth_addr;
     /* Allocate space */
-    backup_packet = rte_pktmbuf_alloc(single_port_param.manager_mempool);
-    if (backup_packet == NULL) {
-        printf("mg: backup_packet alloc failed\n");
+    batch_packet = rte_pktmbuf_alloc(single_port_param.manager_mempool);
+    if (batch_packet == NULL) {
+        printf("mg: batch_packet alloc failed\n");
+        return -1;
     }
     eth_h = (struct ether_hdr *)
-        rte_pktmbuf_append(backup_packet, sizeof(struct ether_hdr));
+        rte_pktmbuf_append(batch_packet, sizeof(struct ether_hdr));
     ip_h = (struct ipv4_hdr *)
-        rte_pktmbuf_append(backup_packet, sizeof(struct ipv4_hdr));
-    payload = (struct states_5tuple_pair*)
-        rte_pktmbuf_append(backup_packet, sizeof(struct states_5tuple_pair));
+        rte_pktmbuf_append(batch_packet, sizeof(struct ipv4_hdr));
+    batch->hdr = (struct ctrl_batch_hdr*)
+        rte_pktmbuf_append(batch_packet, sizeof(struct ctrl_batch_hdr));
     /* Set the packet ether header */
     eth_h->ether_type =  rte_cpu_to_be_16(ETHER_TYPE_IPv4);
     ether_addr_copy(&interface_MAC, &(eth_h->d_addr));
     rte_eth_macaddr_get(port, &self_eth_addr);
     ether_addr_copy(&self_eth_addr, &(eth_h->s_addr));
-    /* Set the packet ip header */
+    /* Set the packet ip header, length and checksum are set on flush */
     memset((char *)ip_h, 0, sizeof(struct ipv4_hdr));
     ip_h->src_addr=rte_cpu_to_be_32(this_machine->ip);
-    ip_h->dst_addr=rte_cpu_to_be_32(backup_machine_ip);
+    ip_h->dst_addr=rte_cpu_to_be_32(target_ip);
     ip_h->version_ihl = (4 << 4) | 5;
-    ip_h->total_length = rte_cpu_to_be_16(20+sizeof(struct states_5tuple_pair));
-    /*
-     * packet_id indicates nf_id: 0 means general state backup,
-     * other means response for nf's state pull request
-     */
-    ip_h->packet_id = rte_cpu_to_be_16(packet_id);
+    ip_h->packet_id = 0;/* general message */
     ip_h->time_to_live=4;
-    /* In HPSMS, proto A0 indicate this is state backup message */
-    ip_h->next_proto_id = 0xA0;
+    ip_h->next_proto_id = proto;
+    batch->hdr->count = 0;
+    batch->hdr->format = format;
+    batch->hdr->reserved = 0;
+    memset(&batch->last_key, 0, sizeof(batch->last_key));
+    batch->packet = batch_packet;
+    batch->port = port;
+    batch->start_tsc = rte_rdtsc();
+    return 0;
+}
+
+/* Send the batch, tx_stat counts its bytes (GW_STAT_COUNT for none) */
+static void
+ctrl_batch_flush(struct ctrl_batch* batch, enum gw_stat tx_stat)
+{
+    struct rte_mbuf* batch_packet = batch->packet;
+    struct ipv4_hdr* ip_h;
+    if (batch_packet == NULL)
+        return;
+    batch->packet = NULL;
+    ip_h = rte_pktmbuf_mtod_offset(batch_packet, struct ipv4_hdr*,
+                                   sizeof(struct ether_hdr));
+    ip_h->total_length = rte_cpu_to_be_16(
+        batch_packet->data_len - sizeof(struct ether_hdr)
+    );
     ip_h->hdr_checksum = rte_ipv4_cksum(ip_h);
-    /* Set the packet payload(5tuple:states) */
-    payload->l4_5tuple.ip_dst = ip_5tuple->ip_dst;
-    payload->l4_5tuple.ip_src = ip_5tuple->ip_src;
-    payload->l4_5tuple.port_dst = ip_5tuple->port_dst;
-    payload->l4_5tuple.port_src = ip_5tuple->port_src;
-    payload->l4_5tuple.proto = ip_5tuple->proto;
-    if (states != NULL) {
-        payload->states.ipserver = states->ipserver;
-        payload->states.dip = states->dip;
-        payload->states.dport = states->dport;
-        payload->states.bip = states->bip;
+    batch->hdr->count = rte_cpu_to_be_16(batch->hdr->count);
+    lcore_stat_add(GW_STAT_CTRL_TX_PKTS, 1);
+    lcore_stat_add(GW_STAT_CTRL_TX_BYTES, batch_packet->data_len);
+    if (tx_stat < GW_STAT_COUNT)
+        lcore_stat_add(tx_stat, batch_packet->data_len);
+    if (rte_eth_tx_burst(batch->port, MANAGER_TX_QUEUE, &batch_packet, 1) != 1) {
+        printf("mg: tx batch_packet failed!\n");
+        rte_pktmbuf_free(batch_packet);
     }
-    else {
-        payload->states.ipserver = 0;
-        payload->states.dip = 0;
-        payload->states.dport = 0;
-        payload->states.bip = 0;
+}
+
+static inline int
+ctrl_batch_fits(const struct ctrl_batch* batch, uint16_t size)
+{
+    return batch->packet->data_len + size <=
+        sizeof(struct ether_hdr) + CTRL_MTU;
+}
+
+/*
+ * Reserve room for one record of size bytes in the batch, sending the
+ * batch first if the record does not fit. Returns NULL on failure.
+ */
+static void*
+ctrl_batch_append(struct ctrl_batch* batch, uint8_t port, uint32_t target_ip,
+                  uint8_t proto, uint8_t format, uint16_t size,
+                  enum gw_stat tx_stat)
+{
+    void* record;
+    if (batch->packet != NULL && !ctrl_batch_fits(batch, size))
+        ctrl_batch_flush(batch, tx_stat);
+    if (batch->packet == NULL &&
+        ctrl_batch_start(batch, port, target_ip, proto, format) < 0)
+        return NULL;
+    record = rte_pktmbuf_append(batch->packet, size);
+    if (record != NULL)
+        batch->hdr->count++;
+    return record;
+}
+
+/* Queue a general state backup for backup_machine_ip */
+static void
+backup_enqueue(uint8_t port, uint32_t backup_machine_ip,
+               const struct ipv4_5tuple* ip_5tuple,
+               const struct nf_states* states)
+{
+    struct states_5tuple_pair* pair;
+    int idx = machine_id(backup_machine_ip) - 1;
+    if (idx < 0) {
+        printf("mg: backup to unknown machine!\n");
+        return;
+    }
+    /* In HPSMS, proto A0 indicate this is state backup message */
+    pair = ctrl_batch_append(
+        &backup_batches[idx], port, backup_machine_ip, 0xA0, CTRL_FMT_RECORDS,
+        sizeof(struct states_5tuple_pair), GW_STAT_STATE_BACKUP_CTRL_TX_BYTES
+    );
+    if (pair == NULL) {
+        printf("mg: backup record dropped!\n");
+        return;
     }
-    ctrl_tx_pkts += 1;
-    ctrl_tx_bytes += backup_packet->data_len;
-   	state_backup_ctrl_tx_bytes += backup_packet->data_len;
-    return backup_packet;
+    pair->l4_5tuple = *ip_5tuple;
+    pair->states = *states;
 }
 
-static struct rte_mbuf*
-build_pull_packet(uint8_t port, struct nf_indexs* indexs,
-                  uint16_t nf_id, struct ipv4_5tuple* ip_5tuple)
+/* Queue the index of a flow for the machine topo[idx] */
+static void
+keyset_enqueue(uint8_t port, uint32_t idx, struct ipv4_5tuple* ip_5tuple,
+               struct nf_indexs* indexs)
 {
-    struct rte_mbuf* pull_packet;
-    struct ether_hdr* eth_h;
-    struct ipv4_hdr* ip_h;
-    struct ipv4_5tuple* payload;
-    struct ether_addr self_eth_addr;
-    /* Allocate space */
-    pull_packet = rte_pktmbuf_alloc(single_port_param.manager_mempool);
-    if (pull_packet == NULL) {
-        printf("mg: pull_packet alloc failed\n");
+    struct ctrl_batch* batch = &keyset_batches[idx];
+    struct indexs_5tuple_pair* pair;
+    struct keyset_compact_rec* rec;
+    struct keyset_compact_dst* dst;
+    uint16_t size;
+
+    if (!keyset_compact) {
+        /* In HPSMS, proto A2 indicate this is keyset broadcast message */
+        pair = ctrl_batch_append(
+            batch, port, topo[idx].ip, 0xA2, CTRL_FMT_RECORDS,
+            sizeof(struct indexs_5tuple_pair), GW_STAT_KEYSET_CTRL_TX_BYTES
+        );
+        if (pair == NULL) {
+            printf("mg: keyset record dropped!\n");
+            return;
+        }
+        pair->l4_5tuple = *ip_5tuple;
+        pair->indexs = *indexs;
+        return;
     }
-    eth_h = (struct ether_hdr *)
-        rte_pktmbuf_append(pull_packet, sizeof(struct ether_hdr));
-    ip_h = (struct ipv4_hdr *)
-        rte_pktmbuf_append(pull_packet, sizeof(struct ipv4_hdr));
-    payload = (struct ipv4_5tuple*)
-        rte_pktmbuf_append(pull_packet, sizeof(struct ipv4_5tuple));
-    /* Set the packet ether header */
-    eth_h->ether_type =  rte_cpu_to_be_16(ETHER_TYPE_IPv4);
-    ether_addr_copy(&interface_MAC, &(eth_h->d_addr));
-    rte_eth_macaddr_get(port, &self_eth_addr);
-    ether_addr_copy(&self_eth_addr, &(eth_h->s_addr));
-    /* Set the packet ip header */
-    memset((char *)ip_h, 0, sizeof(struct ipv4_hdr));
-    ip_h->src_addr=rte_cpu_to_be_32(this_machine->ip);
-    ip_h->dst_addr=rte_cpu_to_be_32(indexs->backupip[0]);
-    ip_h->version_ihl = (4 << 4) | 5;
-    ip_h->total_length = rte_cpu_to_be_16(20+sizeof(struct ipv4_5tuple));
-    /*
-     * packet_id indicates nf_id: 0 means general state backup,
-     * other means response for nf's state pull request
-     */
-    ip_h->packet_id = rte_cpu_to_be_16(nf_id);
-    ip_h->time_to_live=4;
-    /* In HPSMS, proto A1 indicate this is state pull message */
-    ip_h->next_proto_id = 0xA1;
-    ip_h->hdr_checksum = rte_ipv4_cksum(ip_h);
-    /* Set the packet payload(5tuple:states) */
-    payload->ip_dst = ip_5tuple->ip_dst;
-    payload->ip_src = ip_5tuple->ip_src;
-    payload->port_dst = ip_5tuple->port_dst;
-    payload->port_src = ip_5tuple->port_src;
-    payload->proto = ip_5tuple->proto;
-    ctrl_tx_pkts += 1;
-    ctrl_tx_bytes += pull_packet->data_len;
-    state_pull_ctrl_tx_bytes += pull_packet->data_len;
-    return pull_packet;
+
+    /* Send first if even a record carrying the destination would not fit */
+    size = sizeof(struct keyset_compact_rec) + sizeof(struct keyset_compact_dst);
+    if (batch->packet != NULL && !ctrl_batch_fits(batch, size))
+        ctrl_batch_flush(batch, GW_STAT_KEYSET_CTRL_TX_BYTES);
+    if (batch->packet != NULL &&
+        batch->last_key.ip_dst == ip_5tuple->ip_dst &&
+        batch->last_key.port_dst == ip_5tuple->port_dst &&
+        batch->last_key.proto == ip_5tuple->proto)
+        size = sizeof(struct keyset_compact_rec);
+    rec = ctrl_batch_append(
+        batch, port, topo[idx].ip, 0xA2, CTRL_FMT_KEYSET_COMPACT,
+        size, GW_STAT_KEYSET_CTRL_TX_BYTES
+    );
+    if (rec == NULL) {
+        printf("mg: keyset record dropped!\n");
+        return;
+    }
+    rec->flags = 0;
+    rec->backup[0] = machine_id(indexs->backupip[0]);
+    rec->backup[1] = machine_id(indexs->backupip[1]);
+    rec->ip_src = ip_5tuple->ip_src;
+    rec->port_src = ip_5tuple->port_src;
+    if (size > sizeof(struct keyset_compact_rec)) {
+        rec->flags |= KEYSET_COMPACT_F_DST;
+        dst = (struct keyset_compact_dst*)(rec + 1);
+        dst->ip_dst = ip_5tuple->ip_dst;
+        dst->port_dst = ip_5tuple->port_dst;
+        dst->proto = ip_5tuple->proto;
+        batch->last_key = *ip_5tuple;
+    }
+}
+
+/* Send the batches whose oldest record waited CTRL_FLUSH_CYCLES */
+static void
+ctrl_batch_flush_expired(uint64_t cur_tsc)
+{
+    uint32_t idx;
+    for (idx = 0; idx < n_machines; idx++) {
+        if (backup_batches[idx].packet != NULL &&
+            cur_tsc - backup_batches[idx].start_tsc > CTRL_FLUSH_CYCLES)
+            ctrl_batch_flush(&backup_batches[idx], GW_STAT_STATE_BACKUP_CTRL_TX_BYTES);
+        if (keyset_batches[idx].packet != NULL &&
+            cur_tsc - keyset_batches[idx].start_tsc > CTRL_FLUSH_CYCLES)
+            ctrl_batch_flush(&keyset_batches[idx], GW_STAT_KEYSET_CTRL_TX_BYTES);
+        if (backup6_batches[idx].packet != NULL &&
+            cur_tsc - backup6_batches[idx].start_tsc > CTRL_FLUSH_CYCLES)
+            ctrl_batch_flush(&backup6_batches[idx], GW_STAT_STATE_BACKUP_CTRL_TX_BYTES);
+        if (keyset6_batches[idx].packet != NULL &&
+            cur_tsc - keyset6_batches[idx].start_tsc > CTRL_FLUSH_CYCLES)
+            ctrl_batch_flush(&keyset6_batches[idx], GW_STAT_KEYSET_CTRL_TX_BYTES);
+        if (snat_batches[idx].packet != NULL &&
+            cur_tsc - snat_batches[idx].start_tsc > CTRL_FLUSH_CYCLES)
+            ctrl_batch_flush(&snat_batches[idx], GW_STAT_KEYSET_CTRL_TX_BYTES);
+        if (teardown_batches[idx].packet != NULL &&
+            cur_tsc - teardown_batches[idx].start_tsc > CTRL_FLUSH_CYCLES)
+            ctrl_batch_flush(&teardown_batches[idx], GW_STAT_COUNT);
+        if (teardown6_batches[idx].packet != NULL &&
+            cur_tsc - teardown6_batches[idx].start_tsc > CTRL_FLUSH_CYCLES)
+            ctrl_batch_flush(&teardown6_batches[idx], GW_STAT_COUNT);
+    }
+}
+
+/*
+ * Queue the NAT port of a flow for every other machine, server_ip 0 when
+ * the flow is gone. Nothing for a flow snat did not translate.
+ */
+static void
+snat_broadcast(uint8_t port, const struct ipv4_5tuple* ip_5tuple,
+               const struct nf_states* states, uint32_t server_ip)
+{
+    struct snat_record* rec;
+    uint32_t idx;
+
+    if (snat_ip == 0 || states->dip != snat_ip || states->dport == 0)
+        return;
+    for (idx = 0; idx < n_machines; idx++) {
+        if (idx == this_machine_index)
+            continue;
+        rec = ctrl_batch_append(
+            &snat_batches[idx], port, topo[idx].ip, 0xA2, CTRL_FMT_SNAT,
+            sizeof(struct snat_record), GW_STAT_KEYSET_CTRL_TX_BYTES
+        );
+        if (rec == NULL) {
+            printf("mg: snat record dropped!\n");
+            return;
+        }
+        rec->l4_5tuple = *ip_5tuple;
+        rec->server_ip = server_ip;
+        rec->port = states->dport;
+    }
+}
+
+/* Queue a general state backup of an IPv6 flow for backup_machine_ip */
+static void
+backup6_enqueue(uint8_t port, uint32_t backup_machine_ip,
+                const struct ipv6_5tuple* ip_5tuple,
+                const struct nf_states* states)
+{
+    struct states_5tuple6_pair* pair;
+    int idx = machine_id(backup_machine_ip) - 1;
+    if (idx < 0) {
+        printf("mg: backup to unknown machine!\n");
+        return;
+    }
+    pair = ctrl_batch_append(
+        &backup6_batches[idx], port, backup_machine_ip, 0xA0, CTRL_FMT_RECORDS6,
+        sizeof(struct states_5tuple6_pair), GW_STAT_STATE_BACKUP_CTRL_TX_BYTES
+    );
+    if (pair == NULL) {
+        printf("mg: backup record dropped!\n");
+        return;
+    }
+    pair->l4_5tuple = *ip_5tuple;
+    pair->states = *states;
 }
 
+/* Queue the index of an IPv6 flow for the machine topo[idx] */
+static void
+keyset6_enqueue(uint8_t port, uint32_t idx,
+                const struct ipv6_5tuple* ip_5tuple,
+                const struct nf_indexs* indexs)
+{
+    struct indexs_5tuple6_pair* pair;
+    /* no compact encoding, the IPv6 records are sent as they are */
+    pair = ctrl_batch_append(
+        &keyset6_batches[idx], port, topo[idx].ip, 0xA2, CTRL_FMT_RECORDS6,
+        sizeof(struct indexs_5tuple6_pair), GW_STAT_KEYSET_CTRL_TX_BYTES
+    );
+    if (pair == NULL) {
+        printf("mg: keyset record dropped!\n");
+        return;
+    }
+    pair->l4_5tuple = *ip_5tuple;
+    pair->indexs = *indexs;
+}
+
+/*
+ * Build a control message of proto that carries a single record of len
+ * bytes, a batch of one with its format: the state pulls and their
+ * replies, which are not batched. packet_id is the nf the pull is for
+ * plus one. tx_stat is the statistic of the message type, GW_STAT_COUNT
+ * for none.
+ */
 static struct rte_mbuf*
-build_keyset_packet(uint32_t target_ip, struct nf_indexs* indexs,
-                    uint8_t port, struct ipv4_5tuple* ip_5tuple)
+build_ctrl_record(uint8_t port, uint32_t target_ip, uint8_t proto,
+                  uint16_t packet_id, uint8_t format, const void* data,
+                  uint16_t len, enum gw_stat tx_stat)
 {
-    struct rte_mbuf* keyset_packet;
+    struct rte_mbuf* ctrl_packet;
     struct ether_hdr* eth_h;
     struct ipv4_hdr* ip_h;
-    struct indexs_5tuple_pair* payload;
+    struct ctrl_batch_hdr* hdr;
     struct ether_addr self_eth_addr;
     /* Allocate space */
-    keyset_packet = rte_pktmbuf_alloc(single_port_param.manager_mempool);
-    if (keyset_packet == NULL) {
-        printf("mg: keyset_packet alloc failed\n");
+    ctrl_packet = rte_pktmbuf_alloc(single_port_param.manager_mempool);
+    if (ctrl_packet == NULL) {
+        printf("mg: ctrl_packet alloc failed\n");
+        return NULL;
     }
     eth_h = (struct ether_hdr *)
-        rte_pktmbuf_append(keyset_packet, sizeof(struct ether_hdr));
+        rte_pktmbuf_append(ctrl_packet, sizeof(struct ether_hdr));
     ip_h = (struct ipv4_hdr *)
-        rte_pktmbuf_append(keyset_packet, sizeof(struct ipv4_hdr));
-    payload = (struct indexs_5tuple_pair*)
-        rte_pktmbuf_append(keyset_packet, sizeof(struct indexs_5tuple_pair));
+        rte_pktmbuf_append(ctrl_packet, sizeof(struct ipv4_hdr));
+    hdr = (struct ctrl_batch_hdr *)
+        rte_pktmbuf_append(ctrl_packet, sizeof(*hdr) + len);
     /* Set the packet ether header */
     eth_h->ether_type =  rte_cpu_to_be_16(ETHER_TYPE_IPv4);
     ether_addr_copy(&interface_MAC, &(eth_h->d_addr));
@@ -341,28 +537,108 @@ build_keyset_packet(uint32_t target_ip, struct nf_indexs* indexs,
     ip_h->src_addr=rte_cpu_to_be_32(this_machine->ip);
     ip_h->dst_addr=rte_cpu_to_be_32(target_ip);
     ip_h->version_ihl = (4 << 4) | 5;
-    ip_h->total_length = rte_cpu_to_be_16(20+sizeof(struct indexs_5tuple_pair));
-    ip_h->packet_id = 0;/* NO USE */
+    ip_h->total_length = rte_cpu_to_be_16(20 + sizeof(*hdr) + len);
+    ip_h->packet_id = rte_cpu_to_be_16(packet_id);
     ip_h->time_to_live=4;
-    /* In HPSMS, proto A2 indicate this is keyset broadcast message */
-    ip_h->next_proto_id = 0xA2;
+    ip_h->next_proto_id = proto;
     ip_h->hdr_checksum = rte_ipv4_cksum(ip_h);
-    /* Set the packet payload(5tuple:states) */
-    payload->l4_5tuple.ip_dst = ip_5tuple->ip_dst;
-    payload->l4_5tuple.ip_src = ip_5tuple->ip_src;
-    payload->l4_5tuple.port_dst = ip_5tuple->port_dst;
-    payload->l4_5tuple.port_src = ip_5tuple->port_src;
-    payload->l4_5tuple.proto = ip_5tuple->proto;
-    payload->indexs.backupip[0] = indexs->backupip[0];
-    payload->indexs.backupip[1] = indexs->backupip[1];
-    ctrl_tx_pkts += 1;
-    ctrl_tx_bytes += keyset_packet->data_len;
-    keyset_ctrl_tx_bytes+= keyset_packet->data_len;
-    return keyset_packet;
+    hdr->count = rte_cpu_to_be_16(1);
+    hdr->format = format;
+    hdr->reserved = 0;
+    memcpy(hdr + 1, data, len);
+    lcore_stat_add(GW_STAT_CTRL_TX_PKTS, 1);
+    lcore_stat_add(GW_STAT_CTRL_TX_BYTES, ctrl_packet->data_len);
+    if (tx_stat < GW_STAT_COUNT)
+        lcore_stat_add(tx_stat, ctrl_packet->data_len);
+    return ctrl_packet;
+}
+
+/* Build and send a control message, see build_ctrl_record() */
+static int
+send_ctrl_record(uint8_t port, uint16_t tx_queue_id, uint32_t target_ip,
+                 uint8_t proto, uint16_t packet_id, uint8_t format,
+                 const void* data, uint16_t len, enum gw_stat tx_stat)
+{
+    struct rte_mbuf* ctrl_packet;
+    ctrl_packet = build_ctrl_record(port, target_ip, proto, packet_id,
+                                    format, data, len, tx_stat);
+    if (ctrl_packet == NULL)
+        return -1;
+    if (rte_eth_tx_burst(port, tx_queue_id, &ctrl_packet, 1) != 1) {
+        printf("mg: tx ctrl_packet failed!\n");
+        rte_pktmbuf_free(ctrl_packet);
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue the teardown of a flow for the machine topo[idx] */
+static void
+teardown_enqueue(uint8_t port, uint32_t idx, const struct ipv4_5tuple* ip_5tuple)
+{
+    struct ipv4_5tuple* rec;
+    /* In HPSMS, proto A3 indicate this is flow teardown message */
+    rec = ctrl_batch_append(
+        &teardown_batches[idx], port, topo[idx].ip, 0xA3, CTRL_FMT_RECORDS,
+        sizeof(struct ipv4_5tuple), GW_STAT_COUNT
+    );
+    if (rec == NULL) {
+        printf("mg: teardown record dropped!\n");
+        return;
+    }
+    *rec = *ip_5tuple;
 }
 
+/* teardown_enqueue() of an IPv6 flow */
+static void
+teardown6_enqueue(uint8_t port, uint32_t idx,
+                  const struct ipv6_5tuple* ip_5tuple)
+{
+    struct ipv6_5tuple* rec;
+    rec = ctrl_batch_append(
+        &teardown6_batches[idx], port, topo[idx].ip, 0xA3, CTRL_FMT_RECORDS6,
+        sizeof(struct ipv6_5tuple), GW_STAT_COUNT
+    );
+    if (rec == NULL) {
+        printf("mg: teardown record dropped!\n");
+        return;
+    }
+    *rec = *ip_5tuple;
+}
+
+/*
+ * Add, reweight (weight > 0) or remove (weight 0) a load balancer backend.
+ * Flows keep the server in their state, only new flows see the change.
+ */
+static void
+backend_update(const struct lb_backend_update* update)
+{
+    const uint32_t ip = rte_be_to_cpu_32(update->ip);
+    const uint16_t weight = rte_be_to_cpu_16(update->weight);
+    int ret;
+
+    if (weight == 0)
+        ret = maglev_remove_backend(ip);
+    else
+        ret = maglev_add_backend(ip, weight);
+    if (ret < 0)
+        printf("mg: backend update of "IPv4_BYTES_FMT" failed!\n",
+               IPv4_BYTES(ip));
+    #ifdef __DEBUG_LV1
+    else
+        printf("mg: backend "IPv4_BYTES_FMT" weight %u\n",
+               IPv4_BYTES(ip), weight);
+    #endif
+}
+
+/*
+ * Store a state received from another machine in the table of socket.
+ * flags tells whether it is a backup copy (general backup) or a flow now
+ * served here (pull reply).
+ */
 static struct nf_states*
-backup_to_machine(struct states_5tuple_pair* backup_pair)
+backup_to_machine(struct states_5tuple_pair* backup_pair, uint8_t flags,
+                  unsigned socket)
 {
     #ifdef __DEBUG_LV1
     printf("mg: ip_src is "IPv4_BYTES_FMT " \n",
@@ -382,16 +658,38 @@ backup_to_machine(struct states_5tuple_pair* backup_pair)
     printf("mg: dip is "IPv4_BYTES_FMT " \n",
            IPv4_BYTES(backup_pair->states.bip));
     #endif
-    struct nf_states* states = rte_malloc(NULL, sizeof(struct nf_states), 0);
-    if (!states) {
-        rte_panic("mg: states malloc failed!");
+    /* the state is copied into its slot of the state table */
+    struct nf_states states = backup_pair->states;
+    states.last_seen = flow_time_now();
+    states.flags = flags;
+    return setStates(socket, &(backup_pair->l4_5tuple), &states);
+}
+
+/* backup_to_machine() for up to BURST_SIZE records, inserted together */
+static void
+backup_batch_to_machine(struct states_5tuple_pair* pairs, uint16_t count,
+                        uint8_t flags, unsigned socket)
+{
+    struct ipv4_5tuple* keys[BURST_SIZE];
+    struct nf_states states[BURST_SIZE];
+    struct nf_states* cur;
+    const uint32_t now = flow_time_now();
+    uint16_t idx, nb = 0;
+
+    for (idx = 0; idx < count; idx++) {
+        /* a refresh of a flow served here now leaves it alone */
+        if ((flags & NF_STATE_F_BACKUP) &&
+            getStates(&pairs[idx].l4_5tuple, &cur) >= 0 &&
+            !(cur->flags & NF_STATE_F_BACKUP))
+            continue;
+        keys[nb] = &pairs[idx].l4_5tuple;
+        states[nb] = pairs[idx].states;
+        states[nb].last_seen = now;
+        states[nb].flags = flags;
+        nb++;
     }
-    states->ipserver = backup_pair->states.ipserver;
-    states->dip = backup_pair->states.dip;
-    states->dport = backup_pair->states.dport;
-    states->bip = backup_pair->states.bip;
-    managerSetStates(&(backup_pair->l4_5tuple), states);
-    return states;
+    if (setStatesBulk(socket, keys, states, nb) < nb)
+        printf("mg: state table full, backup records dropped!\n");
 }
 
 static void
@@ -410,41 +708,1090 @@ keyset_to_machine(struct indexs_5tuple_pair* keyset_pair)
     printf("mg: port_dst is 0x%x\n", keyset_pair->l4_5tuple.port_dst);
     printf("mg: proto is 0x%x\n", keyset_pair->l4_5tuple.proto);
     #endif
-    struct nf_indexs* indexs = rte_malloc(NULL, sizeof(struct nf_indexs), 0);
-    if (!indexs) {
-        rte_panic("mg: indexs malloc failed!");
+    setIndexs(&(keyset_pair->l4_5tuple), &(keyset_pair->indexs));
+}
+
+/* Apply every keyset record of a batch, end is the end of the IP packet */
+static void
+keyset_batch_to_machine(struct ctrl_batch_hdr* hdr, u_char* end)
+{
+    struct indexs_5tuple_pair keyset_pair;
+    struct indexs_5tuple_pair* pair;
+    struct indexs_5tuple6_pair* pair6;
+    struct keyset_compact_rec* rec;
+    struct keyset_compact_dst* dst;
+    struct snat_record* snat;
+    struct nf_states* states;
+    uint16_t count = rte_be_to_cpu_16(hdr->count);
+    u_char* p = (u_char*)(hdr + 1);
+    int has_dst = 0;
+    uint16_t idx;
+
+    if (hdr->format == CTRL_FMT_RECORDS) {
+        pair = (struct indexs_5tuple_pair*)p;
+        if ((u_char*)(pair + count) > end) {
+            printf("mg: truncated keyset message!\n");
+            return;
+        }
+        for (idx = 0; idx < count; idx++)
+            keyset_to_machine(&pair[idx]);
+        return;
+    }
+    if (hdr->format == CTRL_FMT_RECORDS6) {
+        pair6 = (struct indexs_5tuple6_pair*)p;
+        if ((u_char*)(pair6 + count) > end) {
+            printf("mg: truncated keyset message!\n");
+            return;
+        }
+        for (idx = 0; idx < count; idx++)
+            setIndexs6(&pair6[idx].l4_5tuple, &pair6[idx].indexs);
+        return;
+    }
+    if (hdr->format == CTRL_FMT_SNAT) {
+        snat = (struct snat_record*)p;
+        if ((u_char*)(snat + count) > end) {
+            printf("mg: truncated snat message!\n");
+            return;
+        }
+        for (idx = 0; idx < count; idx++) {
+            if (snat[idx].server_ip != 0) {
+                nf_snat_install(&snat[idx].l4_5tuple, snat[idx].server_ip,
+                                snat[idx].port);
+                continue;
+            }
+            /* a state of the flow here releases the port when it goes */
+            if (getStates(&snat[idx].l4_5tuple, &states) >= 0 &&
+                states->dip == snat_ip && states->dport == snat[idx].port)
+                continue;
+            nf_snat_release(&snat[idx].l4_5tuple, snat[idx].port);
+        }
+        return;
+    }
+    if (hdr->format != CTRL_FMT_KEYSET_COMPACT) {
+        printf("mg: unknown keyset format %u!\n", hdr->format);
+        return;
+    }
+    memset(&keyset_pair, 0, sizeof(keyset_pair));
+    for (idx = 0; idx < count; idx++) {
+        rec = (struct keyset_compact_rec*)p;
+        p += sizeof(struct keyset_compact_rec);
+        if (p > end)
+            break;
+        if (rec->flags & KEYSET_COMPACT_F_DST) {
+            dst = (struct keyset_compact_dst*)p;
+            p += sizeof(struct keyset_compact_dst);
+            if (p > end)
+                break;
+            keyset_pair.l4_5tuple.ip_dst = dst->ip_dst;
+            keyset_pair.l4_5tuple.port_dst = dst->port_dst;
+            keyset_pair.l4_5tuple.proto = dst->proto;
+            has_dst = 1;
+        }
+        else if (!has_dst) {
+            break;
+        }
+        keyset_pair.l4_5tuple.ip_src = rec->ip_src;
+        keyset_pair.l4_5tuple.port_src = rec->port_src;
+        keyset_pair.indexs.backupip[0] = machine_ip(rec->backup[0]);
+        keyset_pair.indexs.backupip[1] = machine_ip(rec->backup[1]);
+        keyset_to_machine(&keyset_pair);
+    }
+    if (idx != count)
+        printf("mg: malformed compact keyset message!\n");
+}
+
+/*
+ * A remote owner tore a flow down: drop our backup copy of its state (a
+ * state we serve ourselves is left alone) and its index.
+ */
+static void
+teardown_to_machine(struct ipv4_5tuple* ip_5tuple)
+{
+    union ipv4_5tuple_host key;
+    struct nf_states* states;
+    #ifdef __DEBUG_LV1
+    printf("mg: teardown ip_src is "IPv4_BYTES_FMT " \n",
+           IPv4_BYTES(ip_5tuple->ip_src));
+    printf("mg: teardown ip_dst is "IPv4_BYTES_FMT " \n",
+           IPv4_BYTES(ip_5tuple->ip_dst));
+    #endif
+    convert_ipv4_5tuple(ip_5tuple, &key);
+    if (getStates(ip_5tuple, &states) >= 0 &&
+        (states->flags & NF_STATE_F_BACKUP)) {
+        nf_chain_flow_release(states, ip_5tuple);
+        delStates(&key);
+    }
+    delIndexs(&key);
+}
+
+/*
+ * Remove a flow owned by this machine, and tell the peers to drop its
+ * backup copies and index entries if they were ever disseminated, and
+ * its NAT port.
+ */
+static void
+flow_teardown(uint8_t port, const union ipv4_5tuple_host* key,
+              const struct nf_states* states)
+{
+    struct ipv4_5tuple ip_5tuple;
+    struct nf_indexs* indexs;
+    uint32_t idx;
+
+    convert_ipv4_5tuple_host(key, &ip_5tuple);
+    nf_chain_flow_release(states, &ip_5tuple);
+    snat_broadcast(port, &ip_5tuple, states, 0);
+    if (getIndexs(&ip_5tuple, &indexs) >= 0) {
+        for (idx = 0; idx < n_machines; idx++) {
+            if (idx == this_machine_index)
+                continue;
+            teardown_enqueue(port, idx, &ip_5tuple);
+        }
+        delIndexs(key);
+    }
+    delStates(key);
+    lcore_stat_add(GW_STAT_AGED_FLOWS, 1);
+}
+
+/* teardown_to_machine() of an IPv6 flow */
+static void
+teardown6_to_machine(const struct ipv6_5tuple* ip_5tuple)
+{
+    union ipv6_5tuple_host key;
+    struct nf_states* states;
+    convert_ipv6_5tuple(ip_5tuple, &key);
+    if (getStates6(ip_5tuple, &states) >= 0 &&
+        (states->flags & NF_STATE_F_BACKUP))
+        delStates6(&key);
+    delIndexs6(&key);
+}
+
+/* Apply every teardown record of a batch, end is the end of the IP packet */
+static void
+teardown_batch_to_machine(struct ctrl_batch_hdr* hdr, u_char* end)
+{
+    struct ipv4_5tuple* recs = (struct ipv4_5tuple*)(hdr + 1);
+    struct ipv6_5tuple* recs6 = (struct ipv6_5tuple*)(hdr + 1);
+    uint16_t count = rte_be_to_cpu_16(hdr->count);
+    uint16_t idx;
+
+    if (hdr->format == CTRL_FMT_RECORDS6) {
+        if ((u_char*)(recs6 + count) > end) {
+            printf("mg: truncated teardown message!\n");
+            return;
+        }
+        for (idx = 0; idx < count; idx++)
+            teardown6_to_machine(&recs6[idx]);
+        return;
+    }
+    if (hdr->format != CTRL_FMT_RECORDS) {
+        printf("mg: unknown teardown format %u!\n", hdr->format);
+        return;
+    }
+    if ((u_char*)(recs + count) > end) {
+        printf("mg: truncated teardown message!\n");
+        return;
+    }
+    for (idx = 0; idx < count; idx++)
+        teardown_to_machine(&recs[idx]);
+}
+
+/* flow_teardown() of an IPv6 flow */
+static void
+flow_teardown6(uint8_t port, const union ipv6_5tuple_host* key)
+{
+    struct ipv6_5tuple ip_5tuple;
+    struct nf_indexs* indexs;
+    uint32_t idx;
+
+    convert_ipv6_5tuple_host(key, &ip_5tuple);
+    if (getIndexs6(&ip_5tuple, &indexs) >= 0) {
+        for (idx = 0; idx < n_machines; idx++) {
+            if (idx == this_machine_index)
+                continue;
+            teardown6_enqueue(port, idx, &ip_5tuple);
+        }
+        delIndexs6(key);
+    }
+    delStates6(key);
+    lcore_stat_add(GW_STAT_AGED_FLOWS, 1);
+}
+
+/* Store the states of a CTRL_FMT_RECORDS6 backup batch as backups */
+static void
+backup6_batch_to_machine(const struct states_5tuple6_pair* pairs,
+                         uint16_t count)
+{
+    struct nf_states states;
+    struct nf_states* cur;
+    const uint32_t now = flow_time_now();
+    uint16_t idx;
+
+    for (idx = 0; idx < count; idx++) {
+        if (getStates6(&pairs[idx].l4_5tuple, &cur) >= 0 &&
+            !(cur->flags & NF_STATE_F_BACKUP))
+            continue;
+        states = pairs[idx].states;
+        states.last_seen = now;
+        states.flags = NF_STATE_F_BACKUP;
+        if (setStates6(rte_socket_id(), &pairs[idx].l4_5tuple,
+                       &states) == NULL) {
+            printf("mg: state table full, backup records dropped!\n");
+            return;
+        }
+    }
+}
+
+/*
+ * Answer a state pull with a specific state backup message, whose
+ * packet_id is the one of the pull. ipserver 0 tells the puller that we
+ * have no state. end is the end of the message.
+ */
+static void
+pull_to_machine(uint8_t port, const struct ipv4_hdr* ip_h,
+                const struct ctrl_batch_hdr* hdr, const u_char* end)
+{
+    const uint32_t request_ip = rte_be_to_cpu_32(ip_h->src_addr);
+    const uint16_t packet_id = rte_be_to_cpu_16(ip_h->packet_id);
+    struct nf_states* request_states;
+
+    if (hdr->format == CTRL_FMT_RECORDS6) {
+        struct states_5tuple6_pair pair;
+        if ((const u_char*)hdr + sizeof(*hdr) + sizeof(pair.l4_5tuple) > end) {
+            printf("mg: truncated state pull message!\n");
+            return;
+        }
+        memset(&pair, 0, sizeof(pair));
+        memcpy(&pair.l4_5tuple, hdr + 1, sizeof(pair.l4_5tuple));
+        if (getStates6(&pair.l4_5tuple, &request_states) >= 0)
+            pair.states = *request_states;
+        else
+            printf("mg: state not found for remote machine!\n");
+        /* In HPSMS, proto A0 indicate this is state backup message */
+        send_ctrl_record(port, MANAGER_TX_QUEUE, request_ip, 0xA0, packet_id,
+                         CTRL_FMT_RECORDS6, &pair, sizeof(pair),
+                         GW_STAT_STATE_BACKUP_CTRL_TX_BYTES);
+    }
+    else {
+        struct states_5tuple_pair pair;
+        if ((const u_char*)hdr + sizeof(*hdr) + sizeof(pair.l4_5tuple) > end) {
+            printf("mg: truncated state pull message!\n");
+            return;
+        }
+        memset(&pair, 0, sizeof(pair));
+        memcpy(&pair.l4_5tuple, hdr + 1, sizeof(pair.l4_5tuple));
+        if (managerGetStates(&pair.l4_5tuple, &request_states) >= 0)
+            pair.states = *request_states;
+        else
+            printf("mg: state not found for remote machine!\n");
+        send_ctrl_record(port, MANAGER_TX_QUEUE, request_ip, 0xA0, packet_id,
+                         CTRL_FMT_RECORDS, &pair, sizeof(pair),
+                         GW_STAT_STATE_BACKUP_CTRL_TX_BYTES);
+    }
+}
+
+/*
+ * Install the state of a pulled flow in the tables of the socket of the
+ * nf packet_id-1, and hand the answer over to that nf, which parked the
+ * packets of the flow. end is the end of the message.
+ */
+static void
+pull_reply_to_machine(const struct ipv4_hdr* ip_h,
+                      const struct ctrl_batch_hdr* hdr, const u_char* end)
+{
+    const uint16_t nf_id = rte_be_to_cpu_16(ip_h->packet_id) - 1;
+    const int ipv6 = hdr->format == CTRL_FMT_RECORDS6;
+    struct pull_reply* reply;
+    struct nf_states states;
+    unsigned socket;
+
+    if (nf_id >= nb_nf_cores) {
+        printf("mg: pull reply for unknown nf %u!\n", nf_id);
+        return;
+    }
+    if ((const u_char*)(hdr + 1) + (ipv6 ?
+            sizeof(struct states_5tuple6_pair) :
+            sizeof(struct states_5tuple_pair)) > end) {
+        printf("mg: truncated state backup message!\n");
+        return;
+    }
+    if (rte_mempool_get(pull_reply_pool, (void **)&reply) < 0) {
+        printf("mg: pull reply alloc failed!\n");
+        return;
+    }
+    socket = rte_lcore_to_socket_id(nf_insts[nf_id].lcore_id);
+    reply->ipv6 = ipv6;
+    reply->states = NULL;
+    if (ipv6) {
+        const struct states_5tuple6_pair* pair =
+            (const struct states_5tuple6_pair*)(hdr + 1);
+        reply->l6_5tuple = pair->l4_5tuple;
+        /* ipserver 0 means the backup machine has no state */
+        if (pair->states.ipserver != 0) {
+            states = pair->states;
+            states.last_seen = flow_time_now();
+            states.flags = 0;
+            reply->states = setStates6(socket, &pair->l4_5tuple, &states);
+        }
+    }
+    else {
+        struct states_5tuple_pair* pair = (struct states_5tuple_pair*)(hdr + 1);
+        reply->l4_5tuple = pair->l4_5tuple;
+        if (pair->states.ipserver != 0)
+            reply->states = backup_to_machine(pair, 0, socket);
+    }
+    if (rte_ring_enqueue(nf_pull_wait_ring[nf_id], reply) < 0) {
+        printf("mg: enqueue failed!\n");
+        rte_mempool_put(pull_reply_pool, reply);
+    }
+}
+
+/* Ask target_ip to stream its state tables here (proto 0xA5) */
+static void
+migrate_request(uint8_t port, uint32_t target_ip)
+{
+    struct rte_mbuf* request_packet;
+    struct ether_hdr* eth_h;
+    struct ipv4_hdr* ip_h;
+    struct ether_addr self_eth_addr;
+    /* Allocate space */
+    request_packet = rte_pktmbuf_alloc(single_port_param.manager_mempool);
+    if (request_packet == NULL) {
+        printf("mg: request_packet alloc failed\n");
+        return;
+    }
+    eth_h = (struct ether_hdr *)
+        rte_pktmbuf_append(request_packet, sizeof(struct ether_hdr));
+    ip_h = (struct ipv4_hdr *)
+        rte_pktmbuf_append(request_packet, sizeof(struct ipv4_hdr));
+    /* Set the packet ether header */
+    eth_h->ether_type =  rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+    ether_addr_copy(&interface_MAC, &(eth_h->d_addr));
+    rte_eth_macaddr_get(port, &self_eth_addr);
+    ether_addr_copy(&self_eth_addr, &(eth_h->s_addr));
+    /* Set the packet ip header */
+    memset((char *)ip_h, 0, sizeof(struct ipv4_hdr));
+    ip_h->src_addr=rte_cpu_to_be_32(this_machine->ip);
+    ip_h->dst_addr=rte_cpu_to_be_32(target_ip);
+    ip_h->version_ihl = (4 << 4) | 5;
+    ip_h->total_length = rte_cpu_to_be_16(20);
+    ip_h->packet_id = 0;/* NO USE */
+    ip_h->time_to_live=4;
+    /* In HPSMS, proto A5 indicate this is migration request message */
+    ip_h->next_proto_id = 0xA5;
+    ip_h->hdr_checksum = rte_ipv4_cksum(ip_h);
+    lcore_stat_add(GW_STAT_CTRL_TX_PKTS, 1);
+    lcore_stat_add(GW_STAT_CTRL_TX_BYTES, request_packet->data_len);
+    if (rte_eth_tx_burst(port, MANAGER_TX_QUEUE, &request_packet, 1) != 1) {
+        printf("mg: tx request_packet failed!\n");
+        rte_pktmbuf_free(request_packet);
+    }
+}
+
+/* Start streaming the state tables to target_ip, one migration at a time */
+static void
+migrate_start(uint8_t port, uint32_t target_ip)
+{
+    struct migration* mg = &migration;
+
+    if (target_ip == this_machine->ip)
+        return;
+    if (mg->target_ip != 0) {
+        printf("mg: migration to "IPv4_BYTES_FMT " running, request from "
+               IPv4_BYTES_FMT " ignored\n",
+               IPv4_BYTES(mg->target_ip), IPv4_BYTES(target_ip));
+        return;
+    }
+    mg->socket = 0;
+    while (state_tables[mg->socket].hash == NULL)
+        mg->socket++;
+    mg->next = 0;
+    mg->credit = 0;
+    mg->last_tsc = rte_rdtsc();
+    mg->nb_records = 0;
+    mg->nb_backups = 0;
+    mg->nb_indexs = 0;
+    mg->batch.port = port;
+    mg->backup_batch.port = port;
+    mg->target_ip = target_ip;
+    printf("mg: migrating states to "IPv4_BYTES_FMT "\n",
+           IPv4_BYTES(target_ip));
+}
+
+/*
+ * Make room for a record of size bytes in batch, sending it first if it
+ * is full and the rate allows it. Returns 0 if the walk has to wait.
+ */
+static int
+migrate_room(struct migration* mg, struct ctrl_batch* batch, uint16_t size,
+             uint64_t cost, enum gw_stat tx_stat)
+{
+    if (batch->packet == NULL || ctrl_batch_fits(batch, size))
+        return 1;
+    if (mg->credit < cost)
+        return 0;
+    mg->credit -= cost;
+    ctrl_batch_flush(batch, tx_stat);
+    return 1;
+}
+
+/*
+ * Migration step: walk the next MIGRATE_BUDGET slots of the state
+ * tables, then of the index table (socket NB_SOCKETS). Of the flows this
+ * machine owns, the target gets those the ECMP model now places on it,
+ * as its own, and the copies it holds as a backup machine of the others.
+ * It gets the whole index table. A full packet leaves only when the rate
+ * allows it, otherwise the walk waits for the next loop.
+ */
+static void
+manager_migrate(uint64_t cur_tsc)
+{
+    struct migration* mg = &migration;
+    const uint64_t cost = TIMER_RESOLUTION_CYCLES / migrate_rate;
+    const int target_idx = machine_id(mg->target_ip) - 1;
+    struct states_5tuple_pair* pair;
+    struct indexs_5tuple_pair* ipair;
+    struct nf_states* states;
+    struct nf_indexs* indexs;
+    struct ipv4_5tuple l4_5tuple;
+    union ipv4_5tuple_host host_key;
+    struct ctrl_batch* batch;
+    const void* key;
+    void* data;
+    uint32_t next, seq;
+    uint8_t format;
+    int32_t pos;
+    int n;
+
+    if (mg->target_ip == 0)
+        return;
+    mg->credit += cur_tsc - mg->last_tsc;
+    mg->last_tsc = cur_tsc;
+    if (mg->credit > MIGRATE_BURST * cost)
+        mg->credit = MIGRATE_BURST * cost;
+    for (n = 0; n < MIGRATE_BUDGET; n++) {
+        if (mg->socket == NB_SOCKETS) {
+            if (!migrate_room(mg, &mg->batch, sizeof(struct indexs_5tuple_pair),
+                              cost, GW_STAT_KEYSET_CTRL_TX_BYTES))
+                return;
+            /* the manager is the only writer of the index table */
+#ifdef INDEX_TABLE_EFD
+            /* EFD cannot be walked, the new owner gets new keysets only */
+            pos = -ENOENT;
+#else
+            pos = rte_hash_iterate(index_hash_table, &key, &data, &mg->next);
+#endif
+            if (pos < 0) {
+                ctrl_batch_flush(&mg->batch, GW_STAT_KEYSET_CTRL_TX_BYTES);
+                printf("mg: migrated %"PRIu64" states, %"PRIu64" backups and"
+                       " %"PRIu64" indexes to "IPv4_BYTES_FMT "\n",
+                       mg->nb_records, mg->nb_backups, mg->nb_indexs,
+                       IPv4_BYTES(mg->target_ip));
+                mg->target_ip = 0;
+                return;
+            }
+#ifndef INDEX_TABLE_EFD
+            if (flow_indexs[pos].backupip[0] == 0)
+                continue;
+            /* In HPSMS, proto A2 indicate this is keyset message */
+            ipair = ctrl_batch_append(
+                &mg->batch, mg->batch.port, mg->target_ip, 0xA2,
+                CTRL_FMT_RECORDS, sizeof(struct indexs_5tuple_pair),
+                GW_STAT_KEYSET_CTRL_TX_BYTES
+            );
+            if (ipair == NULL) {
+                printf("mg: migration record dropped!\n");
+                continue;
+            }
+            convert_ipv4_5tuple_host((const union ipv4_5tuple_host*)key,
+                                     &ipair->l4_5tuple);
+            ipair->indexs = flow_indexs[pos];
+            mg->nb_indexs++;
+#else
+            RTE_SET_USED(ipair);
+#endif
+            continue;
+        }
+        /* nf cores may add keys, walk again from next if one did */
+        next = mg->next;
+        do {
+            seq = table_read_begin(&state_tables[mg->socket].seq);
+            mg->next = next;
+            pos = rte_hash_iterate(state_tables[mg->socket].hash, &key,
+                                   &data, &mg->next);
+            if (pos >= 0)
+                memcpy(&host_key, key, sizeof(host_key));
+        } while (table_read_retry(&state_tables[mg->socket].seq, seq));
+        if (pos < 0) {
+            /*
+             * at the end of a table go on with the next socket that has
+             * one, then with the index table, in packets of their own
+             */
+            mg->next = 0;
+            do {
+                mg->socket++;
+            } while (mg->socket < NB_SOCKETS &&
+                     state_tables[mg->socket].hash == NULL);
+            if (mg->socket == NB_SOCKETS) {
+                ctrl_batch_flush(&mg->batch, GW_STAT_STATE_BACKUP_CTRL_TX_BYTES);
+                ctrl_batch_flush(&mg->backup_batch,
+                                 GW_STAT_STATE_BACKUP_CTRL_TX_BYTES);
+            }
+            continue;
+        }
+        states = &state_tables[mg->socket].states[pos];
+        /* backups held for other owners stay with them */
+        if (states->ipserver == 0 || (states->flags & NF_STATE_F_BACKUP))
+            continue;
+        convert_ipv4_5tuple_host(&host_key, &l4_5tuple);
+        if (target_idx >= 0 && ecmp_model_owner(&l4_5tuple) == target_idx) {
+            batch = &mg->batch;
+            format = CTRL_FMT_MIGRATE;
+        }
+        else if (getIndexs(&l4_5tuple, &indexs) >= 0 &&
+                 (indexs->backupip[0] == mg->target_ip ||
+                  indexs->backupip[1] == mg->target_ip)) {
+            batch = &mg->backup_batch;
+            format = CTRL_FMT_RECORDS;
+        }
+        else
+            continue;
+        if (!migrate_room(mg, batch, sizeof(struct states_5tuple_pair), cost,
+                          GW_STAT_STATE_BACKUP_CTRL_TX_BYTES)) {
+            /* the slot is visited again on the next loop */
+            mg->next = next;
+            return;
+        }
+        /* In HPSMS, proto A0 indicate this is state backup message */
+        pair = ctrl_batch_append(
+            batch, mg->batch.port, mg->target_ip, 0xA0, format,
+            sizeof(struct states_5tuple_pair),
+            GW_STAT_STATE_BACKUP_CTRL_TX_BYTES
+        );
+        if (pair == NULL) {
+            printf("mg: migration record dropped!\n");
+            continue;
+        }
+        pair->l4_5tuple = l4_5tuple;
+        pair->states = *states;
+        if (format == CTRL_FMT_RECORDS) {
+            mg->nb_backups++;
+            continue;
+        }
+        /*
+         * The target serves the flow from now on. Keep a backup copy for
+         * the packets still on their way here, it ages out unless the
+         * new owner tears the flow down first. An nf core marking the
+         * flow closing at the same time may undo this.
+         */
+        states->flags |= NF_STATE_F_BACKUP;
+        mg->nb_records++;
+    }
+}
+
+/*
+ * Record the backup machines of a new flow in the index table, send them
+ * its state and tell every other machine its index.
+ */
+static void
+place_backups(uint8_t port, struct ipv4_5tuple* ip_5tuple,
+              uint32_t backup_ip1, uint32_t backup_ip2)
+{
+    struct nf_states* backup_states;
+    struct nf_indexs reply_indexs;
+    struct nf_indexs *indexs = &reply_indexs;
+    uint32_t idx;
+
+    ip_5tuple->proto = 0x6;
+    int ret = managerGetStates(ip_5tuple, &backup_states);
+    if (ret < 0) {
+        printf("mg: state not found!\n");
+        return;
+    }
+    if (backup_ip1 ==  this_machine->ip) {
+        indexs->backupip[0] = backup_ip2;
+        indexs->backupip[1] = 0;
+        setIndexs(ip_5tuple, indexs);
+        backup_enqueue(port, backup_ip2, ip_5tuple, backup_states);
+    }
+    else if (backup_ip2 ==  this_machine->ip) {
+        indexs->backupip[0] = backup_ip1;
+        indexs->backupip[1] = 0;
+        setIndexs(ip_5tuple, indexs);
+        backup_enqueue(port, backup_ip1, ip_5tuple, backup_states);
+    }
+    else {
+        indexs->backupip[0] = backup_ip1;
+        indexs->backupip[1] = backup_ip2;
+        setIndexs(ip_5tuple, indexs);
+        backup_enqueue(port, backup_ip1, ip_5tuple, backup_states);
+        backup_enqueue(port, backup_ip2, ip_5tuple, backup_states);
+    }
+
+    for (idx = 0; idx < n_machines; idx++) {
+        if (idx == this_machine_index)
+            continue;
+        keyset_enqueue(port, idx, ip_5tuple, indexs);
+    }
+    snat_broadcast(port, ip_5tuple, backup_states, backup_states->ipserver);
+}
+
+/*
+ * Set once the slave stopped taking backup requests, the manager takes
+ * them from then on and places the backups with the ECMP model.
+ */
+static volatile uint8_t slave_handed_over = 0;
+
+/* Place the backups of the new flows with the ECMP model, no probes */
+static void
+manager_model_requests(uint8_t port)
+{
+    struct ipv4_5tuple* ip_5tuples[BURST_SIZE];
+    uint32_t backup_ip1, backup_ip2;
+    unsigned nb, k;
+    int index;
+    int i;
+
+    if (!slave_handed_over)
+        return;
+    FOR_EACH_NF_CORE {
+        nb = rte_ring_dequeue_burst(nf_manager_ring[i], (void**)ip_5tuples,
+                                    BURST_SIZE, NULL);
+        for (k = 0; k < nb; k++) {
+            index = ecmp_model_index(ip_5tuples[k]);
+            if (index < 0) {
+                printf("mg: no ECMP model for a backup request!\n");
+                continue;
+            }
+            ecmp_backup_ips(index, &backup_ip1, &backup_ip2);
+            place_backups(port, ip_5tuples[k], backup_ip1, backup_ip2);
+        }
+        if (nb > 0)
+            rte_mempool_put_bulk(flow_req_pool, (void**)ip_5tuples, nb);
+    }
+}
+
+/*
+ * place_backups() for a new IPv6 flow. The ECMP probes are IPv4, so the
+ * backups of an IPv6 flow are the machines the hash of its key picks.
+ */
+static void
+place_backups6(uint8_t port, const struct ipv6_5tuple* ip_5tuple)
+{
+    union ipv6_5tuple_host key;
+    struct nf_states* backup_states;
+    struct nf_indexs indexs;
+    uint32_t backup_ip1, backup_ip2;
+    uint32_t idx;
+
+    if (getStates6(ip_5tuple, &backup_states) < 0) {
+        printf("mg: state not found!\n");
+        return;
+    }
+    convert_ipv6_5tuple(ip_5tuple, &key);
+    ecmp_backup_ips(rte_hash_crc(&key, sizeof(key), 0) % n_machines,
+                    &backup_ip1, &backup_ip2);
+    if (backup_ip1 == this_machine->ip) {
+        backup_ip1 = backup_ip2;
+        backup_ip2 = 0;
+    }
+    else if (backup_ip2 == this_machine->ip) {
+        backup_ip2 = 0;
+    }
+    indexs.backupip[0] = backup_ip1;
+    indexs.backupip[1] = backup_ip2;
+    setIndexs6(ip_5tuple, &indexs);
+    backup6_enqueue(port, backup_ip1, ip_5tuple, backup_states);
+    if (backup_ip2 != 0)
+        backup6_enqueue(port, backup_ip2, ip_5tuple, backup_states);
+
+    for (idx = 0; idx < n_machines; idx++) {
+        if (idx == this_machine_index)
+            continue;
+        keyset6_enqueue(port, idx, ip_5tuple, &indexs);
+    }
+}
+
+/* Place the backups of the new IPv6 flows of the nf cores */
+static void
+manager_ipv6_requests(uint8_t port)
+{
+    struct ipv6_5tuple* ip_5tuples[BURST_SIZE];
+    unsigned nb, k;
+    int i;
+
+    FOR_EACH_NF_CORE {
+        nb = rte_ring_dequeue_burst(nf_manager_ring6[i], (void**)ip_5tuples,
+                                    BURST_SIZE, NULL);
+        for (k = 0; k < nb; k++)
+            place_backups6(port, ip_5tuples[k]);
+        if (nb > 0)
+            rte_mempool_put_bulk(flow_req_pool, (void**)ip_5tuples, nb);
     }
-    indexs->backupip[0] = keyset_pair->indexs.backupip[0];
-    indexs->backupip[1] = keyset_pair->indexs.backupip[1];
-    setIndexs(&(keyset_pair->l4_5tuple), indexs);
 }
 
+/* Position of an aging sweep, over the state tables of one IP version */
+struct flow_aging {
+    unsigned socket;
+    uint32_t cursor;
+    /* flow time the last pass refreshing the backups of a table began */
+    uint32_t refresh_start[NB_SOCKETS];
+    /* this pass refreshes the flows seen since refresh_since */
+    uint8_t refresh;
+    uint32_t refresh_since;
+};
+
+/* Send the state of an active flow to its backup machines again */
+static void
+flow_refresh_backups(uint8_t port, const void* key, int ipv6,
+                     const struct nf_states* states)
+{
+    struct ipv4_5tuple ip_5tuple;
+    struct ipv6_5tuple ip_5tuple6;
+    struct nf_indexs* indexs;
+    int k;
+
+    if (ipv6) {
+        convert_ipv6_5tuple_host(key, &ip_5tuple6);
+        if (getIndexs6(&ip_5tuple6, &indexs) < 0)
+            return;
+    }
+    else {
+        convert_ipv4_5tuple_host(key, &ip_5tuple);
+        if (getIndexs(&ip_5tuple, &indexs) < 0)
+            return;
+    }
+    for (k = 0; k < 2; k++) {
+        if (indexs->backupip[k] == 0 || indexs->backupip[k] == this_machine->ip)
+            continue;
+        if (ipv6)
+            backup6_enqueue(port, indexs->backupip[k], &ip_5tuple6, states);
+        else
+            backup_enqueue(port, indexs->backupip[k], &ip_5tuple, states);
+    }
+}
+
+/*
+ * Incremental aging sweep: visit AGING_BUDGET slots of the state tables
+ * of one IP version per call and tear down the flows this machine owns
+ * that have been idle for too long (or closed by FIN/RST for a short
+ * while), refresh the backups of the others on a refreshing pass, and
+ * drop the backup copies their owner stopped refreshing.
+ */
+static void
+flow_aging_sweep(uint8_t port, const struct state_table* tables,
+                 uint32_t entries, int ipv6, struct flow_aging* a)
+{
+    const uint32_t now = flow_time_now();
+    const struct state_table* t;
+    struct nf_states* states;
+    union ipv4_5tuple_host key4;
+    union ipv6_5tuple_host key6;
+    void* key;
+    uint32_t timeout, seq;
+    int32_t ret;
+    int n, idle;
+
+    if (tables[a->socket].hash == NULL)
+        a->cursor = entries;
+    for (n = 0; n < AGING_BUDGET; n++, a->cursor++) {
+        /* at the end of a table go on with the next socket that has one */
+        if (a->cursor >= entries) {
+            a->cursor = 0;
+            do {
+                a->socket = (a->socket + 1) % NB_SOCKETS;
+            } while (tables[a->socket].hash == NULL);
+            a->refresh = (uint32_t)(now - a->refresh_start[a->socket]) >=
+                FLOW_BACKUP_REFRESH;
+            if (a->refresh) {
+                a->refresh_since = a->refresh_start[a->socket];
+                a->refresh_start[a->socket] = now;
+            }
+        }
+        t = &tables[a->socket];
+        states = &t->states[a->cursor];
+        if (states->ipserver == 0)
+            continue;
+        if (states->flags & NF_STATE_F_BACKUP)
+            timeout = FLOW_BACKUP_TIMEOUT;
+        else if (states->flags & NF_STATE_F_CLOSING)
+            timeout = FLOW_CLOSE_TIMEOUT;
+        else
+            timeout = FLOW_IDLE_TIMEOUT;
+        /* an nf core may have seen the flow after now was read */
+        idle = (int32_t)(now - states->last_seen) >= (int32_t)timeout;
+        if (!idle && (!a->refresh || (states->flags & NF_STATE_F_BACKUP) ||
+                      (int32_t)(states->last_seen - a->refresh_since) <= 0))
+            continue;
+        /* nf cores may add keys, copy it out under the sequence count */
+        do {
+            seq = table_read_begin(&t->seq);
+            ret = rte_hash_get_key_with_position(t->hash, a->cursor, &key);
+            if (ret >= 0 && ipv6)
+                memcpy(&key6, key, sizeof(key6));
+            else if (ret >= 0)
+                memcpy(&key4, key, sizeof(key4));
+        } while (table_read_retry(&t->seq, seq));
+        if (ret < 0)
+            continue;
+        if (!idle) {
+            flow_refresh_backups(port, ipv6 ? (void*)&key6 : (void*)&key4,
+                                 ipv6, states);
+            continue;
+        }
+        /* the owner is gone or its teardown was lost, the copy only */
+        if (states->flags & NF_STATE_F_BACKUP) {
+            if (ipv6)
+                delStates6(&key6);
+            else
+                delStates(&key4);
+            continue;
+        }
+        /* IPv6 flows skip the nf chain, they hold nothing of it */
+        if (ipv6) {
+            flow_teardown6(port, &key6);
+            continue;
+        }
+        flow_teardown(port, &key4, states);
+    }
+}
+
+static void
+manager_flow_aging(uint8_t port)
+{
+    static struct flow_aging aging, aging6;
+
+    flow_aging_sweep(port, state_tables, flow_entries, 0, &aging);
+    flow_aging_sweep(port, state_tables6, flow_entries6, 1, &aging6);
+}
+
+/*
+ * Send a state pull request on behalf of an nf core, from its own tx
+ * queue. It does not wait: the reply comes back as a specific state
+ * backup message and is handed to the nf through nf_pull_wait_ring.
+ */
 int
-pullState(uint16_t nf_id, uint8_t port, struct ipv4_5tuple* ip_5tuple,
-          struct nf_indexs* target_indexs, struct nf_states** target_states)
-{
-    struct rte_mbuf* pull_packet;
-    uint64_t prev_tsc, cur_tsc, diff_tsc;
-    /* build and send pull request packet */
-    pull_packet = build_pull_packet(
-        port, target_indexs, nf_id, ip_5tuple
-    );
+pullState(uint16_t nf_id, uint8_t port, uint16_t tx_queue_id,
+          struct ipv4_5tuple* ip_5tuple, struct nf_indexs* target_indexs)
+{
+    /*
+     * In HPSMS, proto A1 indicate this is state pull message, packet_id 0
+     * is general backup
+     */
+    return send_ctrl_record(port, tx_queue_id, target_indexs->backupip[0],
+                            0xA1, nf_id + 1, CTRL_FMT_RECORDS, ip_5tuple,
+                            sizeof(*ip_5tuple),
+                            GW_STAT_STATE_PULL_CTRL_TX_BYTES);
+}
+
+/* pullState() of an IPv6 flow */
+int
+pullState6(uint16_t nf_id, uint8_t port, uint16_t tx_queue_id,
+           const struct ipv6_5tuple* ip_5tuple,
+           const struct nf_indexs* target_indexs)
+{
+    return send_ctrl_record(port, tx_queue_id, target_indexs->backupip[0],
+                            0xA1, nf_id + 1, CTRL_FMT_RECORDS6, ip_5tuple,
+                            sizeof(*ip_5tuple),
+                            GW_STAT_STATE_PULL_CTRL_TX_BYTES);
+}
+
+/*
+ * Handle a control message, from the manager queue of port or passed on
+ * by the nf core that received it.
+ */
+static void
+manager_ctrl_packet(uint8_t port, struct rte_mbuf* m)
+{
+    struct ether_hdr* eth_h;
+    struct ipv4_hdr* ip_h;
+    uint8_t ip_proto;
+    u_char* payload;
 
-    if (rte_eth_tx_burst(port, MANAGER_TX_QUEUE, &pull_packet, 1) != 1) {
-        printf("mg: tx pullState failed!\n");
-        rte_pktmbuf_free(pull_packet);
+    #ifdef __DEBUG_LV1
+    printf("mg: packet comes from port %u\n", port);
+    #endif
+    eth_h = rte_pktmbuf_mtod(m, struct ether_hdr *);
+    if (eth_h->ether_type == rte_cpu_to_be_16(ETHER_TYPE_ARP)) {
+        /* steered here by ctrl_flow_setup(), answered like the nf does */
+        nf_arp_process(port, eth_h, MANAGER_TX_QUEUE, &m);
+        return;
     }
-    /* wait until receive response(specific state backup message) */
-    prev_tsc = rte_rdtsc();
-    while (rte_ring_dequeue(nf_pull_wait_ring, (void**)target_states) != 0) {
-        cur_tsc = rte_rdtsc();
-        diff_tsc = cur_tsc - prev_tsc;
-        if (diff_tsc >= TIMER_RESOLUTION_CYCLES/200) {
-            printf("mg: timeout in pullState\n");
-            return -1;
+    ip_h = (struct ipv4_hdr*)
+           ((u_char*)eth_h + sizeof(struct ether_hdr));
+    ip_proto = ip_h->next_proto_id;
+    #ifdef __DEBUG_LV1
+    printf("mg: dst ip "IPv4_BYTES_FMT " \n",
+           IPv4_BYTES(ip_h->dst_addr));
+    printf("mg: proto: %x\n",ip_proto);
+    #endif
+    if (((ip_h->dst_addr & 0x000000FF) != (0xAC << 0)) ||
+        ((ip_h->dst_addr & 0x0000FF00) != (0x10 << 8))) {
+        printf("mg: wrong packet in control message queue!!!\n");
+        rte_pktmbuf_free(m);
+        return;
+    }
+    if (ip_proto == 0x06 || ip_proto == 0x11) {
+        lcore_stat_add(GW_STAT_CTRL_RX_PKTS, 1);
+        lcore_stat_add(GW_STAT_CTRL_RX_BYTES, m->data_len);
+        /* Control message about ECMP */
+        if ((ip_h->dst_addr & 0x00FF0000) == (0xFD << 16)) {
+            /* Destination ip is 172.16.253.X */
+            /* This is ECMP predict request message */
+            struct rte_mbuf* probing_packet;
+            probing_packet = backup_receive_probe_packet(m);
+            if (probing_packet == NULL) {
+                rte_pktmbuf_free(m);
+                return;
+            }
+            lcore_stat_add(GW_STAT_CTRL_TX_PKTS, 1);
+            lcore_stat_add(GW_STAT_CTRL_TX_BYTES, probing_packet->data_len);
+            lcore_stat_add(GW_STAT_ECMP_CTRL_TX_BYTES, probing_packet->data_len);
+            if (rte_eth_tx_burst(port,MANAGER_TX_QUEUE,&probing_packet,1) != 1) {
+                printf("mg: tx probing_packet failed!\n");
+                rte_pktmbuf_free(probing_packet);
+            }
+            #ifdef __DEBUG_LV1
+            printf("mg: This is ECMP predict request message\n");
+            #endif
+        }
+        else if ((ip_h->dst_addr & 0xFF000000) == (0x2 << 24)) {
+            /* Destination ip is 172.16.X.2 */
+            /* This is ECMP predict reply message */
+            // ecmp_receive_reply(m);
+            struct ipv4_5tuple ip_5tuple;
+            uint32_t backup_ip1;
+            uint32_t backup_ip2;
+            uint32_t index;
+            int calib;
+            /* Get backup machine ip */
+            calib = master_receive_probe_reply(
+                m, &index, &backup_ip1, &backup_ip2, &ip_5tuple
+            );
+            #ifdef __DEBUG_LV1
+            printf("mg: This is ECMP pedict reply message\n");
+            #endif
+            if (calib < 0)
+                printf("mg: probe reply with a bad machine index, dropped\n");
+            else if (calib)
+                ecmp_model_calib_reply(&ip_5tuple, index);
+            else
+                place_backups(port, &ip_5tuple, backup_ip1, backup_ip2);
         }
     }
-    return 0;
+    else if (ip_proto == 0xA0) {
+        /* Control message about state backup */
+        /* Destination ip is 172.16.X.Y */
+        /* This is state backup message */
+        lcore_stat_add(GW_STAT_CTRL_RX_PKTS, 1);
+        lcore_stat_add(GW_STAT_CTRL_RX_BYTES, m->data_len);
+        #ifdef __DEBUG_LV1
+        printf("mg: This is state backup message\n");
+        #endif
+        payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
+        if (ip_h->packet_id == 0) {
+            /* General state backup message, count records */
+            struct ctrl_batch_hdr* hdr =
+                (struct ctrl_batch_hdr*)payload;
+            struct states_5tuple_pair* pair =
+                (struct states_5tuple_pair*)(hdr + 1);
+            struct states_5tuple6_pair* pair6 =
+                (struct states_5tuple6_pair*)(hdr + 1);
+            u_char* end = (u_char*)ip_h + rte_be_to_cpu_16(ip_h->total_length);
+            uint16_t count = rte_be_to_cpu_16(hdr->count);
+            uint16_t idx;
+            if (hdr->format == CTRL_FMT_RECORDS6) {
+                if ((u_char*)(pair6 + count) > end)
+                    printf("mg: truncated state backup message!\n");
+                else
+                    backup6_batch_to_machine(pair6, count);
+                if (latency_enabled)
+                    latency_record(GW_LAT_MG_BACKUP, m);
+                rte_pktmbuf_free(m);
+                return;
+            }
+            if ((u_char*)(pair + count) > end) {
+                printf("mg: truncated state backup message!\n");
+                rte_pktmbuf_free(m);
+                return;
+            }
+            /* migrated states are owned here, aged and torn down here */
+            for (idx = 0; idx < count; idx += BURST_SIZE)
+                backup_batch_to_machine(&pair[idx],
+                    RTE_MIN(count - idx, BURST_SIZE),
+                    hdr->format == CTRL_FMT_MIGRATE ? 0 : NF_STATE_F_BACKUP,
+                    rte_socket_id());
+            if (latency_enabled)
+                latency_record(GW_LAT_MG_BACKUP, m);
+        }
+        else {
+            /* Specific state backup message for nf packet_id-1 */
+            pull_reply_to_machine(
+                ip_h, (struct ctrl_batch_hdr*)payload,
+                (u_char*)ip_h + rte_be_to_cpu_16(ip_h->total_length)
+            );
+        }
+    }
+    else if (ip_proto == 0xA1) {
+        /* Control message about state pull */
+        lcore_stat_add(GW_STAT_CTRL_RX_PKTS, 1);
+        lcore_stat_add(GW_STAT_CTRL_RX_BYTES, m->data_len);
+        #ifdef __DEBUG_LV1
+        printf("mg: This is state pull message\n");
+        #endif
+        payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
+        pull_to_machine(
+            port, ip_h, (struct ctrl_batch_hdr*)payload,
+            (u_char*)ip_h + rte_be_to_cpu_16(ip_h->total_length)
+        );
+    }
+    else if (ip_proto == 0xA2) {
+        /* Control message about keyset broadcast */
+        lcore_stat_add(GW_STAT_CTRL_RX_PKTS, 1);
+        lcore_stat_add(GW_STAT_CTRL_RX_BYTES, m->data_len);
+        #ifdef __DEBUG_LV1
+        printf("mg: This is keyset broadcast message\n");
+        #endif
+        payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
+        keyset_batch_to_machine(
+            (struct ctrl_batch_hdr*)payload,
+            (u_char*)ip_h + rte_be_to_cpu_16(ip_h->total_length)
+        );
+        if (latency_enabled)
+            latency_record(GW_LAT_MG_KEYSET, m);
+    }
+    else if (ip_proto == 0xA3) {
+        /* Control message about flow teardown */
+        lcore_stat_add(GW_STAT_CTRL_RX_PKTS, 1);
+        lcore_stat_add(GW_STAT_CTRL_RX_BYTES, m->data_len);
+        #ifdef __DEBUG_LV1
+        printf("mg: This is flow teardown message\n");
+        #endif
+        payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
+        teardown_batch_to_machine(
+            (struct ctrl_batch_hdr*)payload,
+            (u_char*)ip_h + rte_be_to_cpu_16(ip_h->total_length)
+        );
+    }
+    else if (ip_proto == 0xA4) {
+        /* Control message about a backend update */
+        lcore_stat_add(GW_STAT_CTRL_RX_PKTS, 1);
+        lcore_stat_add(GW_STAT_CTRL_RX_BYTES, m->data_len);
+        payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
+        backend_update((struct lb_backend_update*)payload);
+    }
+    else if (ip_proto == 0xA5) {
+        /* Control message asking for our states */
+        lcore_stat_add(GW_STAT_CTRL_RX_PKTS, 1);
+        lcore_stat_add(GW_STAT_CTRL_RX_BYTES, m->data_len);
+        #ifdef __DEBUG_LV1
+        printf("mg: This is migration request message\n");
+        #endif
+        migrate_start(port, rte_be_to_cpu_32(ip_h->src_addr));
+    }
+    #ifdef __DEBUG_LV1
+    printf("\n");
+    #endif
+    rte_pktmbuf_free(m);
 }
 
 /*
@@ -455,15 +1802,26 @@ lcore_manager(__attribute__((unused)) void *arg)
 {
     const uint8_t nb_ports = rte_eth_dev_count();
     uint8_t port;
+    uint8_t ctrl_port = 0;
     int i;
-    struct ether_hdr* eth_h;
-    struct ipv4_hdr* ip_h;
-    // uint16_t eth_type;
-    uint8_t ip_proto;
-    u_char* payload;
 
     printf("\nCore %u manage states in gateway.\n", rte_lcore_id());
 
+    /* control messages not triggered by a packet leave from this port */
+    while (ctrl_port < nb_ports && (enabled_port_mask & (1 << ctrl_port)) == 0) {
+        ctrl_port++;
+    }
+
+    ecmp_model_calibrate(ctrl_port, MANAGER_TX_QUEUE);
+
+    /* a joining or replacing machine takes the states of the others */
+    if (migrate_on_start) {
+        uint32_t idx;
+        for (idx = 0; idx < n_machines; idx++)
+            if (idx != this_machine_index)
+                migrate_request(ctrl_port, topo[idx].ip);
+    }
+
 	rte_timer_subsystem_init();
 	rte_timer_init(&manager_timer);
 	rte_timer_reset(
@@ -472,7 +1830,7 @@ lcore_manager(__attribute__((unused)) void *arg)
     );
 
 	/* Run until the application is quit or killed. */
-    for (;;) {
+    while (!force_quit) {
         uint64_t prev_tsc = 0, cur_tsc , diff_tsc;
         cur_tsc = rte_rdtsc();
         diff_tsc = cur_tsc - prev_tsc;
@@ -480,6 +1838,11 @@ lcore_manager(__attribute__((unused)) void *arg)
             rte_timer_manage();
             prev_tsc = cur_tsc;
         }
+        ctrl_batch_flush_expired(cur_tsc);
+        manager_flow_aging(ctrl_port);
+        manager_model_requests(ctrl_port);
+        manager_ipv6_requests(ctrl_port);
+        manager_migrate(cur_tsc);
         for (port = 0; port < nb_ports; port++) {
             if ((enabled_port_mask & (1 << port)) == 0) {
                 //printf("Skipping %u\n", port);
@@ -496,227 +1859,17 @@ lcore_manager(__attribute__((unused)) void *arg)
              * continue;
              */
 
-            for (i = 0; i < nb_rx; i ++) {
-                #ifdef __DEBUG_LV1
-                printf("mg: packet comes from port %u queue 1\n", port);
-                #endif
-                eth_h = rte_pktmbuf_mtod(bufs[i], struct ether_hdr *);
-                ip_h = (struct ipv4_hdr*)
-                       ((u_char*)eth_h + sizeof(struct ether_hdr));
-                ip_proto = ip_h->next_proto_id;
-                #ifdef __DEBUG_LV1
-                printf("mg: dst ip "IPv4_BYTES_FMT " \n",
-                       IPv4_BYTES(ip_h->dst_addr));
-                printf("mg: proto: %x\n",ip_proto);
-                #endif
-                if (((ip_h->dst_addr & 0x000000FF) != (0xAC << 0)) ||
-                    ((ip_h->dst_addr & 0x0000FF00) != (0x10 << 8))) {
-                    printf("mg: wrong packet in control message queue!!!\n");
-                    rte_pktmbuf_free(bufs[i]);
-                    continue;
-                }
-                if (ip_proto == 0x06 || ip_proto == 0x11) {
-                    ctrl_rx_pkts += 1;
-                    ctrl_rx_bytes += bufs[i]->data_len;
-                    /* Control message about ECMP */
-                    if ((ip_h->dst_addr & 0x00FF0000) == (0xFD << 16)) {
-                        /* Destination ip is 172.16.253.X */
-                        /* This is ECMP predict request message */
-                        struct rte_mbuf* probing_packet;
-                        probing_packet = backup_receive_probe_packet(bufs[i]);
-                        ctrl_tx_pkts += 1;
-                        ctrl_tx_bytes += probing_packet->data_len;
-                        ecmp_ctrl_tx_bytes+= probing_packet->data_len;
-                        if (rte_eth_tx_burst(port,MANAGER_TX_QUEUE,&probing_packet,1) != 1) {
-                            printf("mg: tx probing_packet failed!\n");
-                            rte_pktmbuf_free(probing_packet);
-                        }
-                        #ifdef __DEBUG_LV1
-                        printf("mg: This is ECMP predict request message\n");
-                        #endif
-                    }
-                    else if ((ip_h->dst_addr & 0xFF000000) == (0x2 << 24)) {
-                        /* Destination ip is 172.16.X.2 */
-                        /* This is ECMP predict reply message */
-                        // ecmp_receive_reply(bufs[i]);
-                        struct ipv4_5tuple* ip_5tuple;
-                        struct rte_mbuf* backup_packet;
-                        struct nf_states* backup_states;
-                        struct rte_mbuf* keyset_packet;
-                        struct nf_indexs *indexs;
-                        uint32_t backup_ip1;
-                        uint32_t backup_ip2;
-                        uint16_t nb_tx;
-                        int idx;
-                        /* Get backup machine ip */
-                        master_receive_probe_reply(
-                            bufs[i], &backup_ip1, &backup_ip2, &ip_5tuple
-                        );
-                        #ifdef __DEBUG_LV1
-                        printf("mg: This is ECMP pedict reply message\n");
-                        #endif
-                        // printf("debug: size %d ip_5tuple %lx\n",
-                               // sizeof(ip_5tuple), ip_5tuple);
-                        ip_5tuple->proto = 0x6;
-                        int ret = managerGetStates(ip_5tuple, &backup_states);
-                        if (ret < 0) {
-                            printf("mg: state not found!\n");
-                            rte_pktmbuf_free(bufs[i]);
-                            continue;
-                        }
-                        indexs = rte_malloc(NULL, sizeof(struct nf_indexs), 0);
-                        if (!indexs) {
-                            rte_panic("mg: indexs malloc failed!");
-                            rte_pktmbuf_free(bufs[i]);
-                            continue;
-                        }
-						int ii;
-						for(ii = 0;ii < 1;ii++){
-                        if (backup_ip1 ==  this_machine->ip) {
-                            indexs->backupip[0] = backup_ip2;
-                            // indexs->backupip[0] = topo[3].ip;
-                            indexs->backupip[1] = 0;
-                            setIndexs(ip_5tuple, indexs);
-                            backup_packet = build_backup_packet(
-                                port, backup_ip2, 0x00, ip_5tuple, backup_states
-                            );
-                            // backup_packet = build_backup_packet(
-                            //     port, topo[3].ip, 0x00,
-                            //     ip_5tuple, backup_states
-                            // );
-                            nb_tx = rte_eth_tx_burst(port,MANAGER_TX_QUEUE,&backup_packet,1);
-                            if (nb_tx != 1) {
-                                printf("mg: tx backup_packet failed!\n");
-                                rte_pktmbuf_free(backup_packet);
-                            }
-                        }
-                        else if (backup_ip2 ==  this_machine->ip) {
-                            indexs->backupip[0] = backup_ip1;
-                            indexs->backupip[1] = 0;
-                            setIndexs(ip_5tuple, indexs);
-                            backup_packet = build_backup_packet(
-                                port, backup_ip1, 0x00, ip_5tuple, backup_states
-                            );
-                            nb_tx = rte_eth_tx_burst(port,MANAGER_TX_QUEUE,&backup_packet,1);
-                            if (nb_tx != 1) {
-                                printf("mg: tx backup_packet failed!\n");
-                                rte_pktmbuf_free(backup_packet);
-                            }
-                        }
-                        else {
-                            indexs->backupip[0] = backup_ip1;
-                            indexs->backupip[1] = backup_ip2;
-                            setIndexs(ip_5tuple, indexs);
-                            backup_packet = build_backup_packet(
-                                port, backup_ip1, 0x00, ip_5tuple, backup_states
-                            );
-                            nb_tx = rte_eth_tx_burst(port,MANAGER_TX_QUEUE,&backup_packet,1);
-                            if (nb_tx != 1) {
-                                printf("mg: tx backup_packet failed!\n");
-                                rte_pktmbuf_free(backup_packet);
-                            }
-                            backup_packet = build_backup_packet(
-                                port, backup_ip2, 0x00, ip_5tuple, backup_states
-                            );
-                            nb_tx = rte_eth_tx_burst(port,MANAGER_TX_QUEUE,&backup_packet,1);
-                            if (nb_tx != 1) {
-                                printf("mg: tx backup_packet failed!\n");
-                                rte_pktmbuf_free(backup_packet);
-                            }
-                        }
-						}
-
-                        for (idx = 0; idx < 4; idx++) {
-                            if (idx == this_machine_index)
-                                continue;
-                            keyset_packet = build_keyset_packet(
-                                topo[idx].ip, indexs, port, ip_5tuple
-                            );
-                            nb_tx = rte_eth_tx_burst(port,MANAGER_TX_QUEUE,&keyset_packet,1);
-                            if (nb_tx != 1) {
-                                printf("mg: tx keyset_packet failed!\n");
-                                rte_pktmbuf_free(keyset_packet);
-                            }
-                        }
-                    }
-                }
-                else if (ip_proto == 0xA0) {
-                    /* Control message about state backup */
-                    /* Destination ip is 172.16.X.Y */
-                    /* This is state backup message */
-                    ctrl_rx_pkts += 1;
-                    ctrl_rx_bytes += bufs[i]->data_len;
-                    #ifdef __DEBUG_LV1
-                    printf("mg: This is state backup message\n");
-                    #endif
-                    payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
-                    if (ip_h->packet_id == 0) {
-                        /* General state backup message */
-                        backup_to_machine((struct states_5tuple_pair*)payload);
-                    }
-                    else if (rte_be_to_cpu_16(ip_h->packet_id) == 1) {
-                        /* Specific state backup message for nf */
-                        int ret = rte_ring_enqueue(
-                            nf_pull_wait_ring,
-                            backup_to_machine(
-                                (struct states_5tuple_pair*)payload
-                            )
-                        );
-                        if (ret < 0) {
-                            printf("mg: enqueue failed!\n");
-                        }
-                    }
-                }
-                else if (ip_proto == 0xA1) {
-                    /* Control message about state pull */
-                    struct ipv4_5tuple* ip_5tuple;
-                    struct rte_mbuf* backup_packet;
-                    struct nf_states* request_states;
-                    struct ether_addr self_eth_addr;
-                    uint32_t request_ip;
-                    ctrl_rx_pkts += 1;
-                    ctrl_rx_bytes += bufs[i]->data_len;
-                    #ifdef __DEBUG_LV1
-                    printf("mg: This is state pull message\n");
-                    #endif
-                    payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
-                    /* Get the 5tuple and relevant state, build and send */
-                    ip_5tuple = (struct ipv4_5tuple*)payload;
-                    int ret = managerGetStates(ip_5tuple, &request_states);
-                    if (ret < 0) {
-                        printf("mg: state not found for remote machine!\n");
-                        backup_packet = build_backup_packet(
-                            port, rte_be_to_cpu_32(ip_h->src_addr),
-                            rte_be_to_cpu_16(ip_h->packet_id), ip_5tuple, NULL
-                        );
-                    }
-                    else {
-                        backup_packet = build_backup_packet(
-                            port, rte_be_to_cpu_32(ip_h->src_addr),
-                            rte_be_to_cpu_16(ip_h->packet_id), ip_5tuple,
-                            request_states
-                        );
-                    }
-                    if (rte_eth_tx_burst(port, MANAGER_TX_QUEUE, &backup_packet, 1) != 1) {
-                        printf("mg: tx backup_packet failed!\n");
-                        rte_pktmbuf_free(backup_packet);
-                    }
-                }
-                else if (ip_proto == 0xA2) {
-                    /* Control message about keyset broadcast */
-                    ctrl_rx_pkts += 1;
-                    ctrl_rx_bytes += bufs[i]->data_len;
-                    #ifdef __DEBUG_LV1
-                    printf("mg: This is keyset broadcast message\n");
-                    #endif
-                    payload = (u_char*)ip_h + ((ip_h->version_ihl)&0x0F)*4;
-                    keyset_to_machine((struct indexs_5tuple_pair*)payload);
-                }
-                #ifdef __DEBUG_LV1
-                printf("\n");
-                #endif
-                rte_pktmbuf_free(bufs[i]);
-            }
+            for (i = 0; i < nb_rx; i ++)
+                manager_ctrl_packet(port, bufs[i]);
+        }
+        /* control messages the ports could not steer, see ctrl_flow_setup() */
+        FOR_EACH_NF_CORE {
+            struct rte_mbuf *bufs[BURST_SIZE];
+            unsigned nb_ctrl = rte_ring_dequeue_burst(nf_ctrl_ring[i],
+                                                      (void**)bufs, BURST_SIZE, NULL);
+            unsigned k;
+            for (k = 0; k < nb_ctrl; k++)
+                manager_ctrl_packet(bufs[k]->port, bufs[k]);
         }
 	}
 	return 0;
@@ -726,42 +1879,63 @@ int
 lcore_manager_slave(__attribute__((unused)) void *arg)
 {
     const uint8_t nb_ports = rte_eth_dev_count();
-    uint8_t port;
-    struct ipv4_5tuple* ip_5tuple;
+    uint8_t ctrl_port = 0;
+    struct ipv4_5tuple* ip_5tuples[BURST_SIZE];
+    struct rte_mbuf* probing_packets[BURST_SIZE];
+    unsigned nb_req;
+    uint16_t nb_probe, nb_sent, k;
+    uint64_t probe_bytes;
+    int i;
+
+    /* probes leave through the control port, like the manager's messages */
+    while (ctrl_port < nb_ports && (enabled_port_mask & (1 << ctrl_port)) == 0) {
+        ctrl_port++;
+    }
     printf("\nCore %u process request from nf\n", rte_lcore_id());
-    for (;;) {
-        for (port = 0; port < nb_ports; port++) {
-            if ((enabled_port_mask & (1 << port)) == 0) {
-                //printf("Skipping %u\n", port);
+    while (!force_quit) {
+        /* the manager places backups itself once the model is ready */
+        if (ecmp_model_ready) {
+            slave_handed_over = 1;
+            rte_pause();
+            continue;
+        }
+        FOR_EACH_NF_CORE {
+            nb_req = rte_ring_dequeue_burst(nf_manager_ring[i],
+                                            (void**)ip_5tuples, BURST_SIZE, NULL);
+            if (nb_req == 0)
                 continue;
-            }
-            if (rte_ring_dequeue(nf_manager_ring, (void**)&ip_5tuple) == 0) {
-                // printf("debug: size %d ip_5tuple %lx\n",
-                       // sizeof(ip_5tuple), ip_5tuple);
-                struct rte_mbuf* probing_packet;
-                probing_packet = build_probe_packet(ip_5tuple);
-                #ifdef __DEBUG_LV1
-                printf("mg-salve: Receive backup request from nf\n");
+            #ifdef __DEBUG_LV1
+            printf("mg-salve: Receive %u backup requests from nf %d\n",
+                   nb_req, i);
+            #endif
+            #ifdef __DEBUG_LV2
+            for (k = 0; k < nb_req; k++) {
                 printf("mg-salve: ip_dst is "IPv4_BYTES_FMT " \n",
-                       IPv4_BYTES(ip_5tuple->ip_dst));
+                       IPv4_BYTES(ip_5tuples[k]->ip_dst));
                 printf("mg-salve: ip_src is "IPv4_BYTES_FMT " \n",
-                       IPv4_BYTES(ip_5tuple->ip_src));
-                #endif
-                #ifdef __DEBUG_LV2
-                printf("mg-salve: port_src is %u\n", ip_5tuple->port_src);
-                printf("mg-salve: port_dst is %u\n", ip_5tuple->port_dst);
-                printf("mg-salve: proto is %u\n", ip_5tuple->proto);
-                #endif
-                #ifdef __DEBUG_LV1
-                printf("\n");
-                #endif
-                ctrl_tx_pkts += 1;
-                ctrl_tx_bytes += probing_packet->data_len;
-                ecmp_ctrl_tx_bytes+= probing_packet->data_len;
-                if (rte_eth_tx_burst(port, MANAGER_SLAVE_TX_QUEUE, &probing_packet, 1) != 1) {
-                    printf("mg-slave: tx probing_packet failed!\n");
-                    rte_pktmbuf_free(probing_packet);
-                }
+                       IPv4_BYTES(ip_5tuples[k]->ip_src));
+                printf("mg-salve: port_src is %u\n", ip_5tuples[k]->port_src);
+                printf("mg-salve: port_dst is %u\n", ip_5tuples[k]->port_dst);
+                printf("mg-salve: proto is %u\n", ip_5tuples[k]->proto);
+            }
+            #endif
+            /* the probes carry the flows, the records go back at once */
+            nb_probe = build_probe_packets(ip_5tuples, probing_packets, nb_req);
+            rte_mempool_put_bulk(flow_req_pool, (void**)ip_5tuples, nb_req);
+            if (nb_probe == 0)
+                continue;
+            nb_sent = rte_eth_tx_burst(ctrl_port, MANAGER_SLAVE_TX_QUEUE,
+                                       probing_packets, nb_probe);
+            probe_bytes = 0;
+            for (k = 0; k < nb_sent; k++)
+                probe_bytes += probing_packets[k]->data_len;
+            lcore_stat_add(GW_STAT_CTRL_TX_PKTS, nb_sent);
+            lcore_stat_add(GW_STAT_CTRL_TX_BYTES, probe_bytes);
+            lcore_stat_add(GW_STAT_ECMP_CTRL_TX_BYTES, probe_bytes);
+            if (unlikely(nb_sent < nb_probe)) {
+                printf("mg-slave: tx probing_packet failed!\n");
+                for (k = nb_sent; k < nb_probe; k++)
+                    rte_pktmbuf_free(probing_packets[k]);
             }
         }
     }
@@ -16,6 +16,9 @@
 #include <rte_udp.h>
 #include <rte_hash.h>
 #include <rte_malloc.h>
+#include <rte_prefetch.h>
+#include <rte_jhash.h>
+#include <rte_random.h>
 #include <rte_debug.h>
 
 
@@ -23,26 +26,26 @@
 #include "main.h"
 
 //share variables
-struct rte_hash *state_hash_table[NB_SOCKETS];
-struct rte_hash *index_hash_table[NB_SOCKETS];
-
-uint32_t flow_counts = 0;
-uint32_t last_flow_counts = 0;
-uint32_t malicious_packet_counts = 0;
-/* Data nf received statistics */
-
-unsigned long long nf_rx_bytes[NF_CORE_COUNT];
-unsigned long long last_nf_rx_bytes[NF_CORE_COUNT];
-unsigned long long nf_rx_pkts[NF_CORE_COUNT];
-unsigned long long last_nf_rx_pkts[NF_CORE_COUNT];
-/* Data nf transmitted statistics */
-unsigned long long nf_tx_bytes[NF_CORE_COUNT];
-unsigned long long last_nf_tx_bytes[NF_CORE_COUNT];
-unsigned long long nf_tx_pkts[NF_CORE_COUNT];
-unsigned long long last_nf_tx_pkts[NF_CORE_COUNT];
-unsigned long long nf_rx[NF_CORE_COUNT];
-
-rte_rwlock_t numa_hash_lock;
+struct state_table state_tables[NB_SOCKETS];
+struct state_table state_tables6[NB_SOCKETS];
+struct rte_hash *index_hash_table6;
+struct nf_indexs *flow_indexs6;
+volatile uint32_t index_seq6;
+#ifdef INDEX_TABLE_EFD
+struct rte_efd_table *index_efd_table;
+#else
+struct rte_hash *index_hash_table;
+/* values of the index table, indexed by the position rte_hash gives a key */
+struct nf_indexs *flow_indexs;
+volatile uint32_t index_seq;
+#endif
+/*
+ * getIndexs() hands out a copy: the slot of a key is reused once the
+ * manager deletes it, and EFD has no value storage to point to.
+ */
+static RTE_DEFINE_PER_LCORE(struct nf_indexs, index_copy);
+
+struct lcore_stats lcore_stats[RTE_MAX_LCORE];
 
 void
 convert_ipv4_5tuple(struct ipv4_5tuple *key1, union ipv4_5tuple_host *key2)
@@ -57,16 +60,67 @@ convert_ipv4_5tuple(struct ipv4_5tuple *key1, union ipv4_5tuple_host *key2)
 }
 
 void
-setIndexs(struct ipv4_5tuple *ip_5tuple, struct nf_indexs *index){
+convert_ipv4_5tuple_host(const union ipv4_5tuple_host *key1, struct ipv4_5tuple *key2)
+{
+	key2->ip_dst = rte_be_to_cpu_32(key1->ip_dst);
+	key2->ip_src = rte_be_to_cpu_32(key1->ip_src);
+	key2->port_dst = rte_be_to_cpu_16(key1->port_dst);
+	key2->port_src = rte_be_to_cpu_16(key1->port_src);
+	key2->proto = key1->proto;
+}
+
+void
+convert_ipv6_5tuple(const struct ipv6_5tuple *key1, union ipv6_5tuple_host *key2)
+{
+	memcpy(key2->ip_dst, key1->ip_dst, IPV6_ADDR_LEN);
+	memcpy(key2->ip_src, key1->ip_src, IPV6_ADDR_LEN);
+	key2->port_dst = rte_cpu_to_be_16(key1->port_dst);
+	key2->port_src = rte_cpu_to_be_16(key1->port_src);
+	key2->proto = key1->proto;
+	key2->pad0 = 0;
+	key2->pad1 = 0;
+	key2->reserve = 0;
+}
+
+void
+convert_ipv6_5tuple_host(const union ipv6_5tuple_host *key1, struct ipv6_5tuple *key2)
+{
+	memcpy(key2->ip_dst, key1->ip_dst, IPV6_ADDR_LEN);
+	memcpy(key2->ip_src, key1->ip_src, IPV6_ADDR_LEN);
+	key2->port_dst = rte_be_to_cpu_16(key1->port_dst);
+	key2->port_src = rte_be_to_cpu_16(key1->port_src);
+	key2->proto = key1->proto;
+}
+
+void
+setIndexs(struct ipv4_5tuple *ip_5tuple, const struct nf_indexs *index){
 	union ipv4_5tuple_host newkey;
 	convert_ipv4_5tuple(ip_5tuple, &newkey);
-	int ret =  rte_hash_add_key_data(index_hash_table[0], &newkey, index);
-	if (ret == 0)
+#ifdef INDEX_TABLE_EFD
+	/* the manager is the only writer, as EFD requires */
+	int ret = rte_efd_update(index_efd_table, rte_socket_id(), &newkey,
+		INDEX_EFD_VALUE(machine_id(index->backupip[0]),
+				machine_id(index->backupip[1])));
+	if (ret == 0 || ret == RTE_EFD_UPDATE_WARN_GROUP_FULL ||
+		ret == RTE_EFD_UPDATE_NO_CHANGE)
+	{
+		#ifdef __DEBUG_LV2
+		printf("nf: set index success!\n");
+		#endif
+	}
+#else
+	table_write_begin(&index_seq);
+	int32_t ret =  rte_hash_add_key(index_hash_table, &newkey);
+	if (ret >= 0)
+		flow_indexs[ret] = *index;
+	table_write_end(&index_seq);
+	if (ret >= 0)
 	{
 		#ifdef __DEBUG_LV2
 		printf("nf: set index success!\n");
 		#endif
 	}
+#endif
 	else{
 		printf("nf: error found in setIndexs!\n");
 		return;
@@ -75,10 +129,31 @@ setIndexs(struct ipv4_5tuple *ip_5tuple, struct nf_indexs *index){
 
 int
 getIndexs(struct ipv4_5tuple *ip_5tuple, struct nf_indexs **index){
+	struct nf_indexs *copy = &RTE_PER_LCORE(index_copy);
 	union ipv4_5tuple_host newkey;
 	convert_ipv4_5tuple(ip_5tuple, &newkey);
-	int ret = rte_hash_lookup_data(index_hash_table[0], &newkey, (void **) index);
+#ifdef INDEX_TABLE_EFD
+	/*
+	 * An unknown flow gets arbitrary ids, only no first backup machine
+	 * reads as a miss. A wrong guess costs a pull answered without state.
+	 */
+	efd_value_t value = rte_efd_lookup(index_efd_table, rte_socket_id(),
+		&newkey);
+	copy->backupip[0] = machine_ip(INDEX_EFD_ID0(value));
+	copy->backupip[1] = machine_ip(INDEX_EFD_ID1(value));
+	int ret = copy->backupip[0] != 0 ? 0 : -ENOENT;
+#else
+	uint32_t seq;
+	int ret;
+	do {
+		seq = table_read_begin(&index_seq);
+		ret = rte_hash_lookup(index_hash_table, &newkey);
+		if (ret >= 0)
+			*copy = flow_indexs[ret];
+	} while (table_read_retry(&index_seq, seq));
+#endif
 	if (ret >= 0){
+		*index = copy;
 		#ifdef __DEBUG_LV2
 		printf("nf: get index success!\n");
 		#endif
@@ -99,61 +174,142 @@ getIndexs(struct ipv4_5tuple *ip_5tuple, struct nf_indexs **index){
 	return ret;
 }
 
-void
-setStates(struct ipv4_5tuple *ip_5tuple, struct nf_states *state, unsigned hash_table_index){
-	union ipv4_5tuple_host newkey;
-	convert_ipv4_5tuple(ip_5tuple, &newkey);
-	// rte_rwlock_write_lock(&numa_hash_lock);
-	// printf("DEBUG: Table item set in table %d.\n", hash_table_index);
-	int ret =  rte_hash_add_key_data(state_hash_table[hash_table_index], &newkey, state);
-	// printf("DEBUG: setStates done\n");
-	// rte_rwlock_write_unlock(&numa_hash_lock);
-	if (ret == 0)
+/*
+ * Insert (or update) the state of a flow in the table of a socket, the
+ * one of the nf core serving the flow. The state is copied into the
+ * table, so the caller can pass a stack variable; the returned pointer
+ * is the slot in the table, or NULL if the table is full.
+ */
+static struct nf_states *
+state_table_set(struct state_table *t, const void *key,
+	const struct nf_states *state)
+{
+	rte_spinlock_lock(&t->lock);
+	table_write_begin(&t->seq);
+	int32_t ret =  rte_hash_add_key(t->hash, key);
+	if (ret >= 0)
+		t->states[ret] = *state;
+	table_write_end(&t->seq);
+	rte_spinlock_unlock(&t->lock);
+	if (ret >= 0)
 	{
 		#ifdef __DEBUG_LV2
 		printf("nf: set state success!\n");
 		#endif
-		//communicate with Manager
-		/*
-		if (rte_ring_enqueue(nf_manager_ring, ip_5tuple) == 0) {
-			#ifdef __DEBUG_LV2
-			printf("nf: enqueue success in setStates!\n");
-			#endif
-		}
-		else{
-			printf("nf: enqueue failed in setStates!!!\n");
-		}
-		*/
+		return &t->states[ret];
 	}
 	else{
 		printf("nf: error found in setStates!\n");
-		return;
+		return NULL;
 	}
 }
 
-int
-getStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state, unsigned own_hash_table_index){
+struct nf_states *
+setStates(unsigned socket, struct ipv4_5tuple *ip_5tuple,
+	const struct nf_states *state){
 	union ipv4_5tuple_host newkey;
 	convert_ipv4_5tuple(ip_5tuple, &newkey);
-	int i;
-    int ret;
-	/* look up in its own table first */
-	ret = rte_hash_lookup_data(state_hash_table[own_hash_table_index], &newkey, (void **) state);
-    if(ret < 0){
-		/* table 0 for manager, 1~NF_CORE_COUNT for nfs */
-		for(i = NF_CORE_COUNT;i >= 0;i--){
-			if(i == own_hash_table_index)
-				continue;
-			ret = rte_hash_lookup_data(state_hash_table[i], &newkey, (void **) state);
-			if(ret >= 0)
-				break;
-		}
+	return state_table_set(&state_tables[socket], &newkey, state);
+}
+
+/* setStates() for an IPv6 flow, in the IPv6 table of socket */
+struct nf_states *
+setStates6(unsigned socket, const struct ipv6_5tuple *ip_5tuple,
+	const struct nf_states *state){
+	union ipv6_5tuple_host newkey;
+	convert_ipv6_5tuple(ip_5tuple, &newkey);
+	return state_table_set(&state_tables6[socket], &newkey, state);
+}
+
+/*
+ * setStates() for a batch of flows, such as migrated ones: the keys are
+ * hashed before the writer lock is taken once for the whole batch. Returns
+ * the number of states stored, the others did not fit in the table.
+ */
+unsigned
+setStatesBulk(unsigned socket, struct ipv4_5tuple **ip_5tuples,
+	const struct nf_states *states, unsigned nb)
+{
+	struct state_table *t = &state_tables[socket];
+	union ipv4_5tuple_host newkeys[BURST_SIZE];
+	hash_sig_t sigs[BURST_SIZE];
+	unsigned k, nb_set = 0;
+	int32_t ret;
+
+	if (nb > BURST_SIZE)
+		nb = BURST_SIZE;
+	for (k = 0; k < nb; k++) {
+		convert_ipv4_5tuple(ip_5tuples[k], &newkeys[k]);
+		sigs[k] = rte_hash_hash(t->hash, &newkeys[k]);
+	}
+	rte_spinlock_lock(&t->lock);
+	table_write_begin(&t->seq);
+	for (k = 0; k < nb; k++) {
+		ret = rte_hash_add_key_with_hash(t->hash, &newkeys[k], sigs[k]);
+		if (ret < 0)
+			continue;
+		t->states[ret] = states[k];
+		nb_set++;
 	}
-	// int ret = rte_hash_lookup_data(state_hash_table[1], &newkey, (void **) state);
-	// if (ret < 0){
-	// 	ret = rte_hash_lookup_data(state_hash_table[0], &newkey, (void **) state);
-	// }
-	// // printf("ret, EINVAL, ENOENT is %d, %u and %u\n", ret, EINVAL, ENOENT);
+	table_write_end(&t->seq);
+	rte_spinlock_unlock(&t->lock);
+	return nb_set;
+}
+
+/*
+ * The returned pointer is the slot of the flow in the table. Only the
+ * manager deletes, from aging and teardowns of flows that went idle, so
+ * the slot is not reused while the nf core serving the flow uses it.
+ */
+static inline int
+state_table_lookup(const struct state_table *t,
+	const void *key, struct nf_states **state)
+{
+	uint32_t seq;
+	int ret;
+	if (t->hash == NULL)
+		return -ENOENT;
+	do {
+		seq = table_read_begin(&t->seq);
+		ret = rte_hash_lookup(t->hash, key);
+	} while (table_read_retry(&t->seq, seq));
+	if (ret >= 0)
+		*state = &t->states[ret];
+	return ret;
+}
+
+static inline int
+remote_state_lookup(const struct state_table *tables, const void *key,
+	struct nf_states **state, unsigned local)
+{
+	unsigned socket;
+	int ret = -ENOENT;
+	for (socket = 0; ret == -ENOENT && socket < NB_SOCKETS; socket++) {
+		if (socket != local)
+			ret = state_table_lookup(&tables[socket], key, state);
+	}
+	return ret;
+}
+
+/*
+ * Look a flow up in the table of the caller's socket first, then in the
+ * tables of the other sockets (backups received by the manager, flows
+ * moved to another nf core).
+ */
+int
+lookupStates(const union ipv4_5tuple_host *key, struct nf_states **state){
+	const unsigned local = rte_socket_id();
+	int ret = state_table_lookup(&state_tables[local], key, state);
+	if (ret == -ENOENT)
+		ret = remote_state_lookup(state_tables, key, state, local);
+	return ret;
+}
+
+int
+getStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state){
+	union ipv4_5tuple_host newkey;
+	convert_ipv4_5tuple(ip_5tuple, &newkey);
+	int ret = lookupStates(&newkey, state);
 	if (ret >= 0){
 		#ifdef __DEBUG_LV2
 		printf("nf: get state success!\n");
@@ -168,23 +324,6 @@ getStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state, unsigned own
 		#ifdef __DEBUG_LV1
 		printf("nf: key not found in getStates!\n");
 		#endif
-		//ask index table
-		struct nf_indexs *index;
-	/*
-		index = rte_malloc(NULL,sizeof(struct nf_indexs),0);
-		index->backupip[0] = topo[1].ip;
-		ret = 1;
-		*/
-		ret =  getIndexs(ip_5tuple, &index);
-		if (ret >= 0){
-			//getRemoteState(index, state);
-			ret = pullState(1, 0, ip_5tuple, index, state);
-		}
-		else{
-			#ifdef __DEBUG_LV1
-			printf("nf: this is an attack!\n");
-			#endif
-		}
 	}
 	else{
 		printf("nf: get state error!\n");
@@ -192,6 +331,666 @@ getStates(struct ipv4_5tuple *ip_5tuple, struct nf_states ** state, unsigned own
 	return ret;
 }
 
+/* lookupStates() of an IPv6 flow, local socket first */
+int
+getStates6(const struct ipv6_5tuple *ip_5tuple, struct nf_states **state){
+	const unsigned local = rte_socket_id();
+	union ipv6_5tuple_host newkey;
+	convert_ipv6_5tuple(ip_5tuple, &newkey);
+	int ret = state_table_lookup(&state_tables6[local], &newkey, state);
+	if (ret == -ENOENT)
+		ret = remote_state_lookup(state_tables6, &newkey, state, local);
+	return ret;
+}
+
+/*
+ * Remove a flow from the state tables of all sockets. Only the manager
+ * deletes, but nf cores may add at the same time, hence the writer lock.
+ */
+static int
+state_tables_del(struct state_table *tables, const void *key){
+	struct state_table *t;
+	unsigned socket;
+	int32_t pos, ret = -ENOENT;
+	for (socket = 0; socket < NB_SOCKETS; socket++) {
+		t = &tables[socket];
+		if (t->hash == NULL)
+			continue;
+		rte_spinlock_lock(&t->lock);
+		table_write_begin(&t->seq);
+		pos = rte_hash_del_key(t->hash, key);
+		/* the aging sweep walks the slots, let it skip this one */
+		if (pos >= 0)
+			t->states[pos].ipserver = 0;
+		table_write_end(&t->seq);
+		rte_spinlock_unlock(&t->lock);
+		if (pos >= 0)
+			ret = pos;
+	}
+	if (ret < 0){
+		#ifdef __DEBUG_LV1
+		printf("nf: key not found in delStates!\n");
+		#endif
+	}
+	return ret;
+}
+
+int
+delStates(const union ipv4_5tuple_host *key){
+	return state_tables_del(state_tables, key);
+}
+
+int
+delStates6(const union ipv6_5tuple_host *key){
+	return state_tables_del(state_tables6, key);
+}
+
+/* Remove a flow from the index table, the manager is its only writer */
+int
+delIndexs(const union ipv4_5tuple_host *key){
+#ifdef INDEX_TABLE_EFD
+	/* keys that were never set are not known to EFD either */
+	int32_t ret = rte_efd_delete(index_efd_table, rte_socket_id(), key,
+		NULL) == 0 ? 0 : -ENOENT;
+	if (ret < 0){
+#else
+	table_write_begin(&index_seq);
+	int32_t ret = rte_hash_del_key(index_hash_table, key);
+	table_write_end(&index_seq);
+	if (ret < 0){
+#endif
+		#ifdef __DEBUG_LV1
+		printf("nf: key not found in delIndexs!\n");
+		#endif
+	}
+	return ret;
+}
+
+/*
+ * Resolve the states of a whole burst of keys with one bulk lookup in
+ * the state table of the local socket (buckets of all keys are
+ * prefetched together by rte_hash), the few misses are looked up in the
+ * other sockets. Returns a bitmask of the keys whose state was found;
+ * the caller sends the misses to the remote pull path. Keys found in
+ * another socket are also set in remote_mask, if not NULL.
+ */
+static uint64_t
+state_tables_lookup_bulk(const struct state_table *tables,
+	const void **key_ptrs, uint32_t nb_keys, struct nf_states **states,
+	uint64_t *remote_mask)
+{
+	const unsigned local = rte_socket_id();
+	const struct state_table *t = &tables[local];
+	int32_t positions[RTE_HASH_LOOKUP_BULK_MAX];
+	uint64_t hit_mask = 0, remote = 0;
+	uint32_t i, seq;
+	int ret;
+
+	if (remote_mask != NULL)
+		*remote_mask = 0;
+	if (nb_keys == 0)
+		return 0;
+
+	/* retried as a whole if a writer changed the table under it */
+	do {
+		seq = table_read_begin(&t->seq);
+		ret = rte_hash_lookup_bulk(t->hash, key_ptrs, nb_keys,
+			positions);
+	} while (table_read_retry(&t->seq, seq));
+	if (ret < 0){
+		printf("nf: get state error!\n");
+		return 0;
+	}
+	for (i = 0; i < nb_keys; i++) {
+		if (positions[i] < 0) {
+			if (remote_state_lookup(tables, key_ptrs[i], &states[i],
+					local) >= 0)
+				remote |= 1ULL << i;
+			continue;
+		}
+		states[i] = &t->states[positions[i]];
+		/* read by the caller right after, and by the nf chain */
+		rte_prefetch0(states[i]);
+		hit_mask |= 1ULL << i;
+	}
+	if (remote_mask != NULL)
+		*remote_mask = remote;
+	return hit_mask | remote;
+}
+
+uint64_t
+getStatesBulk(union ipv4_5tuple_host *keys, uint32_t nb_keys,
+	struct nf_states **states, uint64_t *remote_mask)
+{
+	const void *key_ptrs[RTE_HASH_LOOKUP_BULK_MAX];
+	uint32_t i;
+
+	for (i = 0; i < nb_keys; i++)
+		key_ptrs[i] = &keys[i];
+	return state_tables_lookup_bulk(state_tables, key_ptrs, nb_keys, states,
+		remote_mask);
+}
+
+/* getStatesBulk() in the IPv6 state tables */
+uint64_t
+getStatesBulk6(union ipv6_5tuple_host *keys, uint32_t nb_keys,
+	struct nf_states **states, uint64_t *remote_mask)
+{
+	const void *key_ptrs[RTE_HASH_LOOKUP_BULK_MAX];
+	uint32_t i;
+
+	for (i = 0; i < nb_keys; i++)
+		key_ptrs[i] = &keys[i];
+	return state_tables_lookup_bulk(state_tables6, key_ptrs, nb_keys, states,
+		remote_mask);
+}
+
+/*
+ * Index table of the IPv6 flows, an rte_hash in both builds. Same rules
+ * as the IPv4 one: the manager is its only writer, lookups copy the
+ * index out under index_seq6.
+ */
+void
+setIndexs6(const struct ipv6_5tuple *ip_5tuple, const struct nf_indexs *index){
+	union ipv6_5tuple_host newkey;
+	convert_ipv6_5tuple(ip_5tuple, &newkey);
+	table_write_begin(&index_seq6);
+	int32_t ret = rte_hash_add_key(index_hash_table6, &newkey);
+	if (ret >= 0)
+		flow_indexs6[ret] = *index;
+	table_write_end(&index_seq6);
+	if (ret < 0)
+		printf("nf: error found in setIndexs6!\n");
+}
+
+int
+getIndexs6(const struct ipv6_5tuple *ip_5tuple, struct nf_indexs **index){
+	struct nf_indexs *copy = &RTE_PER_LCORE(index_copy);
+	union ipv6_5tuple_host newkey;
+	uint32_t seq;
+	int ret;
+	convert_ipv6_5tuple(ip_5tuple, &newkey);
+	do {
+		seq = table_read_begin(&index_seq6);
+		ret = rte_hash_lookup(index_hash_table6, &newkey);
+		if (ret >= 0)
+			*copy = flow_indexs6[ret];
+	} while (table_read_retry(&index_seq6, seq));
+	if (ret >= 0)
+		*index = copy;
+	return ret;
+}
+
+int
+delIndexs6(const union ipv6_5tuple_host *key){
+	table_write_begin(&index_seq6);
+	int32_t ret = rte_hash_del_key(index_hash_table6, key);
+	table_write_end(&index_seq6);
+	return ret;
+}
+
+/*
+ * Flows whose state is being pulled from a backup machine. Their packets
+ * are parked here while the core keeps forwarding other traffic, and are
+ * released together when the reply (or the timeout) comes.
+ */
+struct pull_pending {
+	union {
+		struct ipv4_5tuple l4_5tuple;
+		struct ipv6_5tuple l6_5tuple; /* if ipv6 */
+	};
+	uint8_t ipv6;
+	uint64_t start_tsc;
+	uint8_t port;
+	uint16_t nb_pkts; /* 0 means the slot is free */
+	struct rte_mbuf *pkts[PULL_PENDING_PKTS];
+};
+
+struct pull_pending_table {
+	uint16_t nb_used;
+	uint64_t last_expire_tsc;
+	struct pull_pending flows[PULL_PENDING_FLOWS];
+};
+
+/* allocated by each nf core on its own socket */
+static struct pull_pending_table *pull_pendings[NF_CORE_MAX];
+
+static inline int
+ipv4_5tuple_equal(const struct ipv4_5tuple *a, const struct ipv4_5tuple *b)
+{
+	return a->ip_src == b->ip_src && a->ip_dst == b->ip_dst &&
+		a->port_src == b->port_src && a->port_dst == b->port_dst &&
+		a->proto == b->proto;
+}
+
+static inline int
+ipv6_5tuple_equal(const struct ipv6_5tuple *a, const struct ipv6_5tuple *b)
+{
+	return memcmp(a->ip_src, b->ip_src, IPV6_ADDR_LEN) == 0 &&
+		memcmp(a->ip_dst, b->ip_dst, IPV6_ADDR_LEN) == 0 &&
+		a->port_src == b->port_src && a->port_dst == b->port_dst &&
+		a->proto == b->proto;
+}
+
+/* Whether the parked flow p is the flow of key, an ipv6_5tuple if ipv6 */
+static inline int
+nf_pull_match(const struct pull_pending *p, int ipv6, const void *key)
+{
+	if (p->ipv6 != ipv6)
+		return 0;
+	return ipv6 ? ipv6_5tuple_equal(&p->l6_5tuple, key) :
+		ipv4_5tuple_equal(&p->l4_5tuple, key);
+}
+
+/*
+ * Park a packet whose state missed locally, ip_5tuple is an ipv6_5tuple
+ * if ipv6. The first packet of a flow looks up the index table and sends
+ * the pull request, later ones only join the queue. Returns <0 if the
+ * packet has to be dropped.
+ */
+static int
+nf_pull_park(const struct nf_inst_info *nf_info, uint8_t port, int ipv6,
+	const void *ip_5tuple, struct rte_mbuf *m)
+{
+	struct pull_pending_table *t = pull_pendings[nf_info->nf_id];
+	struct pull_pending *free_slot = NULL;
+	struct pull_pending *p;
+	struct nf_indexs *index;
+	int k;
+
+	for (k = 0; k < PULL_PENDING_FLOWS; k++) {
+		p = &t->flows[k];
+		if (p->nb_pkts == 0) {
+			if (free_slot == NULL)
+				free_slot = p;
+			if (t->nb_used == 0)
+				break;
+			continue;
+		}
+		if (nf_pull_match(p, ipv6, ip_5tuple)) {
+			if (p->nb_pkts == PULL_PENDING_PKTS)
+				return -ENOSPC;
+			p->pkts[p->nb_pkts++] = m;
+			return 0;
+		}
+	}
+	if (free_slot == NULL) {
+		#ifdef __DEBUG_LV1
+		printf("nf: too many pending pulls!\n");
+		#endif
+		return -ENOSPC;
+	}
+
+	//ask index table
+	if ((ipv6 ? getIndexs6(ip_5tuple, &index) :
+			getIndexs((struct ipv4_5tuple *)ip_5tuple, &index)) < 0) {
+		#ifdef __DEBUG_LV1
+		printf("nf: this is an attack!\n");
+		#endif
+		return -ENOENT;
+	}
+	if ((ipv6 ? pullState6(nf_info->nf_id, port, nf_info->tx_queue_id,
+			ip_5tuple, index) :
+			pullState(nf_info->nf_id, port, nf_info->tx_queue_id,
+			(struct ipv4_5tuple *)ip_5tuple, index)) < 0)
+		return -EIO;
+	lcore_stat_add(GW_STAT_STATE_PULLS, 1);
+
+	free_slot->ipv6 = ipv6;
+	if (ipv6)
+		free_slot->l6_5tuple = *(const struct ipv6_5tuple *)ip_5tuple;
+	else
+		free_slot->l4_5tuple = *(const struct ipv4_5tuple *)ip_5tuple;
+	free_slot->start_tsc = rte_rdtsc();
+	free_slot->port = port;
+	free_slot->pkts[0] = m;
+	free_slot->nb_pkts = 1;
+	t->nb_used++;
+	return 0;
+}
+
+/*
+ * Packets waiting for tx on a port. The latency tags of the packets are
+ * kept beside them: the driver may free an mbuf as soon as it takes it,
+ * and only the packets it took are counted, when it takes them.
+ */
+struct nf_tx_buffer {
+	uint16_t length;
+	struct rte_mbuf *pkts[NF_TX_BUFFER_SIZE];
+	uint64_t lat_path[NF_TX_BUFFER_SIZE];
+	uint64_t lat_rx_tsc[NF_TX_BUFFER_SIZE];
+};
+
+/* tx buffers of each nf core by port, allocated on its own socket */
+static struct nf_tx_buffer *nf_tx_buffers[NF_CORE_MAX][RTE_MAX_ETHPORTS];
+
+/*
+ * The packets the driver did not take are dropped, and taken out of the
+ * tx counters of the nf core
+ */
+static void
+nf_tx_drop(struct rte_mbuf **unsent, uint16_t count)
+{
+	uint64_t *stats = lcore_stats[rte_lcore_id()].c;
+	uint16_t k;
+
+	stats[GW_STAT_NF_TX_PKTS] -= count;
+	stats[GW_STAT_NF_DROPPED_PKTS] += count;
+	for (k = 0; k < count; k++) {
+		stats[GW_STAT_NF_TX_BYTES] -= unsent[k]->data_len;
+		rte_pktmbuf_free(unsent[k]);
+	}
+}
+
+/* Hand the packets of a tx buffer to the driver */
+static void
+nf_tx_flush_port(const struct nf_inst_info *nf_info, uint8_t port,
+	struct nf_tx_buffer *buffer)
+{
+	const uint16_t nb_pkts = buffer->length;
+	uint16_t nb_sent;
+
+	if (nb_pkts == 0)
+		return;
+	nb_sent = rte_eth_tx_burst(port, nf_info->tx_queue_id, buffer->pkts,
+			nb_pkts);
+	buffer->length = 0;
+	if (latency_enabled)
+		latency_record_tx(buffer->lat_path, buffer->lat_rx_tsc, nb_sent);
+	if (unlikely(nb_sent < nb_pkts))
+		nf_tx_drop(&buffer->pkts[nb_sent], nb_pkts - nb_sent);
+}
+
+/*
+ * Queue the packets for tx. Only the packets that survived the burst get
+ * here, the tx buffer owns them from now on.
+ */
+static inline void
+nf_tx_send(const struct nf_inst_info *nf_info, uint8_t port,
+	struct rte_mbuf **pkts, uint16_t nb_pkts, uint64_t bytes)
+{
+	struct nf_tx_buffer *buffer = nf_tx_buffers[nf_info->nf_id][port];
+	uint64_t *stats = lcore_stats[rte_lcore_id()].c;
+	uint16_t k;
+
+	/* counted first, a flush may uncount drops */
+	stats[GW_STAT_NF_TX_PKTS] += nb_pkts;
+	stats[GW_STAT_NF_TX_BYTES] += bytes;
+	for (k = 0; k < nb_pkts; k++) {
+		if (latency_enabled) {
+			buffer->lat_path[buffer->length] = pkts[k]->udata64;
+			buffer->lat_rx_tsc[buffer->length] = pkts[k]->timestamp;
+		}
+		buffer->pkts[buffer->length++] = pkts[k];
+		if (buffer->length == NF_TX_BUFFER_SIZE)
+			nf_tx_flush_port(nf_info, port, buffer);
+	}
+}
+
+/* Send what waits in the tx buffers of the nf core */
+static void
+nf_tx_flush(const struct nf_inst_info *nf_info)
+{
+	const uint8_t nb_ports = rte_eth_dev_count();
+	uint8_t port;
+
+	for (port = 0; port < nb_ports; port++)
+		if (nf_tx_buffers[nf_info->nf_id][port] != NULL)
+			nf_tx_flush_port(nf_info, port,
+					nf_tx_buffers[nf_info->nf_id][port]);
+}
+
+static void
+nf_tx_setup(const struct nf_inst_info *nf_info)
+{
+	const uint8_t nb_ports = rte_eth_dev_count();
+	struct nf_tx_buffer *buffer;
+	uint8_t port;
+
+	for (port = 0; port < nb_ports; port++) {
+		if ((enabled_port_mask & (1 << port)) == 0)
+			continue;
+		buffer = rte_zmalloc_socket("nf_tx_buffer", sizeof(*buffer),
+				RTE_CACHE_LINE_SIZE, rte_socket_id());
+		if (buffer == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot allocate tx buffer of nf %u\n",
+					nf_info->nf_id);
+		nf_tx_buffers[nf_info->nf_id][port] = buffer;
+	}
+}
+
+/* Forward (state found) or drop (state NULL) the packets of a parked flow */
+static void
+nf_pull_release(const struct nf_inst_info *nf_info, struct pull_pending *p,
+	struct nf_states *state)
+{
+	uint64_t *stats = lcore_stats[rte_lcore_id()].c;
+	struct nf_burst burst;
+	struct rte_mbuf *tx_bufs[PULL_PENDING_PKTS];
+	uint64_t tx_bytes = 0;
+	uint16_t k, nb_tx;
+
+	if (state != NULL) {
+		burst.port = p->port;
+		burst.nb_pkts = p->nb_pkts;
+		burst.drop_mask = 0;
+		for (k = 0; k < p->nb_pkts; k++) {
+			struct ether_hdr *eth_hdr;
+			eth_hdr = rte_pktmbuf_mtod(p->pkts[k], struct ether_hdr *);
+			burst.pkts[k] = p->pkts[k];
+			if (p->ipv6) {
+				burst.ip6_hdrs[k] = (struct ipv6_hdr *)(eth_hdr + 1);
+				burst.tcp_hdrs[k] = (struct tcp_hdr *)(burst.ip6_hdrs[k] + 1);
+				burst.keys6[k] = &p->l6_5tuple;
+			}
+			else {
+				burst.ip_hdrs[k] = (struct ipv4_hdr *)(eth_hdr + 1);
+				burst.tcp_hdrs[k] = (struct tcp_hdr *)(burst.ip_hdrs[k] + 1);
+				burst.keys[k] = &p->l4_5tuple;
+			}
+			burst.states[k] = state;
+			if (latency_enabled)
+				p->pkts[k]->udata64 = GW_LAT_PULL;
+		}
+		nb_tx = p->ipv6 ? nf_chain_run6(&burst, tx_bufs, &tx_bytes) :
+			nf_chain_run(&burst, tx_bufs, &tx_bytes);
+		nf_tx_send(nf_info, p->port, tx_bufs, nb_tx, tx_bytes);
+	}
+	else {
+		stats[GW_STAT_MALICIOUS_PKTS] += p->nb_pkts;
+		for (k = 0; k < p->nb_pkts; k++)
+			rte_pktmbuf_free(p->pkts[k]);
+	}
+	p->nb_pkts = 0;
+	pull_pendings[nf_info->nf_id]->nb_used--;
+}
+
+/*
+ * SYN cookies. The gateway only sees the client side of a flow and cannot
+ * answer for the server's sequence numbers, so a challenged SYN gets a
+ * SYN-ACK whose ack is the cookie instead of the ISN + 1. The client
+ * stack refuses it with an RST whose seq is that ack (RFC 793, SYN-SENT)
+ * and sends its SYN again after its retransmission timeout; the cookie
+ * in the RST marks the flow verified and the new SYN opens it. Spoofed
+ * SYNs never cost a state, a backup or a keyset.
+ */
+struct syn_guard {
+	uint32_t secret;
+	/* tsc the new flow rate still allows to spend */
+	uint64_t credit;
+	uint64_t last_tsc;
+	/* flows whose cookie came back, by signature, and when */
+	uint32_t verified_sig[SYN_VERIFIED_SLOTS];
+	uint32_t verified_time[SYN_VERIFIED_SLOTS];
+};
+
+/* allocated by each nf core with --syn-cookies, RSS keeps a flow on one */
+static struct syn_guard *syn_guards[NF_CORE_MAX];
+
+static inline uint32_t
+nf_syn_sig(const struct syn_guard *g, const struct ipv4_5tuple *key)
+{
+	return rte_jhash_3words(key->ip_src, key->ip_dst,
+			((uint32_t)key->port_src << 16) | key->port_dst, g->secret);
+}
+
+static inline uint32_t
+nf_syn_cookie(const struct syn_guard *g, uint32_t sig, uint64_t tsc)
+{
+	return rte_jhash_2words(sig, (uint32_t)(tsc >> SYN_COOKIE_SLOT_SHIFT),
+			g->secret);
+}
+
+/* Turn the SYN in m into the SYN-ACK that carries the cookie */
+static void
+nf_syn_cookie_reply(struct rte_mbuf *m, struct ipv4_hdr *ip_hdr,
+	struct tcp_hdr *tcp_h, uint32_t cookie)
+{
+	struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(m, struct ether_hdr *);
+	struct ether_addr eth_addr;
+	uint32_t addr;
+	uint16_t port;
+
+	ether_addr_copy(&eth_hdr->s_addr, &eth_addr);
+	ether_addr_copy(&eth_hdr->d_addr, &eth_hdr->s_addr);
+	ether_addr_copy(&eth_addr, &eth_hdr->d_addr);
+
+	addr = ip_hdr->src_addr;
+	ip_hdr->src_addr = ip_hdr->dst_addr;
+	ip_hdr->dst_addr = addr;
+	ip_hdr->total_length = rte_cpu_to_be_16(sizeof(struct ipv4_hdr) +
+			sizeof(struct tcp_hdr));
+	ip_hdr->packet_id = 0;
+	ip_hdr->fragment_offset = 0;
+	ip_hdr->time_to_live = 64;
+	ip_hdr->hdr_checksum = 0;
+	ip_hdr->hdr_checksum = rte_ipv4_cksum(ip_hdr);
+
+	/* no options, the client never reaches a connection with us */
+	port = tcp_h->src_port;
+	tcp_h->src_port = tcp_h->dst_port;
+	tcp_h->dst_port = port;
+	tcp_h->sent_seq = rte_cpu_to_be_32(cookie);
+	tcp_h->recv_ack = rte_cpu_to_be_32(cookie);
+	tcp_h->data_off = (sizeof(struct tcp_hdr) / 4) << 4;
+	tcp_h->tcp_flags = TCP_FLAG_SYN | TCP_FLAG_ACK;
+	tcp_h->tcp_urp = 0;
+	tcp_h->cksum = 0;
+	tcp_h->cksum = rte_ipv4_udptcp_cksum(ip_hdr, tcp_h);
+
+	m->data_len = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) +
+			sizeof(struct tcp_hdr);
+	m->pkt_len = m->data_len;
+}
+
+/*
+ * A SYN without a state: returns 0 if it may open its flow (verified by
+ * its cookie, or within the new flow rate), 1 if m was turned into a
+ * cookie challenge to send back instead.
+ */
+static int
+nf_syn_challenge(const struct nf_inst_info *nf_info,
+	const struct ipv4_5tuple *key, struct rte_mbuf *m,
+	struct ipv4_hdr *ip_hdr, struct tcp_hdr *tcp_h, uint32_t now)
+{
+	struct syn_guard *g = syn_guards[nf_info->nf_id];
+	const uint32_t sig = nf_syn_sig(g, key);
+	const uint32_t slot = sig % SYN_VERIFIED_SLOTS;
+	const uint64_t cur_tsc = rte_rdtsc();
+	uint64_t cost;
+
+	if (g->verified_sig[slot] == sig &&
+	    now - g->verified_time[slot] < SYN_VERIFIED_TIMEOUT) {
+		g->verified_time[slot] = now - SYN_VERIFIED_TIMEOUT;
+		return 0;
+	}
+	if (syn_cookie_rate != 0) {
+		cost = rte_get_tsc_hz() / syn_cookie_rate;
+		g->credit += cur_tsc - g->last_tsc;
+		g->last_tsc = cur_tsc;
+		/* an idle core does not save up more than a second of flows */
+		if (g->credit > rte_get_tsc_hz())
+			g->credit = rte_get_tsc_hz();
+		if (g->credit >= cost) {
+			g->credit -= cost;
+			return 0;
+		}
+	}
+	nf_syn_cookie_reply(m, ip_hdr, tcp_h, nf_syn_cookie(g, sig, cur_tsc));
+	lcore_stat_add(GW_STAT_SYN_COOKIES, 1);
+	return 1;
+}
+
+/*
+ * An RST without a state: returns 0 if it carries the cookie of its flow,
+ * which may then open, <0 if it is for the pull path.
+ */
+static int
+nf_syn_verify(const struct nf_inst_info *nf_info,
+	const struct ipv4_5tuple *key, const struct tcp_hdr *tcp_h,
+	uint32_t now)
+{
+	struct syn_guard *g = syn_guards[nf_info->nf_id];
+	const uint32_t sig = nf_syn_sig(g, key);
+	const uint32_t slot = sig % SYN_VERIFIED_SLOTS;
+	const uint32_t seq = rte_be_to_cpu_32(tcp_h->sent_seq);
+	const uint64_t cur_tsc = rte_rdtsc();
+
+	if (seq != nf_syn_cookie(g, sig, cur_tsc) &&
+	    seq != nf_syn_cookie(g, sig,
+			cur_tsc - (1ULL << SYN_COOKIE_SLOT_SHIFT)))
+		return -1;
+	g->verified_sig[slot] = sig;
+	g->verified_time[slot] = now;
+	lcore_stat_add(GW_STAT_SYN_VERIFIED, 1);
+	return 0;
+}
+
+/*
+ * Apply the pull replies handed over by the manager and expire the pulls
+ * that have not been answered in time.
+ */
+static void
+nf_pull_poll(const struct nf_inst_info *nf_info)
+{
+	struct pull_pending_table *t = pull_pendings[nf_info->nf_id];
+	struct pull_reply *replies[BURST_SIZE];
+	unsigned nb_replies, r;
+	uint64_t cur_tsc;
+	int k;
+
+	nb_replies = rte_ring_dequeue_burst(nf_pull_wait_ring[nf_info->nf_id],
+			(void **)replies, BURST_SIZE, NULL);
+	if (nb_replies == 0 && t->nb_used == 0)
+		return;
+	for (r = 0; r < nb_replies; r++) {
+		for (k = 0; k < PULL_PENDING_FLOWS && t->nb_used > 0; k++) {
+			struct pull_pending *p = &t->flows[k];
+			if (p->nb_pkts != 0 && nf_pull_match(p, replies[r]->ipv6,
+					&replies[r]->l4_5tuple)) {
+				nf_pull_release(nf_info, p, replies[r]->states);
+				break;
+			}
+		}
+	}
+	if (nb_replies > 0)
+		rte_mempool_put_bulk(pull_reply_pool, (void **)replies, nb_replies);
+
+	if (t->nb_used == 0)
+		return;
+	cur_tsc = rte_rdtsc();
+	if (cur_tsc - t->last_expire_tsc < PULL_TIMEOUT_CYCLES / 8)
+		return;
+	t->last_expire_tsc = cur_tsc;
+	for (k = 0; k < PULL_PENDING_FLOWS; k++) {
+		struct pull_pending *p = &t->flows[k];
+		if (p->nb_pkts != 0 && cur_tsc - p->start_tsc >= PULL_TIMEOUT_CYCLES) {
+			printf("nf: timeout in pullState\n");
+			nf_pull_release(nf_info, p, NULL);
+		}
+	}
+}
+
 
 static void
 print_ethaddr(const char *name, struct ether_addr *eth_addr)
@@ -227,7 +1026,8 @@ nf_arp_process(uint8_t port, struct ether_hdr *eth_hdr,
 	ip_addr = arp_h->arp_data.arp_sip;
 	arp_h->arp_data.arp_sip = arp_h->arp_data.arp_tip;
 	arp_h->arp_data.arp_tip = ip_addr;
-	rte_eth_tx_burst(port, tx_queue_id, bufs_i, 1);
+	if (rte_eth_tx_burst(port, tx_queue_id, bufs_i, 1) != 1)
+		rte_pktmbuf_free(*bufs_i);
 	#ifdef __DEBUG_LV1
 	printf("This is arp request message\n");
 	printf("\n");
@@ -236,6 +1036,217 @@ nf_arp_process(uint8_t port, struct ether_hdr *eth_hdr,
 }
 
 
+/*
+ * Hash of a flow for the load balancer, the RSS hash when the NIC gave
+ * one. Every gateway machine hashes a flow the same way.
+ */
+static inline uint32_t
+nf_flow_hash(const struct rte_mbuf *m, const struct ipv4_5tuple *key)
+{
+	if (m->ol_flags & PKT_RX_RSS_HASH)
+		return m->hash.rss;
+	uint32_t hash = rte_hash_crc_4byte(key->proto, 0);
+
+	hash = rte_hash_crc_4byte(key->ip_src, hash);
+	hash = rte_hash_crc_4byte(key->ip_dst, hash);
+	return rte_hash_crc_4byte(((uint32_t)key->port_src << 16) |
+			key->port_dst, hash);
+}
+
+/* nf_flow_hash() of an IPv6 flow */
+static inline uint32_t
+nf_flow_hash6(const struct rte_mbuf *m, const struct ipv6_5tuple *key)
+{
+	if (m->ol_flags & PKT_RX_RSS_HASH)
+		return m->hash.rss;
+	uint32_t hash = rte_hash_crc_4byte(key->proto, 0);
+
+	hash = rte_hash_crc(key->ip_src, IPV6_ADDR_LEN, hash);
+	hash = rte_hash_crc(key->ip_dst, IPV6_ADDR_LEN, hash);
+	return rte_hash_crc_4byte(((uint32_t)key->port_src << 16) |
+			key->port_dst, hash);
+}
+
+/*
+ * Ask the manager to back up the flows a burst opened: the tuples (of
+ * tuple_size bytes) are copied into records of flow_req_pool and
+ * enqueued together to ring.
+ */
+static void
+nf_request_backups(struct rte_ring *ring, const void *ip_5tuples,
+	size_t tuple_size, const uint16_t *new_flows, uint16_t nb_new)
+{
+	void *reqs[BURST_SIZE];
+	unsigned nb_enq;
+	uint16_t k;
+
+	if (nb_new == 0)
+		return;
+	if (rte_mempool_get_bulk(flow_req_pool, (void **)reqs, nb_new) < 0) {
+		printf("nf: no record for backup requests!\n");
+		return;
+	}
+	for (k = 0; k < nb_new; k++)
+		memcpy(reqs[k], (const uint8_t *)ip_5tuples +
+				new_flows[k] * tuple_size, tuple_size);
+	nb_enq = rte_ring_enqueue_burst(ring, reqs, nb_new, NULL);
+	if (unlikely(nb_enq < nb_new)) {
+		printf("nf: enqueue failed for %u backup requests!\n",
+				nb_new - nb_enq);
+		rte_mempool_put_bulk(flow_req_pool, &reqs[nb_enq],
+				nb_new - nb_enq);
+	}
+}
+
+/* Hand the control messages of a burst over to the manager */
+static void
+nf_pass_ctrl(const struct nf_inst_info *nf_info, struct rte_mbuf **ctrl_bufs,
+	uint16_t nb_ctrl)
+{
+	unsigned nb_enq;
+
+	nb_enq = rte_ring_enqueue_burst(nf_ctrl_ring[nf_info->nf_id],
+			(void **)ctrl_bufs, nb_ctrl, NULL);
+	if (unlikely(nb_enq < nb_ctrl)) {
+		printf("nf: enqueue failed for %u control messages!\n",
+				nb_ctrl - nb_enq);
+		for (; nb_enq < nb_ctrl; nb_enq++)
+			rte_pktmbuf_free(ctrl_bufs[nb_enq]);
+	}
+}
+
+/*
+ * The IPv6 packets of a burst. TCP flows are tracked in the IPv6 state
+ * tables: opened by their SYN, backed up, pulled and aged like IPv4
+ * ones, and go through the stages of the chain with IPv6 hooks. A packet
+ * whose flow misses is parked until its state is pulled. Other IPv6
+ * packets pass unchanged. Returns the number of packets added to
+ * tx_pkts.
+ */
+static uint16_t
+nf_ipv6_burst(const struct nf_inst_info *nf_info, uint8_t port,
+	struct rte_mbuf **pkts, uint16_t nb_pkts, uint32_t now,
+	struct rte_mbuf **tx_pkts, uint64_t *tx_bytes)
+{
+	uint64_t *stats = lcore_stats[rte_lcore_id()].c;
+	struct ipv6_hdr *ip6_hdrs[BURST_SIZE];
+	struct tcp_hdr *tcp_hdrs[BURST_SIZE];
+	struct ipv6_5tuple ip_5tuples[BURST_SIZE];
+	union ipv6_5tuple_host lookup_keys[BURST_SIZE];
+	struct nf_states *lookup_states[BURST_SIZE];
+	/* states of the flows the burst opens, until setStates6 copies them */
+	struct nf_states new_states[BURST_SIZE];
+	struct nf_states *state;
+	struct ether_hdr *eth_hdr;
+	struct nf_burst burst;
+	uint16_t new_flows[BURST_SIZE];
+	uint16_t nb_new = 0, nb_tx = 0;
+	uint32_t nb_lookup = 0, j = 0;
+	uint64_t hit_mask, remote_mask;
+	uint16_t i;
+
+	/* the first line, with the ethernet header, was read by the caller */
+	for (i = 0; i < PREFETCH_OFFSET && i < nb_pkts; i++)
+		rte_prefetch0(rte_pktmbuf_mtod_offset(pkts[i], void *,
+				RTE_CACHE_LINE_SIZE));
+	for (i = 0; i < nb_pkts; i++) {
+		if (i + PREFETCH_OFFSET < nb_pkts)
+			rte_prefetch0(rte_pktmbuf_mtod_offset(pkts[i + PREFETCH_OFFSET],
+					void *, RTE_CACHE_LINE_SIZE));
+		tcp_hdrs[i] = NULL;
+		if (latency_enabled)
+			pkts[i]->udata64 = GW_LAT_NONE;
+		eth_hdr = rte_pktmbuf_mtod(pkts[i], struct ether_hdr *);
+		ip6_hdrs[i] = (struct ipv6_hdr *)(eth_hdr + 1);
+		/* extension headers are not walked, such packets pass too */
+		if (ip6_hdrs[i]->proto != IP_PROTO_TCP)
+			continue;
+		stats[GW_STAT_NF_RX_PKTS] += 1;
+		stats[GW_STAT_NF_RX_BYTES] += pkts[i]->data_len;
+		tcp_hdrs[i] = (struct tcp_hdr *)(ip6_hdrs[i] + 1);
+		memcpy(ip_5tuples[i].ip_dst, ip6_hdrs[i]->dst_addr, IPV6_ADDR_LEN);
+		memcpy(ip_5tuples[i].ip_src, ip6_hdrs[i]->src_addr, IPV6_ADDR_LEN);
+		ip_5tuples[i].port_src = rte_be_to_cpu_16(tcp_hdrs[i]->src_port);
+		ip_5tuples[i].port_dst = rte_be_to_cpu_16(tcp_hdrs[i]->dst_port);
+		ip_5tuples[i].proto = IP_PROTO_TCP;
+		convert_ipv6_5tuple(&ip_5tuples[i], &lookup_keys[nb_lookup]);
+		nb_lookup++;
+	}
+
+	hit_mask = getStatesBulk6(lookup_keys, nb_lookup, lookup_states,
+			&remote_mask);
+
+	burst.port = port;
+	burst.nb_pkts = 0;
+	burst.drop_mask = 0;
+	for (i = 0; i < nb_pkts; i++) {
+		struct tcp_hdr *tcp_hdrs_i = tcp_hdrs[i];
+		if (tcp_hdrs_i == NULL) {
+			*tx_bytes += pkts[i]->data_len;
+			tx_pkts[nb_tx++] = pkts[i];
+			continue;
+		}
+		const int hit = (hit_mask & (1ULL << j)) != 0;
+		uint64_t lat_path = (remote_mask & (1ULL << j)) ?
+			GW_LAT_REMOTE : GW_LAT_LOCAL;
+		state = lookup_states[j++];
+
+		if ((tcp_hdrs_i->tcp_flags & TCP_FLAG_SYN) == TCP_FLAG_SYN) {
+			if (hit && !(state->flags & NF_STATE_F_CLOSING)) {
+				state->last_seen = now;
+			}
+			else {
+				struct nf_states *new_state = &new_states[i];
+				memset(new_state, 0, sizeof(*new_state));
+				new_state->last_seen = now;
+				if (nf_chain_flow_init6(new_state, &ip_5tuples[i],
+						tcp_hdrs_i, nf_flow_hash6(pkts[i],
+						&ip_5tuples[i])) < 0) {
+					rte_pktmbuf_free(pkts[i]);
+					stats[GW_STAT_NF_DROPPED_PKTS] ++;
+					continue;
+				}
+				state = setStates6(rte_socket_id(), &ip_5tuples[i],
+						new_state);
+				if (state == NULL)
+					state = new_state;
+				else
+					new_flows[nb_new++] = i;
+				stats[GW_STAT_FLOWS] ++;
+				lat_path = GW_LAT_NEW;
+			}
+		}
+		else {
+			if (!hit) {
+				stats[GW_STAT_STATE_MISSES] ++;
+				/* park it until the backup machine answers */
+				if (nf_pull_park(nf_info, port, 1, &ip_5tuples[i],
+						pkts[i]) == 0)
+					continue;
+				rte_pktmbuf_free(pkts[i]);
+				stats[GW_STAT_MALICIOUS_PKTS] ++;
+				continue;
+			}
+			state->last_seen = now;
+			if (tcp_hdrs_i->tcp_flags & (TCP_FLAG_FIN | TCP_FLAG_RST))
+				state->flags |= NF_STATE_F_CLOSING;
+		}
+
+		if (latency_enabled)
+			pkts[i]->udata64 = lat_path;
+		burst.pkts[burst.nb_pkts] = pkts[i];
+		burst.ip6_hdrs[burst.nb_pkts] = ip6_hdrs[i];
+		burst.tcp_hdrs[burst.nb_pkts] = tcp_hdrs_i;
+		burst.states[burst.nb_pkts] = state;
+		burst.keys6[burst.nb_pkts] = &ip_5tuples[i];
+		burst.nb_pkts++;
+	}
+	nb_tx += nf_chain_run6(&burst, tx_pkts + nb_tx, tx_bytes);
+	nf_request_backups(nf_manager_ring6[nf_info->nf_id], ip_5tuples,
+			sizeof(ip_5tuples[0]), new_flows, nb_new);
+	return nb_tx;
+}
+
 /*
  * gateway network funtions.
  */
@@ -243,8 +1254,13 @@ int
 lcore_nf(/*__attribute__((unused)) void *arg, */const struct nf_inst_info* nf_info)
 {
 	const uint8_t nb_ports = rte_eth_dev_count();
-	struct ipv4_5tuple *ip_5tuple;
+	/* only this core writes its block, so plain increments are enough */
+	struct lcore_stats *ls = &lcore_stats[rte_lcore_id()];
+	uint64_t *stats = ls->c;
 	struct nf_states * state;
+	/* states of the flows a burst opens, until setStates copies them */
+	struct nf_states new_states[BURST_SIZE];
+	uint64_t cur_tsc, drain_tsc = 0;
 	uint8_t port;
 	int i;
 
@@ -256,11 +1272,35 @@ lcore_nf(/*__attribute__((unused)) void *arg, */const struct nf_inst_info* nf_in
 					"polling thread.\n\tPerformance will "
 					"not be optimal.\n NF core id %u\n", port, rte_lcore_id());
 
+	pull_pendings[nf_info->nf_id] = rte_zmalloc_socket("pull_pendings",
+			sizeof(struct pull_pending_table), RTE_CACHE_LINE_SIZE,
+			rte_socket_id());
+	if (pull_pendings[nf_info->nf_id] == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot allocate pull table of nf %u\n",
+				nf_info->nf_id);
+	nf_tx_setup(nf_info);
+	if (syn_cookies) {
+		syn_guards[nf_info->nf_id] = rte_zmalloc_socket("syn_guard",
+				sizeof(struct syn_guard), RTE_CACHE_LINE_SIZE,
+				rte_socket_id());
+		if (syn_guards[nf_info->nf_id] == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot allocate SYN cookies of nf %u\n",
+					nf_info->nf_id);
+		syn_guards[nf_info->nf_id]->secret = (uint32_t)rte_rand();
+		syn_guards[nf_info->nf_id]->last_tsc = rte_rdtsc();
+	}
+
 	printf("\nCore %u processing packets.\n",
 			rte_lcore_id());
 
 	/* Run until the application is quit or killed. */
-	for (;;) {
+	while (!force_quit) {
+		cur_tsc = rte_rdtsc();
+		if (unlikely(cur_tsc - drain_tsc >= NF_TX_DRAIN_CYCLES)) {
+			nf_tx_flush(nf_info);
+			drain_tsc = cur_tsc;
+		}
+		nf_pull_poll(nf_info);
 		for (port = 0; port < nb_ports; port++) {
 			if ((enabled_port_mask & (1 << port)) == 0) {
 				continue;
@@ -270,193 +1310,279 @@ lcore_nf(/*__attribute__((unused)) void *arg, */const struct nf_inst_info* nf_in
 			const uint16_t nb_rx_l = rte_eth_rx_burst(port, nf_info->rx_queue_id,
 					bufs, BURST_SIZE);
 
-            nf_rx[nf_info->nf_id] = nb_rx_l;
+			ls->last_rx_burst = nb_rx_l;
 			if (unlikely(nb_rx_l == 0)){
 				continue;
 			}
+			const uint64_t start_tsc = rte_rdtsc();
 
+			/*
+			 * per-packet parse results: a NULL mbuf was already consumed,
+			 * a NULL tcp header means the packet passes unchanged
+			 */
+			struct ipv4_hdr *ip_hdrs[BURST_SIZE];
+			struct tcp_hdr *tcp_hdrs[BURST_SIZE];
+			struct ipv4_5tuple ip_5tuples[BURST_SIZE];
+			/* keys of the tcp packets, resolved together */
+			union ipv4_5tuple_host lookup_keys[BURST_SIZE];
+			struct nf_states *lookup_states[BURST_SIZE];
+			uint32_t nb_lookup = 0;
+			uint64_t hit_mask, remote_mask;
+			/* packets that survive the burst, passed ones first */
+			struct rte_mbuf *tx_bufs[BURST_SIZE];
+			uint16_t nb_tx = 0;
+			uint64_t tx_bytes = 0;
+			/* packets that opened a flow with a state in the table */
+			uint16_t new_flows[BURST_SIZE];
+			uint16_t nb_new = 0;
+			/* control messages the port did not steer to the manager */
+			struct rte_mbuf *ctrl_bufs[BURST_SIZE];
+			uint16_t nb_ctrl = 0;
+			/* IPv6 packets, see nf_ipv6_burst() */
+			struct rte_mbuf *v6_bufs[BURST_SIZE];
+			uint16_t nb_v6 = 0;
+			const uint32_t now = flow_time_now();
+
+			/*
+			 * The burst is staged: headers are prefetched PREFETCH_OFFSET
+			 * packets ahead of the parsing, which builds the keys of the
+			 * whole burst; the bulk lookup then prefetches their buckets
+			 * and states before the packets are classified and rewritten.
+			 */
+			for (i = 0; i < PREFETCH_OFFSET && i < nb_rx_l; i++)
+				rte_prefetch0(rte_pktmbuf_mtod(bufs[i], void *));
 			for (i = 0; i < nb_rx_l; i ++){
+				if (i + PREFETCH_OFFSET < nb_rx_l)
+					rte_prefetch0(rte_pktmbuf_mtod(bufs[i + PREFETCH_OFFSET],
+							void *));
+				tcp_hdrs[i] = NULL;
+				/* tagged with its path once classified */
+				if (latency_enabled)
+					bufs[i]->udata64 = GW_LAT_NONE;
 				//*************************/
 				/* extract ethernet       */
 				//*************************/
 				// printf("DEBUG...%d\n", bufs[i]->hash.rss);
 				struct ether_hdr *eth_hdr;
 				eth_hdr = rte_pktmbuf_mtod(bufs[i], struct ether_hdr *);
-				struct ether_addr eth_s_addr;
-				eth_s_addr = eth_hdr->s_addr;
-				struct ether_addr eth_d_addr;
-				eth_d_addr = eth_hdr->d_addr;
-
-				//print_ethaddr("eth_s_addr", &eth_s_addr);
-				//print_ethaddr("eth_d_addr", &eth_d_addr);
 
  				if (eth_hdr->ether_type == rte_be_to_cpu_16(ETHER_TYPE_ARP)) {
 					 nf_arp_process(port, eth_hdr, nf_info->tx_queue_id, &bufs[i]);
+					 bufs[i] = NULL;
 					 continue;
   				}
+				if (eth_hdr->ether_type == rte_be_to_cpu_16(ETHER_TYPE_IPv6)) {
+					v6_bufs[nb_v6++] = bufs[i];
+					bufs[i] = NULL;
+					continue;
+				}
+				/* neither IP version, it passes unchanged */
+				if (eth_hdr->ether_type != rte_be_to_cpu_16(ETHER_TYPE_IPv4))
+					continue;
 
 				//*************************/
 				/* extract ip             */
 				//*************************/
 				struct ipv4_hdr *ip_hdr = (struct ipv4_hdr*)((char*)eth_hdr + sizeof(struct ether_hdr));
+				ip_hdrs[i] = ip_hdr;
 
-				struct ipv4_5tuple ip_5tuples;
-				ip_5tuples.ip_dst = rte_be_to_cpu_32(ip_hdr->dst_addr);
-				ip_5tuples.ip_src = rte_be_to_cpu_32(ip_hdr->src_addr);
-				ip_5tuples.proto = ip_hdr->next_proto_id;
+				ip_5tuples[i].ip_dst = rte_be_to_cpu_32(ip_hdr->dst_addr);
+				ip_5tuples[i].ip_src = rte_be_to_cpu_32(ip_hdr->src_addr);
+				ip_5tuples[i].proto = ip_hdr->next_proto_id;
+
+				if ((ip_5tuples[i].ip_dst & CTRL_NET_MASK) == CTRL_NET) {
+					ctrl_bufs[nb_ctrl++] = bufs[i];
+					bufs[i] = NULL;
+					continue;
+				}
 
 				#ifdef __DEBUG_LV2
-				printf("nf: ip_dst is "IPv4_BYTES_FMT " \n", IPv4_BYTES(ip_5tuples.ip_dst));
-				printf("nf: ip_src is "IPv4_BYTES_FMT " \n", IPv4_BYTES(ip_5tuples.ip_src));
-				printf("nf: next_proto_id is %u\n", ip_5tuples.proto);
+				printf("nf: ip_dst is "IPv4_BYTES_FMT " \n", IPv4_BYTES(ip_5tuples[i].ip_dst));
+				printf("nf: ip_src is "IPv4_BYTES_FMT " \n", IPv4_BYTES(ip_5tuples[i].ip_src));
+				printf("nf: next_proto_id is %u\n", ip_5tuples[i].proto);
 				#endif
 
-				switch (ip_5tuples.proto){
+				switch (ip_5tuples[i].proto){
 					case IP_PROTO_UDP:
 					{
 						//*************************/
 						/* extract udp            */
 						//*************************/
 						struct udp_hdr * upd_hdrs = (struct udp_hdr*)((char*)ip_hdr + sizeof(struct ipv4_hdr));
-						ip_5tuples.port_src = rte_be_to_cpu_16(upd_hdrs->src_port);
-						ip_5tuples.port_dst = rte_be_to_cpu_16(upd_hdrs->dst_port);
+						ip_5tuples[i].port_src = rte_be_to_cpu_16(upd_hdrs->src_port);
+						ip_5tuples[i].port_dst = rte_be_to_cpu_16(upd_hdrs->dst_port);
 						printf("nf: udp packets! pass!\n");
 						break;
 					}
 					case IP_PROTO_TCP:
 					{
-						nf_rx_pkts[nf_info->nf_id] += 1;
-						nf_rx_bytes[nf_info->nf_id] += bufs[i]->data_len;
+						stats[GW_STAT_NF_RX_PKTS] += 1;
+						stats[GW_STAT_NF_RX_BYTES] += bufs[i]->data_len;
 						//*************************/
 						/* extract tcp            */
 						//*************************/
-						struct tcp_hdr * tcp_hdrs = (struct tcp_hdr*)((char*)ip_hdr + sizeof(struct ipv4_hdr));
-						ip_5tuples.port_src = rte_be_to_cpu_16(tcp_hdrs->src_port);
-						ip_5tuples.port_dst = rte_be_to_cpu_16(tcp_hdrs->dst_port);
+						struct tcp_hdr * tcp_h = (struct tcp_hdr*)((char*)ip_hdr + sizeof(struct ipv4_hdr));
+						tcp_hdrs[i] = tcp_h;
+						ip_5tuples[i].port_src = rte_be_to_cpu_16(tcp_h->src_port);
+						ip_5tuples[i].port_dst = rte_be_to_cpu_16(tcp_h->dst_port);
 						#ifdef __DEBUG_LV1
-						printf("nf: tcp_flags is %u\n", tcp_hdrs->tcp_flags);
+						printf("nf: tcp_flags is %u\n", tcp_h->tcp_flags);
 						#endif
 
-						// if it's not the start of a flow
-						// getStates
-						if ((tcp_hdrs->tcp_flags & TCP_FLAG_SYN) == TCP_FLAG_SYN) {
-							// SYN or SYN+ACK
-							ip_5tuple = rte_malloc(NULL, sizeof(*ip_5tuple), 0);
-							if (!ip_5tuple)
-								rte_panic("nf: ip_5tuple malloc failed!");
-							ip_5tuple->ip_src = ip_5tuples.ip_src;
-							ip_5tuple->ip_dst = ip_5tuples.ip_dst;
-							ip_5tuple->proto = ip_5tuples.proto;
-							ip_5tuple->port_dst = ip_5tuples.port_dst;
-							ip_5tuple->port_src = ip_5tuples.port_src;
-							state = rte_malloc(NULL, sizeof(*state), 0);
-							if (!state)
-								rte_panic("nf: state malloc failed!");
-						}
-						else {
-							// SYN bit is 0
-							// not SYN nor SYN+ACK
-                            int ret = 1;
-							ret =  getStates(&ip_5tuples, &state, nf_info->hash_table_index);
-							if (ret < 0) {
-								rte_pktmbuf_free(bufs[i]);
-								malicious_packet_counts ++;
-								#ifdef __DEBUG_LV1
-								printf("nf: state not found!%d %d\n",flow_counts ,malicious_packet_counts);
-								#endif
-								continue;
-							}
+						/* an answer of a server to a source NAT flow */
+						if (snat_ip != 0 && ip_5tuples[i].ip_dst == snat_ip) {
+							tcp_hdrs[i] = NULL;
+							if (nf_snat_reverse(bufs[i], ip_hdr, tcp_h) == 0)
+								break;
+							rte_pktmbuf_free(bufs[i]);
+							bufs[i] = NULL;
+							stats[GW_STAT_NF_DROPPED_PKTS] ++;
+							break;
 						}
 
-						// TODO
-						// nf_load_balance();
-						// nf_nat();
-						// nf_stateful_firewall();
-
-
-
-
-
-
-
-
-						if (tcp_hdrs->tcp_flags == 0x12 || tcp_hdrs->tcp_flags == 0x02) {
-							#ifdef __DEBUG_LV1
-							printf("nf: recerive a new flow!\n");
-							#endif
+						// its state is looked up with the rest of the burst,
+						// for a SYN to tell a retransmission from a new flow
+						convert_ipv4_5tuple(&ip_5tuples[i], &lookup_keys[nb_lookup]);
+						nb_lookup++;
+						break;
+					}
+					default:
+					{
+						printf("nf: not tcp and udp packets!\n");
+						rte_pktmbuf_free(bufs[i]);
+						bufs[i] = NULL;
+					}
+				}
+			}
 
+			if (unlikely(nb_ctrl > 0))
+				nf_pass_ctrl(nf_info, ctrl_bufs, nb_ctrl);
 
-							state->ipserver = dip_pool[flow_counts % DIP_POOL_SIZE];
-							setStates(ip_5tuple, state, nf_info->hash_table_index);
+			hit_mask = getStatesBulk(lookup_keys, nb_lookup, lookup_states,
+					&remote_mask);
 
-							ip_hdr->dst_addr = rte_cpu_to_be_32(state->ipserver);
-							ip_hdr->hdr_checksum = 0;
-							ip_hdr->hdr_checksum = rte_ipv4_cksum(ip_hdr);
-							ether_addr_copy(&eth_s_addr,&eth_hdr->d_addr);
-							ether_addr_copy(&eth_d_addr,&eth_hdr->s_addr);
-							#ifdef __DEBUG_LV1
-							printf("nf: tcp_syn new_ip_dst is "IPv4_BYTES_FMT " \n", IPv4_BYTES(rte_be_to_cpu_32(ip_hdr->dst_addr)));
-							#endif
-                            /*
-							if (rte_eth_tx_burst(port, nf_info->tx_queue_id, &bufs[i], 1) != 1){
-								rte_pktmbuf_free(bufs[i]);
-								//printf("nf: error in tx packets\n");
-							}
-							//rte_pktmbuf_free(bufs[i]);
-							nf_tx_pkts[nf_info->nf_id] += 1;
-							nf_tx_bytes[nf_info->nf_id] += bufs[i]->data_len;
-                            */
-							flow_counts ++;
-							//if (flow_counts >= 73000){
-								//rte_exit(EXIT_FAILURE, "this is just a test\n");
-							//}
+			/* the packets with a state go through the nf chain */
+			struct nf_burst burst;
+			burst.port = port;
+			burst.nb_pkts = 0;
+			burst.drop_mask = 0;
 
-						}
-						else{
-							//printf("%x\n", state);
-							//printf("the value of states is %u XXXXXXXXXXXXXXXXXXXXx\n", state->ipserver);
-							// if (ret >= 0){
-								ip_hdr->dst_addr = rte_cpu_to_be_32(state->ipserver);
-								ip_hdr->hdr_checksum = 0;
-								ether_addr_copy(&eth_s_addr,&eth_hdr->d_addr);
-								ether_addr_copy(&eth_d_addr,&eth_hdr->s_addr);
-								ip_hdr->hdr_checksum = rte_ipv4_cksum(ip_hdr);
-								#ifdef __DEBUG_LV1
-								printf("nf: tcp new_ip_dst is "IPv4_BYTES_FMT " \n", IPv4_BYTES(rte_be_to_cpu_32(ip_hdr->dst_addr)));
-								#endif
-                            /*
-								if (rte_eth_tx_burst(port, nf_info->tx_queue_id, &bufs[i], 1) != 1){
-									rte_pktmbuf_free(bufs[i]);
-									//printf("nf: error in tx packets\n");
-								}
-								nf_tx_pkts[nf_info->nf_id] += 1;
-								nf_tx_bytes[nf_info->nf_id] += bufs[i]->data_len;
-                                */
-							// }
+			uint32_t j = 0;
+			for (i = 0; i < nb_rx_l; i ++){
+				if (bufs[i] == NULL)
+					continue;
+				struct tcp_hdr * tcp_hdrs_i = tcp_hdrs[i];
+				if (tcp_hdrs_i == NULL) {
+					tx_bytes += bufs[i]->data_len;
+					tx_bufs[nb_tx++] = bufs[i];
+					continue;
+				}
+				const int hit = (hit_mask & (1ULL << j)) != 0;
+				uint64_t lat_path = (remote_mask & (1ULL << j)) ?
+					GW_LAT_REMOTE : GW_LAT_LOCAL;
+				state = lookup_states[j++];
 
-						}
+				if ((tcp_hdrs_i->tcp_flags & TCP_FLAG_SYN) == TCP_FLAG_SYN) {
+					// SYN or SYN+ACK
+					if (hit && !(state->flags & NF_STATE_F_CLOSING)) {
+						/* retransmitted, the flow keeps its state */
+						state->last_seen = now;
+					}
+					else if (!hit && syn_cookies &&
+							nf_syn_challenge(nf_info, &ip_5tuples[i],
+							bufs[i], ip_hdrs[i], tcp_hdrs_i, now)) {
+						/* answered with a cookie, no state yet */
+						tx_bytes += bufs[i]->data_len;
+						tx_bufs[nb_tx++] = bufs[i];
+						continue;
+					}
+					else {
 						#ifdef __DEBUG_LV1
-						printf("nf: this is very important! port_src and port_dst is %u and %u\n", ip_5tuples.port_src, ip_5tuples.port_dst);
+						printf("nf: recerive a new flow!\n");
 						#endif
-						break;
+						/* a closed flow whose tuple is reused */
+						if (hit)
+							nf_chain_flow_release(state, &ip_5tuples[i]);
+						struct nf_states *new_state = &new_states[i];
+						memset(new_state, 0, sizeof(*new_state));
+						new_state->last_seen = now;
+						if (nf_chain_flow_init(new_state, &ip_5tuples[i],
+								tcp_hdrs_i, nf_flow_hash(bufs[i],
+								&ip_5tuples[i])) < 0) {
+							rte_pktmbuf_free(bufs[i]);
+							stats[GW_STAT_NF_DROPPED_PKTS] ++;
+							continue;
+						}
+						/* the state is copied into the table, no allocation */
+						state = setStates(rte_socket_id(), &ip_5tuples[i],
+								new_state);
+						if (state == NULL) {
+							/* not in the table, nobody would release it */
+							nf_chain_flow_release(new_state,
+									&ip_5tuples[i]);
+							state = new_state;
+						}
+						else
+							new_flows[nb_new++] = i;
+						stats[GW_STAT_FLOWS] ++;
+						lat_path = GW_LAT_NEW;
 					}
-					default:
-					{
-						printf("nf: not tcp and udp packets!\n");
+				}
+				else {
+					// SYN bit is 0
+					// not SYN nor SYN+ACK
+					if (!hit) {
+						/* the client refused our cookie SYN-ACK, as it should */
+						if (syn_cookies &&
+								(tcp_hdrs_i->tcp_flags & TCP_FLAG_RST) &&
+								nf_syn_verify(nf_info, &ip_5tuples[i],
+								tcp_hdrs_i, now) == 0) {
+							rte_pktmbuf_free(bufs[i]);
+							continue;
+						}
+						stats[GW_STAT_STATE_MISSES] ++;
+						/* park it until the backup machine answers */
+						if (nf_pull_park(nf_info, port, 0, &ip_5tuples[i], bufs[i]) == 0)
+							continue;
 						rte_pktmbuf_free(bufs[i]);
+						stats[GW_STAT_MALICIOUS_PKTS] ++;
+						#ifdef __DEBUG_LV1
+						printf("nf: state not found!%"PRIu64" %"PRIu64"\n",
+								stats[GW_STAT_FLOWS],
+								stats[GW_STAT_MALICIOUS_PKTS]);
+						#endif
+						continue;
 					}
+					state->last_seen = now;
+					/* teardown, let the manager age it out soon */
+					if (tcp_hdrs_i->tcp_flags & (TCP_FLAG_FIN | TCP_FLAG_RST))
+						state->flags |= NF_STATE_F_CLOSING;
 				}
-			#ifdef __DEBUG_LV1
-			printf("\n");
-			#endif
+
+				if (latency_enabled)
+					bufs[i]->udata64 = lat_path;
+				burst.pkts[burst.nb_pkts] = bufs[i];
+				burst.ip_hdrs[burst.nb_pkts] = ip_hdrs[i];
+				burst.tcp_hdrs[burst.nb_pkts] = tcp_hdrs_i;
+				burst.states[burst.nb_pkts] = state;
+				burst.keys[burst.nb_pkts] = &ip_5tuples[i];
+				burst.nb_pkts++;
+				#ifdef __DEBUG_LV1
+				printf("nf: this is very important! port_src and port_dst is %u and %u\n", ip_5tuples[i].port_src, ip_5tuples[i].port_dst);
+				printf("\n");
+				#endif
 			}
-            // tx batch
-            //
+			nb_tx += nf_chain_run(&burst, tx_bufs + nb_tx, &tx_bytes);
+			if (nb_v6 > 0)
+				nb_tx += nf_ipv6_burst(nf_info, port, v6_bufs, nb_v6, now,
+						tx_bufs + nb_tx, &tx_bytes);
+			nf_request_backups(nf_manager_ring[nf_info->nf_id], ip_5tuples,
+					sizeof(ip_5tuples[0]), new_flows, nb_new);
 
-			const uint16_t nb_tx_l = rte_eth_tx_burst(port, nf_info->rx_queue_id,
-					bufs, nb_rx_l);
+			nf_tx_send(nf_info, port, tx_bufs, nb_tx, tx_bytes);
+			stats[GW_STAT_NF_CYCLES] += rte_rdtsc() - start_tsc;
 		}
 	}
+	nf_tx_flush(nf_info);
 	return 0;
 }
-
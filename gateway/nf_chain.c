@@ -0,0 +1,704 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_byteorder.h>
+#include <rte_ip.h>
+#include <rte_ether.h>
+#include <rte_common.h>
+#include <rte_tcp.h>
+#include <rte_ring.h>
+#include <rte_atomic.h>
+#include <rte_debug.h>
+
+#include "main.h"
+
+/* drop_mask has one bit per packet of a burst */
+#if BURST_SIZE > 64
+#error "BURST_SIZE must not exceed 64"
+#endif
+
+/* Source NAT allocates ports from here up to 65535 */
+#define SNAT_PORT_MIN 1024
+#define SNAT_PORTS (UINT16_MAX + 1 - SNAT_PORT_MIN)
+
+static const struct nf_stage *nf_chain[NF_CHAIN_MAX];
+static uint8_t nf_chain_len;
+
+/* data address of the gateway the flows are translated to, host order */
+uint32_t snat_ip;
+
+/*
+ * The NAT ports are split between the machines by topo index, and the
+ * part of this machine between its nf cores, so a flow keeps its port
+ * on whichever machine serves it next. setup_snat() sets the layout.
+ */
+static uint32_t snat_machine_base;
+static uint32_t snat_core_ports;
+
+/*
+ * Ports of this machine in use. An entry is only written by the nf core
+ * whose slice it is in: the other cores and the manager hand the ports
+ * they release to it through its ring, which it drains before it
+ * allocates.
+ */
+static uint8_t snat_port_used[UINT16_MAX + 1];
+static uint32_t snat_cursor[NF_CORE_MAX];
+static struct rte_ring *snat_free_rings[NF_CORE_MAX];
+
+/*
+ * Reverse translation, by NAT port: the server answers to snat_ip and the
+ * port of the flow, the entry gives back the client and the address the
+ * client sent to. RSS may hand the answers to another nf core than the
+ * flow's, and ECMP to another machine, so every machine has the entries
+ * of every flow (CTRL_FMT_SNAT). server_ip is written last and 0 marks a
+ * free entry, the release that clears it with a compare and set is the
+ * one that frees the port. Host order.
+ */
+struct snat_rev {
+	uint32_t client_ip;
+	uint32_t vip;
+	uint16_t client_port;
+	uint16_t server_port;
+	uint32_t server_ip;
+};
+static struct snat_rev snat_revs[UINT16_MAX + 1];
+
+/*
+ * Update a checksum for a 32-bit field changing from old_val to new_val,
+ * HC' = ~(~HC + ~m + m') as in RFC 1624. The one's complement sum does
+ * not depend on byte order, so all values stay in network order.
+ */
+static inline uint16_t
+cksum_update32(uint16_t cksum, uint32_t old_val, uint32_t new_val)
+{
+	uint32_t sum = (uint16_t)~cksum;
+
+	sum += (uint16_t)~(old_val >> 16) + (uint16_t)~(old_val & 0xffff);
+	sum += (new_val >> 16) + (new_val & 0xffff);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+static inline uint16_t
+cksum_update16(uint16_t cksum, uint16_t old_val, uint16_t new_val)
+{
+	uint32_t sum = (uint16_t)~cksum;
+
+	sum += (uint16_t)~old_val + new_val;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/*
+ * Header rewrites of the stages, values in network order. The checksums
+ * are patched here unless the port offloads them, then nf_chain_run
+ * fills them once for the final headers.
+ */
+static inline void
+nf_set_dst(const struct nf_burst *b, uint16_t i, uint32_t addr)
+{
+	struct ipv4_hdr *ip_hdr = b->ip_hdrs[i];
+
+	if (port_tx_cksum_flags[b->port] == 0) {
+		/* the address is in both the ip header and the pseudo header */
+		ip_hdr->hdr_checksum = cksum_update32(ip_hdr->hdr_checksum,
+				ip_hdr->dst_addr, addr);
+		b->tcp_hdrs[i]->cksum = cksum_update32(b->tcp_hdrs[i]->cksum,
+				ip_hdr->dst_addr, addr);
+	}
+	ip_hdr->dst_addr = addr;
+}
+
+/*
+ * nf_set_dst() of an IPv6 packet. IPv6 has no header checksum and the
+ * IPv4 offloads of the port do not apply, the tcp checksum is always
+ * patched here.
+ */
+static inline void
+nf_set_dst6(const struct nf_burst *b, uint16_t i, const uint8_t *addr)
+{
+	struct ipv6_hdr *ip6_hdr = b->ip6_hdrs[i];
+	struct tcp_hdr *tcp_h = b->tcp_hdrs[i];
+	uint32_t old_val, new_val;
+	unsigned k;
+
+	for (k = 0; k < IPV6_ADDR_LEN; k += sizeof(uint32_t)) {
+		memcpy(&old_val, &ip6_hdr->dst_addr[k], sizeof(old_val));
+		memcpy(&new_val, &addr[k], sizeof(new_val));
+		tcp_h->cksum = cksum_update32(tcp_h->cksum, old_val, new_val);
+	}
+	memcpy(ip6_hdr->dst_addr, addr, IPV6_ADDR_LEN);
+}
+
+/* bounce the packet out of the port it came from */
+static inline void
+nf_swap_eth(struct rte_mbuf *m)
+{
+	struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(m, struct ether_hdr *);
+	struct ether_addr eth_addr;
+
+	ether_addr_copy(&eth_hdr->s_addr, &eth_addr);
+	ether_addr_copy(&eth_hdr->d_addr, &eth_hdr->s_addr);
+	ether_addr_copy(&eth_addr, &eth_hdr->d_addr);
+}
+
+static inline void
+nf_set_src(const struct nf_burst *b, uint16_t i, uint32_t addr,
+	uint16_t port)
+{
+	struct ipv4_hdr *ip_hdr = b->ip_hdrs[i];
+	struct tcp_hdr *tcp_h = b->tcp_hdrs[i];
+
+	if (port_tx_cksum_flags[b->port] == 0) {
+		ip_hdr->hdr_checksum = cksum_update32(ip_hdr->hdr_checksum,
+				ip_hdr->src_addr, addr);
+		tcp_h->cksum = cksum_update32(tcp_h->cksum,
+				ip_hdr->src_addr, addr);
+		tcp_h->cksum = cksum_update16(tcp_h->cksum,
+				tcp_h->src_port, port);
+	}
+	ip_hdr->src_addr = addr;
+	tcp_h->src_port = port;
+}
+
+//*************************/
+/* load balancer           */
+//*************************/
+static int
+lb_flow_init(struct nf_states *state,
+	__attribute__((unused)) const struct ipv4_5tuple *key,
+	__attribute__((unused)) const struct tcp_hdr *tcp_h, uint32_t hash)
+{
+	state->ipserver = maglev_lookup(hash);
+	return 0;
+}
+
+static void
+lb_burst(struct nf_burst *b)
+{
+	uint16_t i;
+
+	for (i = 0; i < b->nb_pkts; i++) {
+		if (b->drop_mask & (1ULL << i))
+			continue;
+		nf_set_dst(b, i, rte_cpu_to_be_32(b->states[i]->ipserver));
+		#ifdef __DEBUG_LV1
+		printf("nf: tcp new_ip_dst is "IPv4_BYTES_FMT " \n",
+				IPv4_BYTES(b->states[i]->ipserver));
+		#endif
+	}
+}
+
+static int
+lb_flow_init6(struct nf_states *state,
+	__attribute__((unused)) const struct ipv6_5tuple *key,
+	__attribute__((unused)) const struct tcp_hdr *tcp_h, uint32_t hash)
+{
+	if (maglev_table6 != NULL)
+		state->ipserver = maglev_lookup6(hash);
+	return 0;
+}
+
+static void
+lb_burst6(struct nf_burst *b)
+{
+	uint32_t backend;
+	uint16_t i;
+
+	for (i = 0; i < b->nb_pkts; i++) {
+		if (b->drop_mask & (1ULL << i))
+			continue;
+		/* LB_BACKEND6_KEEP, or a state from before the list shrank */
+		backend = b->states[i]->ipserver;
+		if (backend == 0 || backend > nb_lb_backends6_conf)
+			continue;
+		nf_set_dst6(b, i, lb_backends6_conf[backend - 1].ip);
+	}
+}
+
+//*************************/
+/* source NAT              */
+//*************************/
+/* nf core whose slice has port, -1 for a port of another machine */
+static inline int
+snat_port_owner(uint16_t port)
+{
+	uint32_t nf_id;
+
+	if (port < snat_machine_base)
+		return -1;
+	nf_id = (port - snat_machine_base) / snat_core_ports;
+	return nf_id < nb_nf_cores ? (int)nf_id : -1;
+}
+
+static inline int
+snat_rev_match(const struct snat_rev *rev, const struct ipv4_5tuple *key)
+{
+	return rev->client_ip == key->ip_src && rev->vip == key->ip_dst &&
+		rev->client_port == key->port_src &&
+		rev->server_port == key->port_dst;
+}
+
+static void
+snat_rev_set(uint16_t port, const struct ipv4_5tuple *key, uint32_t server_ip)
+{
+	struct snat_rev *rev = &snat_revs[port];
+
+	rev->client_ip = key->ip_src;
+	rev->vip = key->ip_dst;
+	rev->client_port = key->port_src;
+	rev->server_port = key->port_dst;
+	rte_smp_wmb();
+	rev->server_ip = server_ip;
+}
+
+/* Take back the ports the other cores and the manager released */
+static void
+snat_reclaim(int16_t nf_id)
+{
+	void *ports[BURST_SIZE];
+	unsigned n, k;
+
+	n = rte_ring_sc_dequeue_burst(snat_free_rings[nf_id], ports,
+			BURST_SIZE, NULL);
+	for (k = 0; k < n; k++)
+		snat_port_used[(uintptr_t)ports[k]] = 0;
+}
+
+/* Give the flow a free port of the nf core's slice, and its reverse entry */
+static int
+snat_alloc(struct nf_states *state, const struct ipv4_5tuple *key)
+{
+	const int16_t nf_id = lcore_nf_map[rte_lcore_id()];
+	const uint32_t base = snat_machine_base + nf_id * snat_core_ports;
+	uint32_t n, port;
+
+	snat_reclaim(nf_id);
+	for (n = 0; n < snat_core_ports; n++) {
+		port = base + snat_cursor[nf_id];
+		if (++snat_cursor[nf_id] == snat_core_ports)
+			snat_cursor[nf_id] = 0;
+		if (snat_port_used[port] == 0) {
+			snat_port_used[port] = 1;
+			snat_rev_set(port, key, state->ipserver);
+			state->dip = snat_ip;
+			state->dport = port;
+			return 0;
+		}
+	}
+	#ifdef __DEBUG_LV1
+	printf("nf: no source NAT port left!\n");
+	#endif
+	return -1;
+}
+
+/* lb runs first (see nf_chain_parse), ipserver is the flow's server */
+static int
+snat_flow_init(struct nf_states *state, const struct ipv4_5tuple *key,
+	__attribute__((unused)) const struct tcp_hdr *tcp_h,
+	__attribute__((unused)) uint32_t hash)
+{
+	return snat_alloc(state, key);
+}
+
+/*
+ * Enter the reverse translation of a flow served by any machine, from
+ * its CTRL_FMT_SNAT record.
+ */
+void
+nf_snat_install(const struct ipv4_5tuple *key, uint32_t server_ip,
+	uint16_t port)
+{
+	if (port >= SNAT_PORT_MIN && server_ip != 0)
+		snat_rev_set(port, key, server_ip);
+}
+
+/*
+ * The flow key left port: clear its reverse entry, and if the port is of
+ * this machine hand it to the nf core of its slice. The entry is cleared
+ * before the port is queued, so the core cannot give the port again
+ * while the old entry is still seen, and only the release that clears it
+ * queues the port: the nf cores, the manager's aging and the releases of
+ * other machines may race for the same flow. Nothing is done if the
+ * entry is already another flow's.
+ */
+void
+nf_snat_release(const struct ipv4_5tuple *key, uint16_t port)
+{
+	struct snat_rev *rev = &snat_revs[port];
+	const uint32_t server_ip = rev->server_ip;
+	int owner;
+
+	rte_smp_rmb();
+	if (server_ip == 0 || !snat_rev_match(rev, key) ||
+			!rte_atomic32_cmpset((volatile uint32_t *)&rev->server_ip,
+			server_ip, 0))
+		return;
+	owner = snat_port_owner(port);
+	if (owner >= 0 && rte_ring_mp_enqueue(snat_free_rings[owner],
+			(void *)(uintptr_t)port) < 0)
+		printf("nf: source NAT port %u lost\n", port);
+}
+
+static void
+snat_flow_release(const struct nf_states *state, const struct ipv4_5tuple *key)
+{
+	if (state->dip == snat_ip && state->dport >= SNAT_PORT_MIN)
+		nf_snat_release(key, state->dport);
+}
+
+/* Before the lcores run: the slices have no other writer yet */
+static void
+snat_flow_restore(const struct nf_states *state, const struct ipv4_5tuple *key)
+{
+	if (state->dip != snat_ip || state->dport < SNAT_PORT_MIN)
+		return;
+	if (snat_port_owner(state->dport) >= 0)
+		snat_port_used[state->dport] = 1;
+	snat_rev_set(state->dport, key, state->ipserver);
+}
+
+/*
+ * A state pulled or migrated from another machine keeps the port it got
+ * there: the port is unique in the gateway and every machine translates
+ * its answers back, so the connection goes on.
+ */
+static void
+snat_burst(struct nf_burst *b)
+{
+	struct nf_states *state;
+	uint16_t i;
+
+	for (i = 0; i < b->nb_pkts; i++) {
+		if (b->drop_mask & (1ULL << i))
+			continue;
+		state = b->states[i];
+		/* flows opened before snat was in the chain keep their source */
+		if (state->dport == 0)
+			continue;
+		nf_set_src(b, i, rte_cpu_to_be_32(state->dip),
+				rte_cpu_to_be_16(state->dport));
+	}
+}
+
+/*
+ * Lay out the NAT ports of the machines and the nf cores and create the
+ * rings of released ports. Called before the state tables are restored.
+ */
+void
+setup_snat(void)
+{
+	char name[RTE_RING_NAMESIZE];
+	const uint32_t machine_ports = SNAT_PORTS / n_machines;
+	uint16_t i;
+
+	snat_machine_base = SNAT_PORT_MIN + this_machine_index * machine_ports;
+	snat_core_ports = machine_ports / nb_nf_cores;
+	for (i = 0; i < nb_nf_cores; i++) {
+		snprintf(name, sizeof(name), "SNAT_FREE_RING_%u", i);
+		snat_free_rings[i] = rte_ring_create(name,
+				rte_align32pow2(snat_core_ports + 1),
+				rte_lcore_to_socket_id(nf_insts[i].lcore_id),
+				RING_F_SC_DEQ);
+		if (snat_free_rings[i] == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot create ring of snat ports\n");
+	}
+	printf("snat: ports %u-%u of "IPv4_BYTES_FMT", %u per nf core\n",
+			snat_machine_base, snat_machine_base + machine_ports - 1,
+			IPv4_BYTES(snat_ip), snat_core_ports);
+}
+
+/*
+ * Translate back an answer of a server to snat_ip: the destination
+ * becomes the client and the source the address the client sent to.
+ * The checksums are patched in place, whatever the port offloads, and
+ * the packet is bounced like the nf chain does. Returns -1 if no flow
+ * has the NAT port or the packet is not from its server.
+ */
+int
+nf_snat_reverse(struct rte_mbuf *m, struct ipv4_hdr *ip_hdr,
+	struct tcp_hdr *tcp_h)
+{
+	const uint16_t port = rte_be_to_cpu_16(tcp_h->dst_port);
+	const struct snat_rev *rev = &snat_revs[port];
+	const uint32_t server_ip = rev->server_ip;
+	uint32_t addr;
+	uint16_t cport;
+
+	rte_smp_rmb();
+	if (server_ip == 0 || port < SNAT_PORT_MIN ||
+			server_ip != rte_be_to_cpu_32(ip_hdr->src_addr) ||
+			rev->server_port != rte_be_to_cpu_16(tcp_h->src_port))
+		return -1;
+
+	addr = rte_cpu_to_be_32(rev->vip);
+	ip_hdr->hdr_checksum = cksum_update32(ip_hdr->hdr_checksum,
+			ip_hdr->src_addr, addr);
+	tcp_h->cksum = cksum_update32(tcp_h->cksum, ip_hdr->src_addr, addr);
+	ip_hdr->src_addr = addr;
+
+	addr = rte_cpu_to_be_32(rev->client_ip);
+	ip_hdr->hdr_checksum = cksum_update32(ip_hdr->hdr_checksum,
+			ip_hdr->dst_addr, addr);
+	tcp_h->cksum = cksum_update32(tcp_h->cksum, ip_hdr->dst_addr, addr);
+	ip_hdr->dst_addr = addr;
+
+	cport = rte_cpu_to_be_16(rev->client_port);
+	tcp_h->cksum = cksum_update16(tcp_h->cksum, tcp_h->dst_port, cport);
+	tcp_h->dst_port = cport;
+
+	nf_swap_eth(m);
+	return 0;
+}
+
+//*************************/
+/* stateful firewall       */
+//*************************/
+static int
+fw_flow_init(struct nf_states *state,
+	__attribute__((unused)) const struct ipv4_5tuple *key,
+	const struct tcp_hdr *tcp_h, __attribute__((unused)) uint32_t hash)
+{
+	/* only a plain SYN of the client opens a flow */
+	if ((tcp_h->tcp_flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_FIN |
+			TCP_FLAG_RST)) != TCP_FLAG_SYN)
+		return -1;
+	state->fw_state = NF_FW_SYN_SENT;
+	return 0;
+}
+
+static int
+fw_flow_init6(struct nf_states *state,
+	__attribute__((unused)) const struct ipv6_5tuple *key,
+	const struct tcp_hdr *tcp_h, uint32_t hash)
+{
+	return fw_flow_init(state, NULL, tcp_h, hash);
+}
+
+/* the same for both IP versions, it only reads the tcp headers */
+static void
+fw_burst(struct nf_burst *b)
+{
+	struct nf_states *state;
+	uint16_t i;
+	uint8_t flags;
+
+	for (i = 0; i < b->nb_pkts; i++) {
+		if (b->drop_mask & (1ULL << i))
+			continue;
+		state = b->states[i];
+		flags = b->tcp_hdrs[i]->tcp_flags & (TCP_FLAG_SYN | TCP_FLAG_ACK |
+				TCP_FLAG_FIN | TCP_FLAG_RST);
+		if (flags & TCP_FLAG_RST) {
+			if (flags & TCP_FLAG_SYN)
+				b->drop_mask |= 1ULL << i;
+			else
+				state->fw_state = NF_FW_CLOSING;
+		}
+		else if (flags & TCP_FLAG_SYN) {
+			/* only retransmissions of the opening SYN */
+			if (flags != TCP_FLAG_SYN || state->fw_state != NF_FW_SYN_SENT)
+				b->drop_mask |= 1ULL << i;
+		}
+		else if ((flags & TCP_FLAG_ACK) == 0) {
+			/* null scans and FINs without ACK */
+			b->drop_mask |= 1ULL << i;
+		}
+		else if (flags & TCP_FLAG_FIN) {
+			state->fw_state = NF_FW_CLOSING;
+		}
+		else if (state->fw_state != NF_FW_CLOSING) {
+			/* untracked flows (fw_state 0) are picked up here too */
+			state->fw_state = NF_FW_ESTABLISHED;
+		}
+	}
+}
+
+/* snat translates to an IPv4 address, IPv6 flows keep their source */
+static const struct nf_stage nf_stages[] = {
+	{ "lb", lb_flow_init, NULL, NULL, lb_burst, lb_flow_init6, lb_burst6 },
+	{ "snat", snat_flow_init, snat_flow_release, snat_flow_restore, snat_burst,
+		NULL, NULL },
+	{ "fw", fw_flow_init, NULL, NULL, fw_burst, fw_flow_init6, fw_burst },
+};
+
+/*
+ * Compose the chain from a comma separated list of stage names, in the
+ * order the stages run. Returns -1 on an unknown or repeated stage, or
+ * on lb after snat: the reverse entry of snat records the server.
+ */
+int
+nf_chain_parse(const char *list)
+{
+	char buf[128];
+	char *name, *save = NULL;
+	unsigned s, k;
+
+	if (strlen(list) >= sizeof(buf))
+		return -1;
+	strcpy(buf, list);
+	nf_chain_len = 0;
+	for (name = strtok_r(buf, ",", &save); name != NULL;
+			name = strtok_r(NULL, ",", &save)) {
+		for (s = 0; s < RTE_DIM(nf_stages); s++)
+			if (strcmp(name, nf_stages[s].name) == 0)
+				break;
+		if (s == RTE_DIM(nf_stages) || nf_chain_len == NF_CHAIN_MAX)
+			return -1;
+		for (k = 0; k < nf_chain_len; k++)
+			if (nf_chain[k] == &nf_stages[s] ||
+					(nf_stages[s].flow_init == lb_flow_init &&
+					nf_chain[k]->flow_init == snat_flow_init))
+				return -1;
+		nf_chain[nf_chain_len++] = &nf_stages[s];
+	}
+	return nf_chain_len > 0 ? 0 : -1;
+}
+
+/* Whether the chain has the stage name */
+int
+nf_chain_has(const char *name)
+{
+	uint8_t s;
+
+	for (s = 0; s < nf_chain_len; s++)
+		if (strcmp(nf_chain[s]->name, name) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Set up the state of a new flow. Without a load balancer the flow keeps
+ * its destination. If a stage refuses the flow the stages before it
+ * release what they took.
+ */
+int
+nf_chain_flow_init(struct nf_states *state, const struct ipv4_5tuple *key,
+	const struct tcp_hdr *tcp_h, uint32_t hash)
+{
+	int s, k;
+
+	state->ipserver = key->ip_dst;
+	for (s = 0; s < nf_chain_len; s++) {
+		if (nf_chain[s]->flow_init(state, key, tcp_h, hash) < 0) {
+			for (k = s - 1; k >= 0; k--)
+				if (nf_chain[k]->flow_release != NULL)
+					nf_chain[k]->flow_release(state, key);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void
+nf_chain_flow_release(const struct nf_states *state,
+	const struct ipv4_5tuple *key)
+{
+	uint8_t s;
+
+	for (s = 0; s < nf_chain_len; s++)
+		if (nf_chain[s]->flow_release != NULL)
+			nf_chain[s]->flow_release(state, key);
+}
+
+void
+nf_chain_flow_restore(const struct nf_states *state,
+	const struct ipv4_5tuple *key)
+{
+	uint8_t s;
+
+	for (s = 0; s < nf_chain_len; s++)
+		if (nf_chain[s]->flow_restore != NULL)
+			nf_chain[s]->flow_restore(state, key);
+}
+
+/*
+ * Run the stages over a burst, then bounce the packets they kept back out
+ * of the port they came from. The dropped ones are freed; returns the
+ * number of packets put in tx_pkts and adds their bytes to tx_bytes.
+ */
+uint16_t
+nf_chain_run(struct nf_burst *b, struct rte_mbuf **tx_pkts, uint64_t *tx_bytes)
+{
+	const uint64_t ol_flags = port_tx_cksum_flags[b->port];
+	struct rte_mbuf *m;
+	uint16_t i, nb_tx = 0;
+	uint8_t s;
+
+	for (s = 0; s < nf_chain_len; s++)
+		nf_chain[s]->burst(b);
+
+	for (i = 0; i < b->nb_pkts; i++) {
+		m = b->pkts[i];
+		if (b->drop_mask & (1ULL << i)) {
+			rte_pktmbuf_free(m);
+			continue;
+		}
+		nf_swap_eth(m);
+		if (ol_flags != 0) {
+			/* the NIC wants the pseudo header sum in the tcp checksum */
+			m->l2_len = sizeof(struct ether_hdr);
+			m->l3_len = (b->ip_hdrs[i]->version_ihl & IPV4_HDR_IHL_MASK) *
+				IPV4_IHL_MULTIPLIER;
+			m->ol_flags |= ol_flags;
+			b->ip_hdrs[i]->hdr_checksum = 0;
+			b->tcp_hdrs[i]->cksum = rte_ipv4_phdr_cksum(b->ip_hdrs[i],
+					m->ol_flags);
+		}
+		*tx_bytes += m->data_len;
+		tx_pkts[nb_tx++] = m;
+	}
+	lcore_stat_add(GW_STAT_NF_DROPPED_PKTS, b->nb_pkts - nb_tx);
+	return nb_tx;
+}
+
+/*
+ * nf_chain_flow_init() of an IPv6 flow, for the stages with IPv6 hooks.
+ * These hold nothing a refused flow would have to release.
+ */
+int
+nf_chain_flow_init6(struct nf_states *state, const struct ipv6_5tuple *key,
+	const struct tcp_hdr *tcp_h, uint32_t hash)
+{
+	uint8_t s;
+
+	state->ipserver = LB_BACKEND6_KEEP;
+	for (s = 0; s < nf_chain_len; s++)
+		if (nf_chain[s]->flow_init6 != NULL &&
+				nf_chain[s]->flow_init6(state, key, tcp_h, hash) < 0)
+			return -1;
+	return 0;
+}
+
+/* nf_chain_run() of an IPv6 burst, without the checksum offloads */
+uint16_t
+nf_chain_run6(struct nf_burst *b, struct rte_mbuf **tx_pkts, uint64_t *tx_bytes)
+{
+	struct rte_mbuf *m;
+	uint16_t i, nb_tx = 0;
+	uint8_t s;
+
+	for (s = 0; s < nf_chain_len; s++)
+		if (nf_chain[s]->burst6 != NULL)
+			nf_chain[s]->burst6(b);
+
+	for (i = 0; i < b->nb_pkts; i++) {
+		m = b->pkts[i];
+		if (b->drop_mask & (1ULL << i)) {
+			rte_pktmbuf_free(m);
+			continue;
+		}
+		nf_swap_eth(m);
+		*tx_bytes += m->data_len;
+		tx_pkts[nb_tx++] = m;
+	}
+	lcore_stat_add(GW_STAT_NF_DROPPED_PKTS, b->nb_pkts - nb_tx);
+	return nb_tx;
+}
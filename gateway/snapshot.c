@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_tcp.h>
+#include <rte_cycles.h>
+#include <rte_lcore.h>
+#include <rte_hash.h>
+#include <rte_common.h>
+#include <rte_debug.h>
+
+#include "main.h"
+
+/*
+ * Warm restart. With --snapshot FILE the state and index tables are
+ * written to FILE when the gateway stops and inserted back in bulk when
+ * it starts again, before any packet is received, so the flows it served
+ * keep their states instead of being pulled from their backups.
+ *
+ * The file is a sequence of sections, each a snapshot_section followed
+ * by count records of record_size bytes, ended by a SNAPSHOT_END
+ * section. A record size that does not match this build rejects the
+ * file. The EFD index table cannot be walked and is not saved.
+ */
+
+char *snapshot_path;
+
+#define SNAPSHOT_MAGIC 0x47575331 /* "GWS1" */
+
+enum snapshot_kind {
+    SNAPSHOT_STATES,  /* states_5tuple_pair of one socket */
+    SNAPSHOT_STATES6, /* states_5tuple6_pair of one socket */
+    SNAPSHOT_INDEXS,  /* indexs_5tuple_pair */
+    SNAPSHOT_INDEXS6, /* indexs_5tuple6_pair */
+    SNAPSHOT_END
+};
+
+struct snapshot_section {
+    uint32_t magic;
+    uint16_t kind;
+    uint16_t socket;
+    uint32_t record_size;
+    uint32_t count;
+};
+
+static const uint32_t snapshot_record_sizes[SNAPSHOT_END] = {
+    [SNAPSHOT_STATES] = sizeof(struct states_5tuple_pair),
+    [SNAPSHOT_STATES6] = sizeof(struct states_5tuple6_pair),
+    [SNAPSHOT_INDEXS] = sizeof(struct indexs_5tuple_pair),
+    [SNAPSHOT_INDEXS6] = sizeof(struct indexs_5tuple6_pair),
+};
+
+/*
+ * Write a section header, its count is patched once the records are
+ * written. Returns the offset of the header, <0 on error.
+ */
+static long
+snapshot_section_begin(FILE *f, uint16_t kind, uint16_t socket)
+{
+    struct snapshot_section sec = {
+        .magic = SNAPSHOT_MAGIC,
+        .kind = kind,
+        .socket = socket,
+        .record_size = kind < SNAPSHOT_END ? snapshot_record_sizes[kind] : 0,
+        .count = 0,
+    };
+    long off = ftell(f);
+
+    if (off < 0 || fwrite(&sec, sizeof(sec), 1, f) != 1)
+        return -1;
+    return off;
+}
+
+static int
+snapshot_section_end(FILE *f, long off, uint32_t count)
+{
+    const long end = ftell(f);
+
+    if (end < 0 ||
+        fseek(f, off + offsetof(struct snapshot_section, count), SEEK_SET) < 0 ||
+        fwrite(&count, sizeof(count), 1, f) != 1 ||
+        fseek(f, end, SEEK_SET) < 0)
+        return -1;
+    return 0;
+}
+
+/* Write the records of a state table, or of an index table if indexs */
+static int
+snapshot_write_table(FILE *f, uint16_t kind, uint16_t socket,
+                     const struct rte_hash *hash, const struct nf_states *states,
+                     const struct nf_indexs *indexs, uint64_t *nb_records)
+{
+    struct states_5tuple_pair pair;
+    struct states_5tuple6_pair pair6;
+    struct indexs_5tuple_pair ipair;
+    struct indexs_5tuple6_pair ipair6;
+    const void *key, *rec;
+    void *data;
+    uint32_t next = 0, count = 0;
+    int32_t pos;
+    long off;
+
+    off = snapshot_section_begin(f, kind, socket);
+    if (off < 0)
+        return -1;
+    while ((pos = rte_hash_iterate(hash, &key, &data, &next)) >= 0) {
+        switch (kind) {
+        case SNAPSHOT_STATES:
+            if (states[pos].ipserver == 0)
+                continue;
+            convert_ipv4_5tuple_host(key, &pair.l4_5tuple);
+            pair.states = states[pos];
+            rec = &pair;
+            break;
+        case SNAPSHOT_STATES6:
+            if (states[pos].ipserver == 0)
+                continue;
+            convert_ipv6_5tuple_host(key, &pair6.l4_5tuple);
+            pair6.states = states[pos];
+            rec = &pair6;
+            break;
+        case SNAPSHOT_INDEXS:
+            if (indexs[pos].backupip[0] == 0)
+                continue;
+            convert_ipv4_5tuple_host(key, &ipair.l4_5tuple);
+            ipair.indexs = indexs[pos];
+            rec = &ipair;
+            break;
+        default:
+            if (indexs[pos].backupip[0] == 0)
+                continue;
+            convert_ipv6_5tuple_host(key, &ipair6.l4_5tuple);
+            ipair6.indexs = indexs[pos];
+            rec = &ipair6;
+            break;
+        }
+        if (fwrite(rec, snapshot_record_sizes[kind], 1, f) != 1)
+            return -1;
+        count++;
+    }
+    *nb_records += count;
+    return snapshot_section_end(f, off, count);
+}
+
+/*
+ * Write the tables to snapshot_path, through a temporary file renamed
+ * over it, so a crash while saving leaves the previous snapshot. Called
+ * once every lcore returned.
+ */
+void
+snapshot_save(void)
+{
+    char tmp[PATH_MAX];
+    uint64_t nb_records = 0;
+    const uint64_t start_tsc = rte_rdtsc();
+    unsigned socket;
+    FILE *f;
+    int ret = 0;
+
+    if (snapshot_path == NULL)
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot_path);
+    f = fopen(tmp, "wb");
+    if (f == NULL) {
+        printf("Cannot write snapshot %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    for (socket = 0; socket < NB_SOCKETS && ret == 0; socket++) {
+        if (state_tables[socket].hash != NULL)
+            ret = snapshot_write_table(f, SNAPSHOT_STATES, socket,
+                                       state_tables[socket].hash,
+                                       state_tables[socket].states, NULL,
+                                       &nb_records);
+        if (ret == 0 && state_tables6[socket].hash != NULL)
+            ret = snapshot_write_table(f, SNAPSHOT_STATES6, socket,
+                                       state_tables6[socket].hash,
+                                       state_tables6[socket].states, NULL,
+                                       &nb_records);
+    }
+#ifndef INDEX_TABLE_EFD
+    if (ret == 0)
+        ret = snapshot_write_table(f, SNAPSHOT_INDEXS, 0, index_hash_table,
+                                   NULL, flow_indexs, &nb_records);
+#endif
+    if (ret == 0)
+        ret = snapshot_write_table(f, SNAPSHOT_INDEXS6, 0, index_hash_table6,
+                                   NULL, flow_indexs6, &nb_records);
+    if (ret == 0 && snapshot_section_begin(f, SNAPSHOT_END, 0) < 0)
+        ret = -1;
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret < 0 || rename(tmp, snapshot_path) < 0) {
+        printf("Cannot write snapshot %s: %s\n", snapshot_path,
+               strerror(errno));
+        remove(tmp);
+        return;
+    }
+    printf("Saved %"PRIu64" records to %s in %"PRIu64" ms\n", nb_records,
+           snapshot_path,
+           (rte_rdtsc() - start_tsc) * 1000 / rte_get_tsc_hz());
+}
+
+/* Insert a batch of up to BURST_SIZE IPv4 states, like backups */
+static unsigned
+snapshot_load_states(unsigned socket, struct states_5tuple_pair *pairs,
+                     unsigned nb)
+{
+    struct ipv4_5tuple *keys[BURST_SIZE];
+    struct nf_states states[BURST_SIZE];
+    const uint32_t now = flow_time_now();
+    unsigned k;
+
+    for (k = 0; k < nb; k++) {
+        keys[k] = &pairs[k].l4_5tuple;
+        states[k] = pairs[k].states;
+        /* flow times are not kept across runs, aging starts over */
+        states[k].last_seen = now;
+        nf_chain_flow_restore(&states[k], keys[k]);
+    }
+    return setStatesBulk(socket, keys, states, nb);
+}
+
+/* Read the records of one section and insert them */
+static int
+snapshot_load_section(FILE *f, const struct snapshot_section *sec,
+                      unsigned socket, uint64_t *nb_records)
+{
+    union {
+        struct states_5tuple_pair states[BURST_SIZE];
+        struct states_5tuple6_pair states6[BURST_SIZE];
+        struct indexs_5tuple_pair indexs[BURST_SIZE];
+        struct indexs_5tuple6_pair indexs6[BURST_SIZE];
+    } recs;
+    const uint32_t now = flow_time_now();
+    uint32_t left = sec->count;
+    unsigned nb, k, nb_set;
+
+    while (left > 0) {
+        nb = RTE_MIN(left, (uint32_t)BURST_SIZE);
+        if (fread(&recs, sec->record_size, nb, f) != nb)
+            return -1;
+        left -= nb;
+        switch (sec->kind) {
+        case SNAPSHOT_STATES:
+            nb_set = snapshot_load_states(socket, recs.states, nb);
+            break;
+        case SNAPSHOT_STATES6:
+            for (k = 0, nb_set = 0; k < nb; k++) {
+                recs.states6[k].states.last_seen = now;
+                if (setStates6(socket, &recs.states6[k].l4_5tuple,
+                               &recs.states6[k].states) != NULL)
+                    nb_set++;
+            }
+            break;
+        case SNAPSHOT_INDEXS:
+            for (k = 0; k < nb; k++)
+                setIndexs(&recs.indexs[k].l4_5tuple, &recs.indexs[k].indexs);
+            nb_set = nb;
+            break;
+        default:
+            for (k = 0; k < nb; k++)
+                setIndexs6(&recs.indexs6[k].l4_5tuple,
+                           &recs.indexs6[k].indexs);
+            nb_set = nb;
+            break;
+        }
+        if (nb_set < nb)
+            printf("Snapshot: table full, %u records dropped\n", nb - nb_set);
+        *nb_records += nb_set;
+    }
+    return 0;
+}
+
+/*
+ * Fill the tables from snapshot_path, after they are created and before
+ * the lcores are launched. States of a socket without a table now go to
+ * the table of default_socket. A missing file starts with empty tables.
+ */
+void
+snapshot_load(unsigned default_socket)
+{
+    struct snapshot_section sec;
+    uint64_t nb_records = 0;
+    const uint64_t start_tsc = rte_rdtsc();
+    unsigned socket;
+    FILE *f;
+
+    if (snapshot_path == NULL)
+        return;
+    f = fopen(snapshot_path, "rb");
+    if (f == NULL) {
+        printf("No snapshot %s, starting with empty tables\n", snapshot_path);
+        return;
+    }
+    for (;;) {
+        if (fread(&sec, sizeof(sec), 1, f) != 1 ||
+            sec.magic != SNAPSHOT_MAGIC || sec.kind > SNAPSHOT_END ||
+            (sec.kind < SNAPSHOT_END &&
+             sec.record_size != snapshot_record_sizes[sec.kind])) {
+            printf("Snapshot %s is not from this gateway build,"
+                   " the rest of it is ignored\n", snapshot_path);
+            break;
+        }
+        if (sec.kind == SNAPSHOT_END)
+            break;
+        socket = sec.socket;
+        if (socket >= NB_SOCKETS ||
+            (sec.kind == SNAPSHOT_STATES && state_tables[socket].hash == NULL) ||
+            (sec.kind == SNAPSHOT_STATES6 && state_tables6[socket].hash == NULL))
+            socket = default_socket;
+        if (snapshot_load_section(f, &sec, socket, &nb_records) < 0) {
+            printf("Snapshot %s is truncated\n", snapshot_path);
+            break;
+        }
+    }
+    fclose(f);
+    printf("Restored %"PRIu64" records from %s in %"PRIu64" ms\n",
+           nb_records, snapshot_path,
+           (rte_rdtsc() - start_tsc) * 1000 / rte_get_tsc_hz());
+}